@@ -172,7 +172,12 @@ static void alexa_handle_wemo_request(int client_sock, uint8_t relay_id, const c
             ESP_LOGI(ALEXA_TAG, "SetBinaryState: relay %d -> %s",
                      relay_id, new_state ? "ON" : "OFF");
 
-            relay_set(relay_id, new_state);
+            if (!relay_set(relay_id, new_state)) {
+                // Relays busy: let Alexa report the device as not responding
+                const char* busy = "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+                send(client_sock, busy, strlen(busy), 0);
+                return;
+            }
             body_len = snprintf(body, sizeof(body), SOAP_SET_STATE_RESPONSE, new_state);
         }
         // GetBinaryState
@@ -0,0 +1,69 @@
+/**
+ * @file boot_profile.h
+ * @brief Boot stage timestamps
+ *
+ * Each stage records the esp_timer time (µs since the timer started, shortly
+ * after reset) the first time it is reached. The milestones users notice after
+ * a power cut are BOOT_FIRST_RF_CONTROL and BOOT_FIRST_NET_COMMAND.
+ */
+
+#ifndef BOOT_PROFILE_H
+#define BOOT_PROFILE_H
+
+#include <stdint.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define BOOT_TAG "BOOT"
+
+typedef enum {
+    BOOT_APP_MAIN = 0,        // app_main entered
+    BOOT_RELAYS_EARLY,        // outputs restored from RTC memory (warm reset only)
+    BOOT_NVS,                 // NVS ready
+    BOOT_WIFI_STARTED,        // association started
+    BOOT_CONFIG,              // relay config and groups loaded
+    BOOT_RELAYS,              // relays restored and owner task running
+    BOOT_RF,                  // RF receiver and decode task running
+    BOOT_TASKS,               // all tasks created
+    BOOT_SERVER_LISTENING,    // binary protocol sockets bound
+    BOOT_GOT_IP,              // WiFi associated and IP assigned
+    BOOT_FIRST_RF_CONTROL,    // first relay switched by a remote
+    BOOT_FIRST_NET_COMMAND,   // first request answered over the network
+    BOOT_STAGE_COUNT
+} boot_stage_t;
+
+static const char* const boot_stage_names[BOOT_STAGE_COUNT] = {
+    "app_main", "relays_early", "nvs", "wifi_started", "config", "relays",
+    "rf", "tasks", "server_listening", "got_ip", "first_rf_control", "first_net_command",
+};
+
+static uint32_t boot_stage_us[BOOT_STAGE_COUNT];  // 0 = not reached
+
+/**
+ * @brief Record a stage (only the first time it is reached)
+ */
+void boot_mark(boot_stage_t stage) {
+    if (boot_stage_us[stage] != 0) {
+        return;
+    }
+
+    uint32_t now = esp_timer_get_time();
+    boot_stage_us[stage] = now ? now : 1;
+    ESP_LOGI(BOOT_TAG, "%s at %u ms", boot_stage_names[stage], now / 1000);
+}
+
+/**
+ * @brief Time a stage was reached in µs, 0 if it hasn't been
+ */
+uint32_t boot_get_stage_us(boot_stage_t stage) {
+    return boot_stage_us[stage];
+}
+
+/**
+ * @brief Name of a stage for logs and diagnostics
+ */
+const char* boot_get_stage_name(boot_stage_t stage) {
+    return boot_stage_names[stage];
+}
+
+#endif // BOOT_PROFILE_H
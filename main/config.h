@@ -14,9 +14,10 @@ static const char* TAG = "switch-2";
 static const mdns_txt_item_t mdns_txt[] = {
     {"type", "switch"},
     {"relays", "4"},
-    {"proto", "v2"},
+    {"proto", "v3"},
     {"fw", "1.1.0"},
     {"alexa", "yes"},
+    {"udp", "3736"},
 };
 
 /**
@@ -26,11 +27,51 @@ static const mdns_txt_item_t mdns_txt[] = {
 #define WIFI_SSID ""
 #define WIFI_PASS ""
 
+/*
+ * Reconnect straight to the last access point (channel + BSSID cached in NVS)
+ * instead of scanning; after WIFI_FAST_CONNECT_ATTEMPTS failed tries the full
+ * scan is used again.
+ */
+#define WIFI_FAST_CONNECT 1
+#define WIFI_FAST_CONNECT_ATTEMPTS 2
+
+/*
+ * Reuse the cached DHCP lease as a static IP on directed connects (skips
+ * DHCP). Only enable when the router reserves the address for this device.
+ */
+#define WIFI_STATIC_IP_FROM_CACHE 0
+
+/*
+ * Power-save profile used until one is chosen via PUT /api/wifi/power
+ * (see wifi_power_profile_t in wifi.h):
+ * - WIFI_PROFILE_PERFORMANCE: radio always on, lowest command latency
+ * - WIFI_PROFILE_BALANCED: modem sleep, wakes for every DTIM beacon (SDK default)
+ * - WIFI_PROFILE_LOW_POWER: deeper modem sleep, wakes every WIFI_LOW_POWER_LISTEN_INTERVAL beacons
+ */
+#define WIFI_POWER_PROFILE_DEFAULT WIFI_PROFILE_BALANCED
+#define WIFI_LOW_POWER_LISTEN_INTERVAL 10
+
 /*
  * Port on which TCP server will run
  */
 #define RELAY_PORT 3736
 
+/*
+ * Port for the connectionless (UDP) variant of the binary protocol
+ */
+#define RELAY_UDP_PORT 3736
+
+/*
+ * Multicast address and port for group commands sent to many devices at once
+ */
+#define RELAY_GROUP_MULTICAST_ADDR "239.255.37.36"
+#define RELAY_GROUP_PORT 3737
+
+/*
+ * Port streaming raw RF pulse durations to one client (see rf_capture.h)
+ */
+#define RF_CAPTURE_PORT 3738
+
 /**
  * GPIO pin number for relays in order
  *
@@ -88,4 +129,11 @@ static const uint8_t relays[] = {4, 14, 12, 13};
  */
 #define RF_HOLD_TIMEOUT_MS 500
 
+/**
+ * RF Glitch Filter
+ * Pulses shorter than this (µs) are dropped in the receive interrupt as noise.
+ * Keep it well below the shortest pulse of the remotes in use (EV1527: ~320 µs)
+ */
+#define RF_MIN_PULSE_US 100
+
 #endif /* CONFIG_H */
\ No newline at end of file
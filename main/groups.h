@@ -0,0 +1,76 @@
+/**
+ * @file groups.h
+ * @brief Multicast group membership for fleet-wide commands
+ *
+ * A device can be a member of up to 16 groups (IDs 0-15). Group commands are
+ * sent as a single datagram to RELAY_GROUP_MULTICAST_ADDR and applied by every
+ * member. Group ID RELAY_GROUP_ALL addresses all devices.
+ */
+
+#ifndef GROUPS_H
+#define GROUPS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include "persist.h"
+
+#define GROUPS_TAG "GROUPS"
+#define NVS_KEY_GROUPS "groups"
+
+#define RELAY_GROUP_MAX 16
+#define RELAY_GROUP_ALL 0xFF
+
+// Bit n set = member of group n
+static uint16_t group_membership = 0;
+static int groups_persist_id = -1;
+
+/**
+ * @brief Load group membership from NVS (call after pairing_init)
+ */
+void groups_load(void) {
+    groups_persist_id = persist_register(NVS_KEY_GROUPS, &group_membership, sizeof(group_membership), PERSIST_BLOB, 0, 0);
+
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return;
+    }
+
+    size_t size = sizeof(group_membership);
+    if (nvs_get_blob(nvs_handle, NVS_KEY_GROUPS, &group_membership, &size) == ESP_OK) {
+        ESP_LOGI(GROUPS_TAG, "Group membership: 0x%04X", group_membership);
+    }
+    nvs_close(nvs_handle);
+}
+
+/**
+ * @brief Replace the group membership mask and persist it
+ */
+bool groups_set_membership(uint16_t mask) {
+    group_membership = mask;
+    persist_mark_dirty(groups_persist_id);
+
+    ESP_LOGI(GROUPS_TAG, "Group membership set to 0x%04X", mask);
+    return true;
+}
+
+/**
+ * @brief Get the group membership mask
+ */
+uint16_t groups_get_membership(void) {
+    return group_membership;
+}
+
+/**
+ * @brief Check whether a group command addresses this device
+ */
+bool groups_is_member(uint8_t group_id) {
+    if (group_id == RELAY_GROUP_ALL) {
+        return true;
+    }
+    return group_id < RELAY_GROUP_MAX && (group_membership & (1 << group_id));
+}
+
+#endif // GROUPS_H
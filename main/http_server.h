@@ -9,12 +9,17 @@
  * - POST /api/relay/{id}/toggle - Toggle relay
  * - PUT /api/relay/{id}/name - Rename relay (body: new name)
  * - PUT /api/relay/{id}/room - Set room (body: room name)
+ * - GET /api/wifi/power - Current WiFi power-save profile
+ * - PUT /api/wifi/power - Select profile (body: performance, balanced or low_power); clears latency histograms
+ * - GET /api/diag - Runtime counters (relay actuation, journal wear, NVS writes, RF loss, WiFi connects, command latency, gateway round trips, boot timing)
  * - GET / - Serve web interface
  */
 
 #ifndef HTTP_SERVER_H
 #define HTTP_SERVER_H
 
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "config.h"
@@ -23,22 +28,37 @@
 #include "wifi.h"
 #include "relays.h"
 #include "relay_config.h"
+#include "persist.h"
+#include "rf.h"
+#include "rf_capture.h"
+#include "boot_profile.h"
+#include "latency.h"
 
 #define HTTP_PORT 80
 #define HTTP_TAG "HTTP"
 #define HTTP_RECV_BUF_SIZE 512
 #define HTTP_SEND_BUF_SIZE 1024
+#define HTTP_CHUNK_SIZE 512  // large bodies (/api/diag) are streamed through this much RAM
 
 // Simple HTTP response helpers
 static const char* HTTP_200 = "HTTP/1.1 200 OK\r\n";
 static const char* HTTP_204 = "HTTP/1.1 204 No Content\r\n";
 static const char* HTTP_400 = "HTTP/1.1 400 Bad Request\r\n";
 static const char* HTTP_404 = "HTTP/1.1 404 Not Found\r\n";
+static const char* HTTP_503 = "HTTP/1.1 503 Service Unavailable\r\n";
 static const char* CONTENT_JSON = "Content-Type: application/json\r\n";
 static const char* CONTENT_HTML = "Content-Type: text/html\r\n";
 static const char* CORS_HEADERS = "Access-Control-Allow-Origin: *\r\nAccess-Control-Allow-Methods: GET, POST, PUT, OPTIONS\r\nAccess-Control-Allow-Headers: Content-Type\r\n";
 static const char* CONN_CLOSE = "Connection: close\r\n\r\n";
 
+// A response body streamed in chunks; without Content-Length it ends when the connection closes
+typedef struct {
+    int sock;
+    int len;
+    bool failed;  // a send failed, the rest is dropped
+    char buf[HTTP_CHUNK_SIZE];
+} http_out_t;
+
 /**
  * @brief Build JSON status response
  */
@@ -81,6 +101,185 @@ static int http_build_relay_json(char* buf, size_t buf_size, uint8_t relay_id) {
         cfg->alexa_enabled ? "true" : "false");
 }
 
+/**
+ * @brief Send what is buffered
+ */
+static void http_out_flush(http_out_t* out) {
+    if (out->len > 0 && !out->failed && send(out->sock, out->buf, out->len, 0) < 0) {
+        out->failed = true;
+    }
+    out->len = 0;
+}
+
+/**
+ * @brief Append formatted text, sending the buffer first when it does not fit
+ */
+static void http_out_printf(http_out_t* out, const char* fmt, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t space = sizeof(out->buf) - out->len;
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(out->buf + out->len, space, fmt, args);
+        va_end(args);
+
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < space) {
+            out->len += n;
+            return;
+        }
+        if (out->len == 0) {
+            // A single piece longer than the whole buffer: send what fitted
+            ESP_LOGW(HTTP_TAG, "Response piece of %d bytes truncated", n);
+            out->len = sizeof(out->buf) - 1;
+            return;
+        }
+        http_out_flush(out);  // the partial write past len is overwritten on the retry
+    }
+}
+
+/**
+ * @brief Write the diagnostics JSON response body
+ */
+static void http_write_diag_json(http_out_t* out) {
+    relay_stats_t stats;
+    relays_get_stats(&stats);
+
+    http_out_printf(out,
+        "{\"relays\":{\"commands\":%u,\"batches\":%u,\"max_batch\":%u,\"queue_full\":%u,"
+        "\"apply_us_avg\":%u,\"apply_us_max\":%u}",
+        (unsigned)stats.commands,
+        (unsigned)stats.batches,
+        (unsigned)stats.max_batch,
+        (unsigned)stats.queue_full,
+        (unsigned)(stats.batches ? stats.apply_us_total / stats.batches : 0),
+        (unsigned)stats.apply_us_max);
+
+    if (journal_available()) {
+        journal_stats_t js;
+        journal_get_stats(&js);
+        http_out_printf(out,
+            ",\"journal\":{\"active\":%u,\"used\":%u,\"capacity\":%u,\"appends\":%u,\"compactions\":%u,"
+            "\"write_errors\":%u,\"degraded\":%s,\"compact_failures\":%u,\"retry_in_ms\":%u,\"erases\":[%u,%u]}",
+            js.active,
+            (unsigned)js.used,
+            (unsigned)JOURNAL_RECORDS_PER_SECTOR,
+            (unsigned)js.appends,
+            (unsigned)js.compactions,
+            (unsigned)js.write_errors,
+            js.degraded ? "true" : "false",
+            (unsigned)js.compact_failures,
+            (unsigned)journal_retry_wait_ms(),
+            (unsigned)js.erase_count[0],
+            (unsigned)js.erase_count[1]);
+    }
+
+    persist_stats_t ps;
+    persist_get_stats(&ps);
+    http_out_printf(out,
+        ",\"persist\":{\"flushes\":%u,\"keys_written\":%u,\"flush_us_last\":%u,\"flush_us_max\":%u,"
+        "\"deferred\":%u,\"forced\":%u,\"keys\":{",
+        (unsigned)ps.flushes,
+        (unsigned)ps.keys_written,
+        (unsigned)ps.flush_us_last,
+        (unsigned)ps.flush_us_max,
+        (unsigned)ps.deferred,
+        (unsigned)ps.forced);
+
+    for (int i = 0; i < persist_get_region_count(); i++) {
+        const persist_region_t* r = persist_get_region(i);
+        http_out_printf(out,
+            "%s\"%s\":{\"writes\":%u,\"errors\":%u,\"dirty\":%s}",
+            i > 0 ? "," : "",
+            r->key,
+            (unsigned)r->writes,
+            (unsigned)r->errors,
+            r->dirty ? "true" : "false");
+    }
+
+    http_out_printf(out, "}}");
+
+    rf_stats_t rs;
+    rf_get_stats(&rs);
+    http_out_printf(out,
+        ",\"rf\":{\"frames\":%u,\"broken_frames\":%u,\"overflows\":%u,\"lost_during_flash\":%u,"
+        "\"rejected_spikes\":%u,\"buffer_high_water\":%u,\"buffer_size\":%u,\"learn_rejected\":%u}",
+        (unsigned)rs.frames,
+        (unsigned)rs.broken_frames,
+        (unsigned)rs.overflows,
+        (unsigned)rs.lost_during_flash,
+        (unsigned)rs.rejected_spikes,
+        (unsigned)rs.buffer_high_water,
+        (unsigned)rs.buffer_size,
+        (unsigned)rs.learn_rejected);
+
+    rf_capture_stats_t cs;
+    rf_capture_get_stats(&cs);
+    http_out_printf(out,
+        ",\"rf_capture\":{\"connected\":%s,\"clients\":%u,\"rejected\":%u,\"packets\":%u,\"timings\":%u,"
+        "\"tap_drops\":%u,\"send_stalls\":%u}",
+        cs.connected ? "true" : "false",
+        (unsigned)cs.clients,
+        (unsigned)cs.rejected,
+        (unsigned)cs.packets,
+        (unsigned)cs.timings,
+        (unsigned)cs.tap_drops,
+        (unsigned)cs.send_stalls);
+
+    wifi_stats_t ws;
+    wifi_get_stats(&ws);
+    http_out_printf(out,
+        ",\"wifi\":{\"connects\":%u,\"fast_connects\":%u,\"fallbacks\":%u,\"disconnects\":%u,"
+        "\"connect_ms_last\":%u,\"connect_ms_max\":%u,\"last_fast\":%s,\"cached_channel\":%u,"
+        "\"power_profile\":\"%s\"}",
+        (unsigned)ws.connects,
+        (unsigned)ws.fast_connects,
+        (unsigned)ws.fallbacks,
+        (unsigned)ws.disconnects,
+        (unsigned)ws.connect_ms_last,
+        (unsigned)ws.connect_ms_max,
+        ws.last_fast ? "true" : "false",
+        wifi_cache_valid() ? wifi_cache.channel : 0,
+        wifi_profile_names[wifi_get_power_profile()]);
+
+    // Bucket b counts requests below latency_bounds_us[b]; the last one takes the rest
+    http_out_printf(out, ",\"latency\":{\"bounds_us\":[");
+    for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+        http_out_printf(out, "%s%u", b > 0 ? "," : "", (unsigned)latency_bounds_us[b]);
+    }
+    http_out_printf(out, "]");
+    for (int s = 0; s < LATENCY_SOURCE_COUNT; s++) {
+        latency_hist_t h;
+        latency_get((latency_source_t)s, &h);
+        uint32_t n = 0;
+        http_out_printf(out, ",\"%s\":{\"counts\":[", latency_source_names[s]);
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            http_out_printf(out, "%s%u", b > 0 ? "," : "", (unsigned)h.count[b]);
+            n += h.count[b];
+        }
+        http_out_printf(out, "],\"avg_us\":%u,\"max_us\":%u",
+                           (unsigned)(n ? h.total_us / n : 0), (unsigned)h.max_us);
+        if (s == LATENCY_GATEWAY) {
+            http_out_printf(out, ",\"lost\":%u", (unsigned)h.lost);
+        }
+        http_out_printf(out, "}");
+    }
+    http_out_printf(out, "}");
+
+    // Stage times in ms since boot; stages not reached yet are left out
+    http_out_printf(out, ",\"boot\":{\"reset_reason\":%d",
+                       (int)esp_reset_reason());
+    for (int i = 0; i < BOOT_STAGE_COUNT; i++) {
+        uint32_t us = boot_get_stage_us((boot_stage_t)i);
+        if (us != 0) {
+            http_out_printf(out, ",\"%s\":%u",
+                               boot_get_stage_name((boot_stage_t)i), (unsigned)(us / 1000));
+        }
+    }
+    http_out_printf(out, "}}");
+}
+
 /**
  * @brief Embedded web interface HTML
  */
@@ -202,6 +401,18 @@ static int http_extract_relay_id(const char* path) {
     return id;
 }
 
+/**
+ * @brief Relay command queue full: nothing was changed, the client may retry
+ */
+static void http_send_busy(int client_sock) {
+    char send_buf[384];
+    const char* busy = "{\"error\":\"Busy\"}";
+    int send_len = snprintf(send_buf, sizeof(send_buf),
+        "%s%s%sRetry-After: 1\r\nContent-Length: %d\r\n%s%s",
+        HTTP_503, CONTENT_JSON, CORS_HEADERS, (int)strlen(busy), CONN_CLOSE, busy);
+    send(client_sock, send_buf, send_len, 0);
+}
+
 /**
  * @brief Handle HTTP request
  */
@@ -221,6 +432,10 @@ static void http_handle_request(int client_sock, const char* recv_buf) {
 
     ESP_LOGI(HTTP_TAG, "%s %s", method, path);
 
+    if (strncmp(path, "/api/", 5) == 0) {
+        boot_mark(BOOT_FIRST_NET_COMMAND);
+    }
+
     // Handle CORS preflight
     if (strcmp(method, "OPTIONS") == 0) {
         send_len = snprintf(send_buf, sizeof(send_buf), "%s%s%s", HTTP_204, CORS_HEADERS, CONN_CLOSE);
@@ -250,11 +465,57 @@ static void http_handle_request(int client_sock, const char* recv_buf) {
         return;
     }
 
+    // GET /api/diag - Runtime counters
+    if (strcmp(method, "GET") == 0 && strcmp(path, "/api/diag") == 0) {
+        // Streamed: its length grows with the counters, so it is not built in one buffer
+        static http_out_t out;
+        out.sock = client_sock;
+        out.len = 0;
+        out.failed = false;
+
+        http_out_printf(&out, "%s%s%s%s", HTTP_200, CONTENT_JSON, CORS_HEADERS, CONN_CLOSE);
+        http_write_diag_json(&out);
+        http_out_flush(&out);
+        return;
+    }
+
+    // GET /api/wifi/power - Current power-save profile
+    if (strcmp(method, "GET") == 0 && strcmp(path, "/api/wifi/power") == 0) {
+        char json_buf[48];
+        int json_len = snprintf(json_buf, sizeof(json_buf), "{\"profile\":\"%s\"}",
+                                wifi_profile_names[wifi_get_power_profile()]);
+        send_len = snprintf(send_buf, sizeof(send_buf),
+            "%s%s%sContent-Length: %d\r\n%s%s",
+            HTTP_200, CONTENT_JSON, CORS_HEADERS, json_len, CONN_CLOSE, json_buf);
+        send(client_sock, send_buf, send_len, 0);
+        return;
+    }
+
+    // PUT /api/wifi/power - Select power-save profile
+    if (strcmp(method, "PUT") == 0 && strcmp(path, "/api/wifi/power") == 0) {
+        int profile = wifi_power_profile_from_name(body);
+        if (profile >= 0) {
+            wifi_set_power_profile((wifi_power_profile_t)profile);
+            latency_reset();  // histograms describe one profile at a time
+            char json_buf[48];
+            int json_len = snprintf(json_buf, sizeof(json_buf), "{\"profile\":\"%s\"}",
+                                    wifi_profile_names[profile]);
+            send_len = snprintf(send_buf, sizeof(send_buf),
+                "%s%s%sContent-Length: %d\r\n%s%s",
+                HTTP_200, CONTENT_JSON, CORS_HEADERS, json_len, CONN_CLOSE, json_buf);
+            send(client_sock, send_buf, send_len, 0);
+            return;
+        }
+    }
+
     // POST /api/relay/{id}/on
     if (strcmp(method, "POST") == 0 && strstr(path, "/on")) {
         int id = http_extract_relay_id(path);
         if (id >= 0) {
-            relay_set(id, 1);
+            if (!relay_set(id, 1)) {
+                http_send_busy(client_sock);
+                return;
+            }
             char json_buf[128];
             int json_len = http_build_relay_json(json_buf, sizeof(json_buf), id);
             send_len = snprintf(send_buf, sizeof(send_buf),
@@ -269,7 +530,10 @@ static void http_handle_request(int client_sock, const char* recv_buf) {
     if (strcmp(method, "POST") == 0 && strstr(path, "/off")) {
         int id = http_extract_relay_id(path);
         if (id >= 0) {
-            relay_set(id, 0);
+            if (!relay_set(id, 0)) {
+                http_send_busy(client_sock);
+                return;
+            }
             char json_buf[128];
             int json_len = http_build_relay_json(json_buf, sizeof(json_buf), id);
             send_len = snprintf(send_buf, sizeof(send_buf),
@@ -284,7 +548,10 @@ static void http_handle_request(int client_sock, const char* recv_buf) {
     if (strcmp(method, "POST") == 0 && strstr(path, "/toggle")) {
         int id = http_extract_relay_id(path);
         if (id >= 0) {
-            relay_set(id, !relay_get(id));
+            if (!relay_toggle(id)) {
+                http_send_busy(client_sock);
+                return;
+            }
             char json_buf[128];
             int json_len = http_build_relay_json(json_buf, sizeof(json_buf), id);
             send_len = snprintf(send_buf, sizeof(send_buf),
@@ -358,7 +625,7 @@ void http_server_task(void* pvParameters) {
     int listen_sock, client_sock;
     char recv_buf[HTTP_RECV_BUF_SIZE];
 
-    xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, false, true, portMAX_DELAY);
+    // Bound to INADDR_ANY, so there is no need to wait for an IP
     ESP_LOGI(HTTP_TAG, "Starting HTTP server on port %d", HTTP_PORT);
 
     listen_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -407,7 +674,9 @@ void http_server_task(void* pvParameters) {
         int len = recv(client_sock, recv_buf, sizeof(recv_buf) - 1, 0);
 
         if (len > 0) {
+            int64_t start = esp_timer_get_time();
             http_handle_request(client_sock, recv_buf);
+            latency_record(LATENCY_HTTP, esp_timer_get_time() - start);
         }
 
         close(client_sock);
@@ -0,0 +1,88 @@
+/**
+ * @file latency.h
+ * @brief Command latency histograms
+ *
+ * Each transport records how long a request took on the device, from the
+ * moment it was read off the socket until the reply was handed to lwIP
+ * (relay actuation included). Counts are kept in fixed log-spaced buckets so
+ * recording is a few comparisons and histograms from different devices or
+ * power-save profiles can be compared bucket by bucket.
+ *
+ * Time spent in the air, including the AP holding frames until a sleeping
+ * station wakes up, is not visible in those. The "gateway" histogram covers
+ * it: the relay server pings the gateway periodically and records the round
+ * trips, with unanswered pings counted as lost. Histograms are cleared when
+ * the power-save profile changes, so they always describe the current one.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <string.h>
+
+typedef enum {
+    LATENCY_TCP = 0,
+    LATENCY_UDP,
+    LATENCY_GROUP,
+    LATENCY_HTTP,
+    LATENCY_GATEWAY,  // round trips to the gateway, not requests
+    LATENCY_SOURCE_COUNT
+} latency_source_t;
+
+#define LATENCY_BUCKETS 10
+
+// Upper bound (exclusive, µs) of every bucket but the last, which takes the rest
+static const uint32_t latency_bounds_us[LATENCY_BUCKETS - 1] = {
+    500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000,
+};
+
+static const char* const latency_source_names[LATENCY_SOURCE_COUNT] = {"tcp", "udp", "group", "http", "gateway"};
+
+typedef struct {
+    uint32_t count[LATENCY_BUCKETS];
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t lost;  // round trips that never completed
+} latency_hist_t;
+
+static latency_hist_t latency_hists[LATENCY_SOURCE_COUNT];
+
+/**
+ * @brief Add one request to a transport's histogram
+ */
+void latency_record(latency_source_t source, uint32_t us) {
+    latency_hist_t* h = &latency_hists[source];
+    int b = 0;
+    while (b < LATENCY_BUCKETS - 1 && us >= latency_bounds_us[b]) {
+        b++;
+    }
+    h->count[b]++;
+    h->total_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+/**
+ * @brief Count a round trip that timed out
+ */
+void latency_record_lost(latency_source_t source) {
+    latency_hists[source].lost++;
+}
+
+/**
+ * @brief Copy of one transport's histogram
+ */
+void latency_get(latency_source_t source, latency_hist_t* out) {
+    *out = latency_hists[source];
+}
+
+/**
+ * @brief Clear all histograms (e.g. after switching power-save profile)
+ */
+void latency_reset(void) {
+    memset(latency_hists, 0, sizeof(latency_hists));
+}
+
+#endif // LATENCY_H
@@ -1,9 +1,11 @@
 #include "esp_log.h"
+#include "boot_profile.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/gpio.h"
 #include "nvs_flash.h"
 #include "rf.h"
+#include "rf_capture.h"
 #include "server.h"
 #include "relays.h"
 #include "pairing.h"
@@ -12,6 +14,8 @@
 #include "relay_config.h"
 #include "http_server.h"
 #include "alexa.h"
+#include "groups.h"
+#include "persist.h"
 
 // Pairing button monitoring task
 void pairing_button_task(void *pvParameters) {
@@ -60,13 +64,19 @@ void pairing_button_task(void *pvParameters) {
 void led_task(void *pvParameters) {
     while (1) {
         status_led_update();
-        relays_check_save();         // Periodically save relay states if dirty
-        relay_config_check_save();   // Periodically save relay config if dirty
+        persist_service();           // Write pending NVS changes in one batch
         vTaskDelay(pdMS_TO_TICKS(100));
     }
 }
 
 void app_main(void) {
+    boot_mark(BOOT_APP_MAIN);
+
+    // After a watchdog/soft reset, put the relays back before anything slow runs
+    if (relays_early_restore()) {
+        boot_mark(BOOT_RELAYS_EARLY);
+    }
+
     ESP_LOGI(TAG, "Starting relay controller");
     
     // Initialize status LED first
@@ -75,15 +85,27 @@ void app_main(void) {
     
     // Initialize NVS and pairing
     pairing_init();
+    boot_mark(BOOT_NVS);
+
+    // WiFi only needs NVS: start associating now so it overlaps the rest of the boot
+    ESP_LOGI(TAG, "ESP8266 WiFi + Web Server starting...");
+    wifi_init_sta();
+    boot_mark(BOOT_WIFI_STARTED);
 
     // Load relay configuration (names, rooms, etc.)
     relay_config_load();
+    groups_load();
+    boot_mark(BOOT_CONFIG);
 
-    // Initialize relays (will restore saved states)
+    // Initialize relays (will restore saved states) and hand them to their owner task
     relays_init();
+    relays_start();
+    boot_mark(BOOT_RELAYS);
     
-    // Initialize RF receiver
+    // Remotes work as soon as the decode task runs, without waiting for the network
     rf_receiver_init();
+    xTaskCreate(rf_decode_task, "rf_task", 2048, NULL, 6, NULL);
+    boot_mark(BOOT_RF);
     
     // Set LED status based on pairing state
     if (pairing_is_paired()) {
@@ -92,26 +114,17 @@ void app_main(void) {
         status_led_set(LED_STATUS_UNPAIRED);
     }
     
-    ESP_LOGI(TAG, "ESP8266 WiFi + Web Server starting...");
-    
-    // Initialize WiFi
-    wifi_init_sta();
-    
-    // WiFi connected, set normal status if paired
-    if (pairing_is_paired()) {
-        status_led_set(LED_STATUS_NORMAL);
-    }
-    
-    // Start tasks
+    // Start tasks; the servers bind right away and start answering once an IP arrives
     xTaskCreate(relay_server_task, "binary_server", 4096, NULL, 5, NULL);
     xTaskCreate(http_server_task, "http_server", 4096, NULL, 5, NULL);
+    xTaskCreate(rf_capture_task, "rf_capture", 2048, NULL, 4, NULL);
     xTaskCreate(mdns_task, "mdns_task", 2048, NULL, 5, NULL);
-    xTaskCreate(rf_decode_task, "rf_task", 2048, NULL, 6, NULL);
     xTaskCreate(pairing_button_task, "pairing_task", 2048, NULL, 4, NULL);
     xTaskCreate(led_task, "led_task", 1024, NULL, 3, NULL);
 
     // Initialize Alexa support (starts its own tasks)
     alexa_init();
+    boot_mark(BOOT_TASKS);
 
     ESP_LOGI(TAG, "All tasks started");
     ESP_LOGI(TAG, "Web interface: http://%s.local/", MDNS_HOSTNAME);
@@ -12,29 +12,74 @@
 #include "nvs.h"
 #include "esp_log.h"
 #include "config.h"
+#include "persist.h"
 
 #define PAIRING_TAG "PAIRING"
-#define NVS_NAMESPACE "relay_ctrl"
-#define NVS_KEY_RF_ADDR "rf_address"
+#define NVS_KEY_RF_ADDR "rf_addr32"
+#define NVS_KEY_RF_ADDR_LEGACY "rf_address"  // "0101..." string written by older firmware
 #define NVS_KEY_RELAY_STATE "relay_state"
 
+// EV1527 addresses are 20 bits, but a learned protocol can decode this one, so it is refused when pairing
+#define PAIRING_NO_ADDRESS 0xFFFFFFFF
+
 // Pairing state
 typedef struct {
     bool is_paired;
-    char rf_address[21];  // 20-bit address as string + null terminator
+    uint32_t rf_address;  // 20-bit EV1527 address
     bool pairing_mode_active;
     uint32_t pairing_mode_start_time;
 } pairing_state_t;
 
 static pairing_state_t pairing_state = {
     .is_paired = false,
-    .rf_address = {0},
+    .rf_address = PAIRING_NO_ADDRESS,
     .pairing_mode_active = false,
     .pairing_mode_start_time = 0
 };
 
 #define PAIRING_MODE_TIMEOUT_MS 30000  // 30 seconds
 
+static int pairing_persist_id = -1;
+
+/**
+ * @brief Convert an address saved as a bit string by older firmware
+ *
+ * The integer copy is committed before the string is erased, so a reset
+ * in between only repeats the migration.
+ */
+static void pairing_migrate_legacy_address(void) {
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return;
+    }
+
+    char legacy[21] = {0};
+    size_t required_size = sizeof(legacy);
+    if (nvs_get_str(nvs_handle, NVS_KEY_RF_ADDR_LEGACY, legacy, &required_size) != ESP_OK) {
+        nvs_close(nvs_handle);
+        return;
+    }
+
+    uint32_t address = 0;
+    int bits = 0;
+    for (; legacy[bits] == '0' || legacy[bits] == '1'; bits++) {
+        address = (address << 1) | (legacy[bits] == '1');
+    }
+
+    if (bits == 20 && legacy[bits] == '\0') {
+        pairing_state.rf_address = address;
+        persist_mark_dirty(pairing_persist_id);
+        if (persist_flush()) {
+            nvs_erase_key(nvs_handle, NVS_KEY_RF_ADDR_LEGACY);
+            nvs_commit(nvs_handle);
+            ESP_LOGI(PAIRING_TAG, "Migrated RF address %s", legacy);
+        }
+    } else {
+        ESP_LOGW(PAIRING_TAG, "Ignoring malformed RF address '%s'", legacy);
+    }
+    nvs_close(nvs_handle);
+}
+
 /**
  * @brief Initialize NVS and load saved pairing data
  */
@@ -47,66 +92,57 @@ void pairing_init(void) {
     }
     ESP_ERROR_CHECK(err);
 
+    // Pairing changes are rare and should stick right away
+    pairing_persist_id = persist_register(NVS_KEY_RF_ADDR, &pairing_state.rf_address, sizeof(pairing_state.rf_address),
+                                          PERSIST_BLOB, 0, 0);
+
     // Try to load saved RF address
     nvs_handle_t nvs_handle;
     err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
     if (err == ESP_OK) {
         size_t required_size = sizeof(pairing_state.rf_address);
-        err = nvs_get_str(nvs_handle, NVS_KEY_RF_ADDR, pairing_state.rf_address, &required_size);
-        if (err == ESP_OK) {
-            pairing_state.is_paired = true;
-            ESP_LOGI(PAIRING_TAG, "Loaded paired RF address: %s", pairing_state.rf_address);
-        } else {
-            ESP_LOGI(PAIRING_TAG, "No paired remote found");
+        err = nvs_get_blob(nvs_handle, NVS_KEY_RF_ADDR, &pairing_state.rf_address, &required_size);
+        if (err != ESP_OK) {
+            pairing_state.rf_address = PAIRING_NO_ADDRESS;
         }
         nvs_close(nvs_handle);
     }
-}
 
-/**
- * @brief Save RF address to NVS
- */
-bool pairing_save_address(const char *address) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(PAIRING_TAG, "Failed to open NVS: %s", esp_err_to_name(err));
-        return false;
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        pairing_migrate_legacy_address();
     }
 
-    err = nvs_set_str(nvs_handle, NVS_KEY_RF_ADDR, address);
-    if (err != ESP_OK) {
-        ESP_LOGE(PAIRING_TAG, "Failed to save address: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return false;
+    if (pairing_state.rf_address != PAIRING_NO_ADDRESS) {
+        pairing_state.is_paired = true;
+        ESP_LOGI(PAIRING_TAG, "Loaded paired RF address: 0x%05X", pairing_state.rf_address);
+    } else {
+        ESP_LOGI(PAIRING_TAG, "No paired remote found");
     }
+}
 
-    err = nvs_commit(nvs_handle);
-    nvs_close(nvs_handle);
-
-    if (err == ESP_OK) {
-        strncpy(pairing_state.rf_address, address, sizeof(pairing_state.rf_address) - 1);
-        pairing_state.is_paired = true;
-        ESP_LOGI(PAIRING_TAG, "Saved RF address: %s", address);
-        return true;
+/**
+ * @brief Save RF address (written to NVS by the next persist_service())
+ * @return false for PAIRING_NO_ADDRESS, which would read back as unpaired
+ */
+bool pairing_save_address(uint32_t address) {
+    if (address == PAIRING_NO_ADDRESS) {
+        ESP_LOGW(PAIRING_TAG, "Address 0x%08X is reserved, can't pair this remote", address);
+        return false;
     }
-    return false;
+    pairing_state.rf_address = address;
+    pairing_state.is_paired = true;
+    persist_mark_dirty(pairing_persist_id);
+    ESP_LOGI(PAIRING_TAG, "Saved RF address: 0x%05X", address);
+    return true;
 }
 
 /**
  * @brief Clear paired remote from NVS
  */
 void pairing_clear(void) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err == ESP_OK) {
-        nvs_erase_key(nvs_handle, NVS_KEY_RF_ADDR);
-        nvs_commit(nvs_handle);
-        nvs_close(nvs_handle);
-    }
-    
     pairing_state.is_paired = false;
-    memset(pairing_state.rf_address, 0, sizeof(pairing_state.rf_address));
+    pairing_state.rf_address = PAIRING_NO_ADDRESS;
+    persist_mark_dirty(pairing_persist_id);
     ESP_LOGI(PAIRING_TAG, "Cleared pairing data");
 }
 
@@ -157,30 +193,10 @@ bool pairing_is_paired(void) {
 /**
  * @brief Get the paired RF address
  */
-const char* pairing_get_address(void) {
+uint32_t pairing_get_address(void) {
     return pairing_state.rf_address;
 }
 
-/**
- * @brief Save relay states to NVS
- */
-void pairing_save_relay_states(const uint8_t *states, size_t count) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(PAIRING_TAG, "Failed to open NVS for relay states");
-        return;
-    }
-
-    // Save as a blob
-    err = nvs_set_blob(nvs_handle, NVS_KEY_RELAY_STATE, states, count);
-    if (err == ESP_OK) {
-        nvs_commit(nvs_handle);
-        ESP_LOGD(PAIRING_TAG, "Saved relay states");
-    }
-    nvs_close(nvs_handle);
-}
-
 /**
  * @brief Load relay states from NVS
  */
@@ -0,0 +1,306 @@
+/**
+ * @file persist.h
+ * @brief Batched NVS persistence for all modules
+ *
+ * Modules register the memory backing each of their NVS keys once and then
+ * only mark it dirty. persist_service() (called from the housekeeping task)
+ * decides when to flush and then writes every dirty region in a single
+ * nvs_open/commit, so one flash stall covers several modules' changes.
+ *
+ * Each region has a quiet time (flush once it has not changed for this long)
+ * and a maximum delay (flush at the latest this long after the first change,
+ * even if it keeps changing). When any region is due, all other dirty regions
+ * are written along with it.
+ *
+ * Flash writes stall the instruction cache and can cost the RF receiver edges.
+ * A busy check (registered by the RF module) lets flushes wait for a quiet
+ * window, up to PERSIST_MAX_DEFER_MS past the point they became due. Other
+ * flash writers use persist_flash_begin()/end() so RF losses can be blamed.
+ */
+
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define PERSIST_TAG "PERSIST"
+#define NVS_NAMESPACE "relay_ctrl"
+#define PERSIST_MAX_REGIONS 8
+#define PERSIST_MAX_DEFER_MS 10000   // Write anyway once a flush has waited this long for RF to go quiet
+
+typedef enum {
+    PERSIST_BLOB = 0,
+    PERSIST_STR = 1,    // NUL-terminated; an empty string erases the key
+} persist_kind_t;
+
+typedef struct {
+    const char* key;
+    const void* data;
+    size_t len;                 // blob size (ignored for strings)
+    persist_kind_t kind;
+    uint32_t quiet_ms;          // flush after this long without changes
+    uint32_t max_delay_ms;      // ... but no later than this after the first change
+    volatile bool dirty;
+    bool deferred;              // the pending write has been counted in persist_stats.deferred
+    uint32_t first_change;      // ms timestamps
+    uint32_t last_change;
+    uint32_t writes;            // successful NVS writes of this key
+    uint32_t errors;
+} persist_region_t;
+
+typedef struct {
+    uint32_t flushes;           // nvs_open/commit cycles
+    uint32_t keys_written;
+    uint32_t flush_us_last;
+    uint32_t flush_us_max;
+    uint32_t deferred;          // flash writes postponed because RF was busy (once per pending write)
+    uint32_t forced;            // flash writes done while RF was busy (deferred too long)
+} persist_stats_t;
+
+typedef bool (*persist_busy_fn_t)(void);
+
+static persist_region_t persist_regions[PERSIST_MAX_REGIONS];
+static int persist_region_count = 0;
+static persist_stats_t persist_stats;
+static persist_busy_fn_t persist_busy_check = NULL;
+static volatile bool persist_flash_active = false;
+static volatile uint32_t persist_flash_end_ms = 0;
+
+/**
+ * @brief Register the check that tells whether flash writes should wait
+ */
+void persist_set_busy_check(persist_busy_fn_t fn) {
+    persist_busy_check = fn;
+}
+
+/**
+ * @brief Decide whether a flash write may go ahead now
+ * @param waited_ms how long the write has been due
+ * @param max_defer_ms write regardless of RF once it has waited this long
+ * @param deferred the pending write's flag: it is counted as deferred the first time it is
+ *                 postponed, and the caller clears the flag once the write is done
+ * @return false to postpone
+ */
+bool persist_flash_allowed(uint32_t waited_ms, uint32_t max_defer_ms, bool* deferred) {
+    if (persist_busy_check == NULL || !persist_busy_check()) {
+        return true;
+    }
+    if (waited_ms >= max_defer_ms) {
+        persist_stats.forced++;
+        return true;
+    }
+    if (!*deferred) {
+        *deferred = true;
+        persist_stats.deferred++;
+    }
+    return false;
+}
+
+/**
+ * @brief Mark the start of a flash write or erase
+ */
+void persist_flash_begin(void) {
+    persist_flash_active = true;
+}
+
+/**
+ * @brief Mark the end of a flash write or erase
+ */
+void persist_flash_end(void) {
+    persist_flash_end_ms = esp_timer_get_time() / 1000;
+    persist_flash_active = false;
+}
+
+/**
+ * @brief Whether flash was being written at, or within window_ms before, now
+ */
+bool persist_flash_recent(uint32_t window_ms) {
+    return persist_flash_active || (uint32_t)(esp_timer_get_time() / 1000) - persist_flash_end_ms < window_ms;
+}
+
+/**
+ * @brief Register the memory backing an NVS key
+ * @return region id for persist_mark_dirty(), or -1 if the table is full
+ */
+int persist_register(const char* key, const void* data, size_t len, persist_kind_t kind, uint32_t quiet_ms,
+                     uint32_t max_delay_ms) {
+    if (persist_region_count >= PERSIST_MAX_REGIONS) {
+        ESP_LOGE(PERSIST_TAG, "Too many regions, '%s' not persisted", key);
+        return -1;
+    }
+
+    persist_region_t* r = &persist_regions[persist_region_count];
+    r->key = key;
+    r->data = data;
+    r->len = len;
+    r->kind = kind;
+    r->quiet_ms = quiet_ms;
+    r->max_delay_ms = max_delay_ms;
+    return persist_region_count++;
+}
+
+/**
+ * @brief Note that a region's memory has changed
+ */
+void persist_mark_dirty(int id) {
+    if (id < 0 || id >= persist_region_count) {
+        return;
+    }
+
+    persist_region_t* r = &persist_regions[id];
+    uint32_t now = esp_timer_get_time() / 1000;
+    if (!r->dirty) {
+        r->first_change = now;
+    }
+    r->last_change = now;
+    r->dirty = true;
+}
+
+static esp_err_t persist_write_region(nvs_handle_t nvs_handle, persist_region_t* r) {
+    if (r->kind == PERSIST_STR) {
+        const char* str = (const char*)r->data;
+        if (str[0] == '\0') {
+            esp_err_t err = nvs_erase_key(nvs_handle, r->key);
+            return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+        }
+        return nvs_set_str(nvs_handle, r->key, str);
+    }
+    return nvs_set_blob(nvs_handle, r->key, r->data, r->len);
+}
+
+/**
+ * @brief Write every dirty region in one NVS transaction
+ * @return true if everything was written and committed
+ */
+bool persist_flush(void) {
+    bool any = false;
+    for (int i = 0; i < persist_region_count; i++) {
+        any |= persist_regions[i].dirty;
+    }
+    if (!any) {
+        return true;
+    }
+
+    int64_t start = esp_timer_get_time();
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(PERSIST_TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return false;
+    }
+    persist_flash_begin();
+
+    bool ok = true;
+    int written = 0;
+    for (int i = 0; i < persist_region_count; i++) {
+        persist_region_t* r = &persist_regions[i];
+        if (!r->dirty) {
+            continue;
+        }
+
+        // Clear first: a change made while we write marks it dirty again
+        r->dirty = false;
+        err = persist_write_region(nvs_handle, r);
+        if (err != ESP_OK) {
+            ESP_LOGE(PERSIST_TAG, "Failed to write '%s': %s", r->key, esp_err_to_name(err));
+            r->errors++;
+            r->dirty = true;
+            ok = false;
+            continue;
+        }
+        r->deferred = false;
+        r->writes++;
+        written++;
+    }
+
+    err = nvs_commit(nvs_handle);
+    nvs_close(nvs_handle);
+    persist_flash_end();
+    if (err != ESP_OK) {
+        ESP_LOGE(PERSIST_TAG, "Commit failed: %s", esp_err_to_name(err));
+        ok = false;
+    }
+
+    uint32_t elapsed = esp_timer_get_time() - start;
+    persist_stats.flushes++;
+    persist_stats.keys_written += written;
+    persist_stats.flush_us_last = elapsed;
+    if (elapsed > persist_stats.flush_us_max) {
+        persist_stats.flush_us_max = elapsed;
+    }
+
+    ESP_LOGD(PERSIST_TAG, "Flushed %d keys in %u us", written, elapsed);
+    return ok;
+}
+
+/**
+ * @brief Flush if any region is due and RF is quiet (call periodically)
+ */
+void persist_service(void) {
+    uint32_t now = esp_timer_get_time() / 1000;
+    bool due = false;
+    bool deferred = true;  // every due region was counted when first postponed
+    uint32_t waited = 0;
+
+    for (int i = 0; i < persist_region_count; i++) {
+        persist_region_t* r = &persist_regions[i];
+        if (!r->dirty) {
+            continue;
+        }
+
+        uint32_t quiet_due = r->last_change + r->quiet_ms;
+        uint32_t max_due = r->first_change + r->max_delay_ms;
+        uint32_t due_at = (int32_t)(quiet_due - max_due) < 0 ? quiet_due : max_due;
+        if ((int32_t)(now - due_at) >= 0) {
+            due = true;
+            deferred &= r->deferred;
+            if (now - due_at > waited) {
+                waited = now - due_at;
+            }
+        }
+    }
+
+    if (!due) {
+        return;
+    }
+    if (persist_flash_allowed(waited, PERSIST_MAX_DEFER_MS, &deferred)) {
+        persist_flush();
+        return;
+    }
+
+    // Postponed: every dirty region goes out with that flush, so none is counted again until written
+    for (int i = 0; i < persist_region_count; i++) {
+        if (persist_regions[i].dirty) {
+            persist_regions[i].deferred = true;
+        }
+    }
+}
+
+/**
+ * @brief Number of registered regions (for diagnostics)
+ */
+int persist_get_region_count(void) {
+    return persist_region_count;
+}
+
+/**
+ * @brief Registered region by id (for diagnostics)
+ */
+const persist_region_t* persist_get_region(int id) {
+    return id >= 0 && id < persist_region_count ? &persist_regions[id] : NULL;
+}
+
+/**
+ * @brief Copy of the flush counters
+ */
+void persist_get_stats(persist_stats_t* out) {
+    *out = persist_stats;
+}
+
+#endif // PERSIST_H
@@ -7,10 +7,16 @@
 
 // Protocol: Simple binary packets
 // All multi-byte values are little-endian
+//
+// v2 commands carry relay states as an 8-bit mask and only see relays 0-7.
+// v3 adds *_WIDE variants with 1-4 byte masks and long (16-bit length) responses;
+// support is advertised with CAP_WIDE_MASK in DESC_CAPABILITIES.
 
 #define PROTO_MAGIC 0xA5 // Start byte for packet validation
 
 #define MAX_RESP_DATA 255
+#define MAX_RESP_FRAME (3 + MAX_RESP_DATA) // Header + largest payload
+#define MAX_MASK_BYTES 4                   // Widest relay mask on the wire (32 relays)
 
 // Command types
 typedef enum {
@@ -19,6 +25,13 @@ typedef enum {
   CMD_SET_RELAY = 0x03,    // Set specific relay state
   CMD_TOGGLE_RELAY = 0x04, // Toggle specific relay
   CMD_SET_ALL = 0x05,      // Set all relays at once (bitmask)
+  CMD_SUBSCRIBE = 0x06,    // Push status on every change (value: 1=subscribe, 2=wide frames, 0=unsubscribe)
+  CMD_SET_MASKED = 0x07,   // Set relays selected by relay_id (bitmask) to the bits in value
+
+  // Wide mask commands (v3): value = mask width N in bytes (1-4), masks follow the header
+  CMD_GET_STATUS_WIDE = 0x08, // Get all relay states as [COUNT:1][MASK:N]
+  CMD_SET_ALL_WIDE = 0x09,    // Set all relays: [MASK:N]
+  CMD_SET_MASKED_WIDE = 0x0A, // Set selected relays: [SELECT:N][STATES:N]
   CMD_DESCRIBE = 0x10,     // Get all information about device
 
   // Configuration commands (v2)
@@ -28,10 +41,27 @@ typedef enum {
   CMD_SET_RELAY_ICON = 0x23,    // Set relay icon (icon type in value)
   CMD_SET_RELAY_ALEXA = 0x24,   // Enable/disable Alexa for relay
   CMD_GET_ALL_CONFIG = 0x25,    // Get all relay configurations
+  CMD_SET_GROUPS = 0x26,        // Set multicast group membership (mask: relay_id=low, value=high byte)
+  CMD_GET_GROUPS = 0x27,        // Get multicast group membership
+  CMD_GET_ALL_CONFIG_V3 = 0x28, // Get all relay configurations as a long response (TCP only)
+  CMD_SET_RELAY_NAME_V3 = 0x29, // Set relay name, length-prefixed so it can be pipelined (length in value)
+  CMD_SET_RELAY_ROOM_V3 = 0x2A, // Set relay room, length-prefixed so it can be pipelined (length in value)
 } cmd_type_t;
 
 // Response types
-typedef enum { RESP_OK = 0x00, RESP_ERROR = 0x01, RESP_STATUS = 0x02, RESP_PONG = 0x03, RESP_DESCRIBE = 0x04, RESP_CONFIG = 0x05 } resp_type_t;
+typedef enum {
+  RESP_OK = 0x00,
+  RESP_ERROR = 0x01,
+  RESP_STATUS = 0x02,
+  RESP_PONG = 0x03,
+  RESP_DESCRIBE = 0x04,
+  RESP_CONFIG = 0x05,
+  RESP_STATUS_WIDE = 0x06, // [COUNT:1][MASK:(COUNT+7)/8] (+[VERSION:4] when pushed)
+} resp_type_t;
+
+// Response types with this bit set use a 16-bit length:
+// [MAGIC:1][RESP_TYPE:1][DATA_LEN:2][DATA:N]
+#define RESP_FLAG_LONG 0x80
 
 // A5 04 1B 01 06 73 77 69 74 63 68 02 04 53 52 2D 34 03 01 A5 A5 A5 A5 A5 A5 A5
 // A5 A5 A5 A5
@@ -45,6 +75,13 @@ typedef enum {
   DESC_FW_VERSION = 0x05,   // "1.2.0"
 } desc_type_t;
 
+// DESC_CAPABILITIES bits
+typedef enum {
+  CAP_RELAY = 0x01,     // Relay control
+  CAP_ALEXA = 0x02,     // Alexa (WeMo emulation)
+  CAP_WIDE_MASK = 0x04, // Protocol v3: wide masks and long responses
+} capability_t;
+
 // Relay configuration description (for CMD_GET_RELAY_CONFIG response)
 typedef enum {
   CFG_RELAY_ID = 0x01,     // u8 relay index
@@ -61,11 +98,16 @@ typedef enum {
   ERR_UNKNOWN_CMD = 0x02,
   ERR_INVALID_VALUE = 0x03,
   ERR_NAME_TOO_LONG = 0x04,
+  ERR_NEEDS_STREAM = 0x05, // Command needs a TCP connection
+  ERR_BUSY = 0x06,         // Relay command queue or subscriber slots full, nothing was changed; retry
   ERR_INVALID_MAGIC = 0xFF,
 } error_code_t;
 
 // Request packet structure
 // [MAGIC:1][CMD:1][RELAY_ID:1][VALUE:1]
+// Requests may be pipelined on one connection; they are answered in order.
+// SET_RELAY_NAME/ROOM: [HEADER][STRING] (string is the rest of the segment, VALUE ignored)
+// SET_RELAY_NAME/ROOM_V3: [HEADER][STRING:VALUE]
 typedef struct __attribute__((packed)) {
   uint8_t magic;    // Must be PROTO_MAGIC
   uint8_t cmd;      // Command type
@@ -73,6 +115,19 @@ typedef struct __attribute__((packed)) {
   uint8_t value;    // 0=off, 1=on, or bitmask
 } relay_request_t;
 
+// UDP datagrams carry a request ID that is echoed in the reply so clients can
+// match replies and retry:
+// Request:  [REQ_ID:2][MAGIC:1][CMD:1][RELAY_ID:1][VALUE:1][STRING:N]
+// Response: [REQ_ID:2][MAGIC:1][RESP_TYPE:1][DATA_LEN:1][DATA:N]
+#define PROTO_UDP_HEADER 2
+
+// Group commands are multicast to RELAY_GROUP_MULTICAST_ADDR:
+// [GROUP_ID:1][FLAGS:1][REQ_ID:2][MAGIC:1][CMD:1][RELAY_ID:1][VALUE:1]
+// Members reply like a UDP request, but only when GROUP_FLAG_ACK is set.
+// Only relay control commands (PING, GET_STATUS, SET_*, TOGGLE) are accepted.
+#define PROTO_GROUP_HEADER 2
+#define GROUP_FLAG_ACK 0x01
+
 // Response packet structure
 // [MAGIC:1][RESP_TYPE:1][DATA_LEN:1][DATA:N]
 typedef struct __attribute__((packed)) {
@@ -95,6 +150,36 @@ static inline bool proto_parse_request(const uint8_t* buf, size_t len, relay_req
   return req->magic == PROTO_MAGIC;
 }
 
+// Return the size of the first complete frame in buf, or 0 if more bytes are needed.
+// v2 name/room strings run to the end of the received data; the _V3 forms carry
+// their length in `value`, and a length of 0 ends the frame after the header. Wide commands
+// carry their mask width in `value`; widths outside 1..MAX_MASK_BYTES end the frame
+// after the header, and any mask bytes sent after it are skipped as bad magic.
+static inline size_t proto_frame_length(const uint8_t* buf, size_t len) {
+  if (len < sizeof(relay_request_t))
+    return 0;
+
+  if (buf[1] == CMD_SET_RELAY_NAME || buf[1] == CMD_SET_RELAY_ROOM)
+    return len;
+
+  if (buf[1] == CMD_SET_RELAY_NAME_V3 || buf[1] == CMD_SET_RELAY_ROOM_V3) {
+    size_t total = sizeof(relay_request_t) + buf[3];
+    return len >= total ? total : 0;
+  }
+
+  if (buf[1] == CMD_SET_ALL_WIDE || buf[1] == CMD_SET_MASKED_WIDE) {
+    // A bad width is a header-only frame, answered with ERR_INVALID_VALUE rather than waited on
+    if (buf[3] == 0 || buf[3] > MAX_MASK_BYTES)
+      return sizeof(relay_request_t);
+
+    size_t masks = buf[1] == CMD_SET_MASKED_WIDE ? 2 : 1;
+    size_t total = sizeof(relay_request_t) + masks * buf[3];
+    return len >= total ? total : 0;
+  }
+
+  return sizeof(relay_request_t);
+}
+
 // Build response
 static inline size_t proto_build_response(uint8_t* buf, uint8_t resp_type, const uint8_t* data, uint8_t data_len) {
 
@@ -128,4 +213,49 @@ static inline size_t proto_status_response(uint8_t* buf, uint8_t relay_states) {
   return proto_build_response(buf, RESP_STATUS, &relay_states, 1);
 }
 
+// Long response header: [MAGIC][TYPE|RESP_FLAG_LONG][LEN:2], data is written by the caller after it
+static inline size_t proto_long_response_header(uint8_t* buf, uint8_t type, uint16_t data_len) {
+  buf[0] = PROTO_MAGIC;
+  buf[1] = type | RESP_FLAG_LONG;
+  buf[2] = data_len & 0xFF;
+  buf[3] = data_len >> 8;
+  return 4;
+}
+
+// Read a little-endian relay mask of n bytes
+static inline uint32_t proto_get_mask(const uint8_t* buf, size_t n) {
+  uint32_t mask = 0;
+  for (size_t i = 0; i < n; i++) {
+    mask |= (uint32_t)buf[i] << (8 * i);
+  }
+  return mask;
+}
+
+// Wide status: [COUNT:1][MASK:(COUNT+7)/8], optionally followed by [VERSION:4]
+static inline size_t proto_status_wide_response(uint8_t* buf, uint8_t relay_count, uint32_t relay_states, bool with_version,
+                                                uint32_t version) {
+  uint8_t data[1 + MAX_MASK_BYTES + 4];
+  size_t mask_len = (relay_count + 7) / 8;
+  size_t idx = 0;
+
+  data[idx++] = relay_count;
+  for (size_t i = 0; i < mask_len; i++) {
+    data[idx++] = (relay_states >> (8 * i)) & 0xFF;
+  }
+  if (with_version) {
+    for (size_t i = 0; i < 4; i++) {
+      data[idx++] = (version >> (8 * i)) & 0xFF;
+    }
+  }
+
+  return proto_build_response(buf, RESP_STATUS_WIDE, data, idx);
+}
+
+// Status with state version, used for CMD_SUBSCRIBE acks and pushed updates
+// Data: [STATES:1][VERSION:4]
+static inline size_t proto_status_version_response(uint8_t* buf, uint8_t relay_states, uint32_t version) {
+  uint8_t data[5] = {relay_states, version & 0xFF, (version >> 8) & 0xFF, (version >> 16) & 0xFF, (version >> 24) & 0xFF};
+  return proto_build_response(buf, RESP_STATUS, data, sizeof(data));
+}
+
 #endif // RELAY_PROTOCOL_H
\ No newline at end of file
@@ -15,6 +15,7 @@
 #include "nvs.h"
 #include "esp_log.h"
 #include "config.h"
+#include "persist.h"
 
 #define RELAY_CONFIG_TAG "RELAY_CFG"
 #define NVS_KEY_RELAY_CONFIG "relay_cfg"
@@ -54,9 +55,10 @@ typedef struct __attribute__((packed)) {
 
 // Global configuration state
 static relay_config_t relay_config = {0};
-static bool relay_config_dirty = false;
-static uint32_t relay_config_last_change = 0;
-#define RELAY_CONFIG_SAVE_DELAY_MS 3000
+static uint32_t relay_config_generation = 0;  // Bumped on every change, used to invalidate cached responses
+static int relay_config_persist_id = -1;
+#define RELAY_CONFIG_SAVE_DELAY_MS 3000       // Save once edits pause for this long
+#define RELAY_CONFIG_SAVE_MAX_MS 15000        // ... or at the latest this long after the first edit
 
 /**
  * @brief Initialize relay configuration with defaults
@@ -65,10 +67,8 @@ static void relay_config_set_defaults(void) {
     relay_config.version = RELAY_CONFIG_VERSION;
     relay_config.relay_count = NUM_RELAYS;
 
-    const char* default_names[] = {"Switch 1", "Switch 2", "Switch 3", "Switch 4"};
-
     for (int i = 0; i < NUM_RELAYS; i++) {
-        snprintf(relay_config.relays[i].name, RELAY_NAME_MAX_LEN, "%s", default_names[i]);
+        snprintf(relay_config.relays[i].name, RELAY_NAME_MAX_LEN, "Switch %d", i + 1);
         snprintf(relay_config.relays[i].room, RELAY_ROOM_MAX_LEN, "Home");
         relay_config.relays[i].icon = ICON_SWITCH;
         relay_config.relays[i].alexa_enabled = 1;  // Enabled by default
@@ -81,6 +81,9 @@ static void relay_config_set_defaults(void) {
  * @brief Load relay configuration from NVS
  */
 bool relay_config_load(void) {
+    relay_config_persist_id = persist_register(NVS_KEY_RELAY_CONFIG, &relay_config, sizeof(relay_config_t), PERSIST_BLOB,
+                                               RELAY_CONFIG_SAVE_DELAY_MS, RELAY_CONFIG_SAVE_MAX_MS);
+
     nvs_handle_t nvs_handle;
     esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
     if (err != ESP_OK) {
@@ -110,53 +113,18 @@ bool relay_config_load(void) {
 }
 
 /**
- * @brief Save relay configuration to NVS
- */
-bool relay_config_save(void) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(RELAY_CONFIG_TAG, "Failed to open NVS: %s", esp_err_to_name(err));
-        return false;
-    }
-
-    err = nvs_set_blob(nvs_handle, NVS_KEY_RELAY_CONFIG, &relay_config, sizeof(relay_config_t));
-    if (err != ESP_OK) {
-        ESP_LOGE(RELAY_CONFIG_TAG, "Failed to save config: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return false;
-    }
-
-    err = nvs_commit(nvs_handle);
-    nvs_close(nvs_handle);
-
-    if (err == ESP_OK) {
-        ESP_LOGI(RELAY_CONFIG_TAG, "Saved relay configuration to NVS");
-        relay_config_dirty = false;
-        return true;
-    }
-
-    return false;
-}
-
-/**
- * @brief Check if configuration needs saving (call periodically)
+ * @brief Mark configuration as modified
  */
-void relay_config_check_save(void) {
-    if (relay_config_dirty) {
-        uint32_t now = esp_timer_get_time() / 1000;
-        if (now - relay_config_last_change >= RELAY_CONFIG_SAVE_DELAY_MS) {
-            relay_config_save();
-        }
-    }
+static void relay_config_mark_dirty(void) {
+    relay_config_generation++;
+    persist_mark_dirty(relay_config_persist_id);
 }
 
 /**
- * @brief Mark configuration as modified
+ * @brief Get the configuration generation (changes whenever the config does)
  */
-static void relay_config_mark_dirty(void) {
-    relay_config_dirty = true;
-    relay_config_last_change = esp_timer_get_time() / 1000;
+uint32_t relay_config_get_generation(void) {
+    return relay_config_generation;
 }
 
 /**
@@ -0,0 +1,283 @@
+/**
+ * @file relay_journal.h
+ * @brief Append-only flash journal of relay states
+ *
+ * Relay states are logged to the "relayjrnl" partition (two flash sectors used
+ * in turn) as 8-byte records, one per change, so a state is persisted as soon as
+ * it is applied without rewriting an NVS blob. Boot replays the newest record.
+ * When the active sector fills up, the other one is erased and seeded with the
+ * current state (compaction); each sector header carries its erase count.
+ * If compaction fails the journal is degraded: appends are refused until a
+ * retry, at growing intervals, succeeds, rather than erasing on every change.
+ *
+ * Records hold the full relay mask rather than (relay, state) pairs: a bulk
+ * command is then one record, and replay only needs the last valid one.
+ */
+
+#ifndef RELAY_JOURNAL_H
+#define RELAY_JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+
+#define JOURNAL_TAG "JOURNAL"
+#define JOURNAL_PARTITION_LABEL "relayjrnl"
+#define JOURNAL_PARTITION_SUBTYPE 0x40
+
+#define JOURNAL_MAGIC 0x4C4E4A52  // "RJNL"
+#define JOURNAL_RECORD_TAG 0xA5
+#define JOURNAL_SECTORS 2
+#define JOURNAL_RETRY_MIN_MS 1000      // first retry after a failed compaction, doubled on each failure
+#define JOURNAL_RETRY_MAX_MS 300000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;    // highest valid generation is the active sector
+    uint32_t erase_count;   // times this sector has been erased
+    uint32_t check;         // ~(magic ^ generation ^ erase_count)
+} journal_header_t;
+
+typedef struct {
+    uint32_t mask;          // relay states, bit n = relay n
+    uint16_t seq;           // low bits of the relay state version, for diagnostics
+    uint8_t tag;            // JOURNAL_RECORD_TAG; 0xFF = never written
+    uint8_t crc;            // crc8 over the first 7 bytes
+} journal_record_t;
+
+#define JOURNAL_RECORDS_PER_SECTOR ((SPI_FLASH_SEC_SIZE - sizeof(journal_header_t)) / sizeof(journal_record_t))
+
+typedef struct {
+    uint32_t appends;       // records written since boot
+    uint32_t compactions;   // sector switches since boot
+    uint32_t write_errors;
+    uint32_t compact_failures;
+    bool degraded;          // the last compaction failed; appends wait for the retry
+    uint32_t erase_count[JOURNAL_SECTORS];
+    uint32_t used;          // records in the active sector
+    uint8_t active;         // active sector index
+} journal_stats_t;
+
+static const esp_partition_t* journal_partition = NULL;
+static journal_header_t journal_active_header;
+static uint32_t journal_next = 0;   // next free record slot in the active sector
+static journal_stats_t journal_stats;
+static uint32_t journal_retry_ms = 0;   // current backoff while degraded
+static uint32_t journal_retry_at = 0;   // ms since boot of the next compaction attempt
+
+static uint8_t journal_crc8(const uint8_t* data, size_t len) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static bool journal_header_valid(const journal_header_t* h) {
+    return h->magic == JOURNAL_MAGIC && h->check == ~(h->magic ^ h->generation ^ h->erase_count);
+}
+
+static bool journal_record_valid(const journal_record_t* r) {
+    return r->tag == JOURNAL_RECORD_TAG && r->crc == journal_crc8((const uint8_t*)r, sizeof(*r) - 1);
+}
+
+static bool journal_record_blank(const journal_record_t* r) {
+    const uint8_t* p = (const uint8_t*)r;
+    for (size_t i = 0; i < sizeof(*r); i++) {
+        if (p[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t journal_record_offset(uint8_t sector, uint32_t slot) {
+    return sector * SPI_FLASH_SEC_SIZE + sizeof(journal_header_t) + slot * sizeof(journal_record_t);
+}
+
+static bool journal_write_record(uint8_t sector, uint32_t slot, uint32_t mask, uint16_t seq) {
+    journal_record_t rec = {.mask = mask, .seq = seq, .tag = JOURNAL_RECORD_TAG};
+    rec.crc = journal_crc8((const uint8_t*)&rec, sizeof(rec) - 1);
+
+    if (esp_partition_write(journal_partition, journal_record_offset(sector, slot), &rec, sizeof(rec)) != ESP_OK) {
+        journal_stats.write_errors++;
+        return false;
+    }
+    journal_stats.appends++;
+    return true;
+}
+
+/**
+ * @brief Switch to the other sector, seeding it with the current state
+ *
+ * The old sector stays valid until the new header is written, so a reset at
+ * any point leaves one readable copy of the state.
+ */
+static bool journal_compact(uint32_t mask, uint16_t seq) {
+    uint8_t target = (journal_stats.active + 1) % JOURNAL_SECTORS;
+    size_t base = target * SPI_FLASH_SEC_SIZE;
+
+    journal_header_t old;
+    esp_partition_read(journal_partition, base, &old, sizeof(old));
+    uint32_t erase_count = (journal_header_valid(&old) ? old.erase_count : journal_stats.erase_count[target]) + 1;
+
+    if (esp_partition_erase_range(journal_partition, base, SPI_FLASH_SEC_SIZE) != ESP_OK) {
+        journal_stats.write_errors++;
+        return false;
+    }
+
+    if (!journal_write_record(target, 0, mask, seq)) {
+        return false;
+    }
+
+    journal_header_t h = {
+        .magic = JOURNAL_MAGIC,
+        .generation = journal_active_header.generation + 1,
+        .erase_count = erase_count,
+    };
+    h.check = ~(h.magic ^ h.generation ^ h.erase_count);
+    if (esp_partition_write(journal_partition, base, &h, sizeof(h)) != ESP_OK) {
+        journal_stats.write_errors++;
+        return false;
+    }
+
+    journal_active_header = h;
+    journal_stats.active = target;
+    journal_stats.erase_count[target] = erase_count;
+    journal_stats.compactions++;
+    journal_next = 1;
+    journal_stats.used = 1;
+
+    ESP_LOGI(JOURNAL_TAG, "Compacted into sector %d (generation %u, %u erases)", target, h.generation, erase_count);
+    return true;
+}
+
+/**
+ * @brief Find the journal partition and replay it
+ * @param mask receives the last journalled relay states
+ * @return true if a state was recovered; false if the journal is empty or missing
+ *         (check journal_available() to tell the two apart)
+ */
+bool journal_init(uint32_t* mask) {
+    journal_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, JOURNAL_PARTITION_SUBTYPE,
+                                                 JOURNAL_PARTITION_LABEL);
+    if (journal_partition == NULL || journal_partition->size < JOURNAL_SECTORS * SPI_FLASH_SEC_SIZE) {
+        ESP_LOGW(JOURNAL_TAG, "No journal partition, relay states go to NVS");
+        journal_partition = NULL;
+        return false;
+    }
+
+    int active = -1;
+    for (int s = 0; s < JOURNAL_SECTORS; s++) {
+        journal_header_t h;
+        esp_partition_read(journal_partition, s * SPI_FLASH_SEC_SIZE, &h, sizeof(h));
+        if (!journal_header_valid(&h)) {
+            continue;
+        }
+        journal_stats.erase_count[s] = h.erase_count;
+        if (active < 0 || (int32_t)(h.generation - journal_active_header.generation) > 0) {
+            active = s;
+            journal_active_header = h;
+        }
+    }
+
+    if (active < 0) {
+        ESP_LOGI(JOURNAL_TAG, "Journal is empty");
+        journal_active_header.generation = 0;
+        journal_stats.active = JOURNAL_SECTORS - 1;  // first compaction starts at sector 0
+        journal_next = JOURNAL_RECORDS_PER_SECTOR;
+        return false;
+    }
+
+    // Torn or corrupt records are skipped; the newest valid one wins
+    bool found = false;
+    journal_next = 0;
+    for (uint32_t slot = 0; slot < JOURNAL_RECORDS_PER_SECTOR; slot++) {
+        journal_record_t rec;
+        esp_partition_read(journal_partition, journal_record_offset(active, slot), &rec, sizeof(rec));
+        if (journal_record_blank(&rec)) {
+            break;
+        }
+        journal_next = slot + 1;
+        if (journal_record_valid(&rec)) {
+            *mask = rec.mask;
+            found = true;
+        }
+    }
+
+    journal_stats.active = active;
+    journal_stats.used = journal_next;
+    ESP_LOGI(JOURNAL_TAG, "Replayed sector %d: %u records, state 0x%08X", active, journal_next, found ? *mask : 0);
+    return found;
+}
+
+/**
+ * @brief Whether the journal partition is in use
+ */
+bool journal_available(void) {
+    return journal_partition != NULL;
+}
+
+/**
+ * @brief How long a degraded journal refuses appends, in ms (0 when it takes them)
+ */
+uint32_t journal_retry_wait_ms(void) {
+    if (!journal_stats.degraded) {
+        return 0;
+    }
+    int32_t wait = (int32_t)(journal_retry_at - (uint32_t)(esp_timer_get_time() / 1000));
+    return wait > 0 ? (uint32_t)wait : 0;
+}
+
+/**
+ * @brief Append the current relay states
+ *
+ * Costs one 8-byte flash write, plus a sector erase every
+ * JOURNAL_RECORDS_PER_SECTOR appends. Returns false without touching flash
+ * while journal_retry_wait_ms() is non-zero.
+ */
+bool journal_append(uint32_t mask, uint16_t seq) {
+    if (journal_partition == NULL || journal_retry_wait_ms() > 0) {
+        return false;
+    }
+
+    if (journal_next >= JOURNAL_RECORDS_PER_SECTOR) {
+        if (!journal_compact(mask, seq)) {
+            journal_stats.compact_failures++;
+            journal_stats.degraded = true;
+            journal_retry_ms = journal_retry_ms == 0 ? JOURNAL_RETRY_MIN_MS
+                             : journal_retry_ms * 2 > JOURNAL_RETRY_MAX_MS ? JOURNAL_RETRY_MAX_MS
+                             : journal_retry_ms * 2;
+            journal_retry_at = esp_timer_get_time() / 1000 + journal_retry_ms;
+            ESP_LOGW(JOURNAL_TAG, "Compaction failed, journal degraded; retrying in %u ms", journal_retry_ms);
+            return false;
+        }
+        if (journal_stats.degraded) {
+            ESP_LOGI(JOURNAL_TAG, "Journal recovered after %u failed compactions", journal_stats.compact_failures);
+        }
+        journal_stats.degraded = false;
+        journal_retry_ms = 0;
+        return true;
+    }
+
+    // A failed write may have left a partial record; never reuse the slot
+    bool ok = journal_write_record(journal_stats.active, journal_next, mask, seq);
+    journal_next++;
+    journal_stats.used = journal_next;
+    return ok;
+}
+
+/**
+ * @brief Copy of the journal wear counters
+ */
+void journal_get_stats(journal_stats_t* out) {
+    *out = journal_stats;
+}
+
+#endif // RELAY_JOURNAL_H
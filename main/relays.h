@@ -1,20 +1,248 @@
 #ifndef RELAYS_H
 #define RELAYS_H
 
+#include <string.h>
 #include "config.h"
 #include "driver/gpio.h"
+#include "esp8266/gpio_struct.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
 #include "pairing.h"
+#include "persist.h"
+#include "relay_journal.h"
 
-// Current relay states
+// Relay states as a bitmask (bit n = relay n), wide enough for 32-channel boards
+typedef uint32_t relay_mask_t;
+_Static_assert(NUM_RELAYS <= sizeof(relay_mask_t) * 8, "relay_mask_t too narrow for NUM_RELAYS");
+#define RELAY_MASK_ALL ((((relay_mask_t)1 << (NUM_RELAYS - 1)) << 1) - 1)
+
+/**
+ * Relay actor
+ *
+ * The binary server, HTTP server, WeMo tasks and RF task all switch relays. Rather
+ * than share relay_states[] between them, every change is queued to one owner task
+ * (relays_task) which applies commands in order, folds everything waiting in the
+ * queue into a single output write, and publishes the result as a snapshot that
+ * readers pick up without locking.
+ */
+
+#define RELAY_QUEUE_LEN 16
+#define RELAY_TASK_PRIORITY 7       // Above the network and RF tasks: actuation is short and latency-sensitive
+#define RELAY_SAVE_DELAY_MS 5000    // NVS fallback: save 5 seconds after last change
+#define RELAY_SAVE_MAX_MS 30000     // ... or 30 seconds after the first one while relays keep changing
+#define RELAY_JOURNAL_DEFER_MS 2000 // Longest a journal write waits for RF reception to finish
+#define RELAY_JOURNAL_RETRY_MS 50   // How often a deferred journal write is retried
+#define RELAYS_NOTIFY_DONE 0x80000000 // Task notification bit used to wake callers waiting on a command
+
+typedef enum {
+  RELAY_OP_SET = 0,    // relays in mask take the bits in value
+  RELAY_OP_TOGGLE = 1, // relays in mask are inverted
+} relay_op_t;
+
+typedef struct {
+  uint8_t op;
+  relay_mask_t mask;
+  relay_mask_t value;
+  TaskHandle_t waiter;  // notified once applied, NULL for fire-and-forget
+  volatile bool* done;  // set before the waiter is notified
+} relay_cmd_t;
+
+// Actuation counters, owned by the actor
+typedef struct {
+  uint32_t commands;    // commands applied
+  uint32_t batches;     // output writes (commands - batches = coalesced)
+  uint32_t max_batch;   // most commands folded into one write
+  uint32_t queue_full;  // commands dropped because the queue stayed full
+  uint32_t apply_us_max; // slowest batch, queue drain to waiters notified
+  uint64_t apply_us_total;
+} relay_stats_t;
+
+// Called by the actor after every state change (see relays_set_change_hook)
+typedef void (*relays_change_hook_t)(void);
+static relays_change_hook_t relays_change_hook = NULL;
+
+// Current relay states, written only by the actor (or relays_init before it starts)
 static uint8_t relay_states[NUM_RELAYS] = {0};
 
-// Delayed save mechanism to avoid excessive NVS writes
+// Output register bits for relay pins on GPIO0-15 (0 for GPIO16), computed in relays_init()
+static uint32_t relay_gpio_bits[NUM_RELAYS];
+
+// Unsaved change; journalled right away, or handed to the persist service without a journal
 static bool relay_states_dirty = false;
-static uint32_t last_relay_change_time = 0;
-#define RELAY_SAVE_DELAY_MS 5000  // Save 5 seconds after last change
+static uint32_t relay_dirty_since = 0;  // ms, start of the current unsaved period
+static bool relay_save_deferred = false;  // the unsaved period's journal write was counted as deferred
+static int relay_persist_id = -1;
+
+/*
+ * Published snapshot: the actor makes relay_snapshot_seq odd while updating mask
+ * and version, readers retry until they see the same even sequence on both sides.
+ * The version is bumped on every actual state change so observers can detect
+ * updates cheaply.
+ */
+static volatile uint32_t relay_snapshot_seq = 0;
+static volatile relay_mask_t relay_snapshot_mask = 0;
+static volatile uint32_t relay_snapshot_version = 0;
+
+/*
+ * Copy of the published snapshot in RTC memory, which survives watchdog and
+ * software resets (not power loss). Lets relays_early_restore() put the outputs
+ * back before NVS, the journal or WiFi are up. It must be RTC_NOINIT_ATTR: the
+ * startup code re-initialises RTC_DATA_ATTR on every boot except deep-sleep
+ * wake, so it would be zero after exactly the resets this is for. Not being
+ * initialised, it holds garbage after power-up; the magic and check catch that.
+ */
+#define RELAY_RTC_MAGIC 0x52454C59  // "RELY"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t mask;
+  uint32_t version;
+  uint32_t check;
+} relay_rtc_mirror_t;
+
+static RTC_NOINIT_ATTR relay_rtc_mirror_t relay_rtc_mirror;
+static bool relay_rtc_restored = false;
+
+static QueueHandle_t relay_queue = NULL;
+static TaskHandle_t relay_task_handle = NULL;
+static relay_stats_t relay_stats;
+
+/**
+ * Drive the selected relays to the bits in value, all at once.
+ * GPIO0-15 change in one W1TS and one W1TC write so interlocked loads switch
+ * together; GPIO16 lives in the RTC block and is set separately.
+ */
+static void relays_write_outputs(relay_mask_t mask, relay_mask_t value) {
+  uint32_t set = 0;
+  uint32_t clear = 0;
+
+  for (int i = 0; i < NUM_RELAYS; i++) {
+    if (!((mask >> i) & 1)) {
+      continue;
+    }
+    if (relay_gpio_bits[i] == 0) {
+      gpio_set_level(relays[i], (value >> i) & 1);
+    } else if ((value >> i) & 1) {
+      set |= relay_gpio_bits[i];
+    } else {
+      clear |= relay_gpio_bits[i];
+    }
+  }
+
+  if (set) {
+    GPIO.out_w1ts.val = set;
+  }
+  if (clear) {
+    GPIO.out_w1tc.val = clear;
+  }
+}
+
+static uint32_t relay_rtc_check(const relay_rtc_mirror_t* m) {
+  return ~(m->magic ^ m->mask ^ (m->version * 0x9E3779B1));
+}
+
+// Publish a new snapshot to readers and to the RTC mirror
+static void relays_publish(relay_mask_t mask, uint32_t version) {
+  relay_snapshot_seq++;
+  __sync_synchronize();
+  relay_snapshot_mask = mask;
+  relay_snapshot_version = version;
+  __sync_synchronize();
+  relay_snapshot_seq++;
+
+  relay_rtc_mirror.magic = RELAY_RTC_MAGIC;
+  relay_rtc_mirror.mask = mask;
+  relay_rtc_mirror.version = version;
+  relay_rtc_mirror.check = relay_rtc_check(&relay_rtc_mirror);
+}
+
+/**
+ * Apply a new state word to the selected relays (actor context).
+ * State, version, dirty flag and logging are updated once per call.
+ */
+static void relays_apply(relay_mask_t mask, relay_mask_t value) {
+  mask &= RELAY_MASK_ALL;
+  if (mask == 0) {
+    return;
+  }
+
+  relays_write_outputs(mask, value);
+
+  relay_mask_t changed = (relay_snapshot_mask ^ value) & mask;
+  if (changed == 0) {
+    return;
+  }
+
+  for (int i = 0; i < NUM_RELAYS; i++) {
+    if ((changed >> i) & 1) {
+      relay_states[i] = (value >> i) & 1;
+    }
+  }
+  relays_publish(relay_snapshot_mask ^ changed, relay_snapshot_version + 1);
+  if (relays_change_hook != NULL) {
+    relays_change_hook();
+  }
+
+  // Mark as dirty - actual save happens once the batch is done
+  if (!relay_states_dirty) {
+    relay_dirty_since = esp_timer_get_time() / 1000;
+  }
+  relay_states_dirty = true;
+
+  if ((changed & (changed - 1)) == 0) {
+    int relay_num = __builtin_ctz(changed);
+    ESP_LOGI(TAG, "Relay %d (GPIO %d) -> %s", relay_num + 1, relays[relay_num], relay_states[relay_num] ? "ON" : "OFF");
+  } else {
+    ESP_LOGI(TAG, "Relays 0x%08X -> 0x%08X", (unsigned)changed, (unsigned)(value & changed));
+  }
+}
+
+/**
+ * Persist relay states (actor context).
+ * With a journal partition every change is appended immediately; otherwise the
+ * relay_state NVS blob is left to the persist service, which writes it once
+ * states have been stable for RELAY_SAVE_DELAY_MS.
+ */
+static void relays_check_save(void) {
+  if (!relay_states_dirty) {
+    return;
+  }
+
+  if (journal_available()) {
+    // A degraded journal is retried when its backoff ends, with the state current by then
+    if (journal_retry_wait_ms() > 0) {
+      return;
+    }
+    // A remote button is often still transmitting repeats when its toggle lands here
+    uint32_t waited = esp_timer_get_time() / 1000 - relay_dirty_since;
+    if (!persist_flash_allowed(waited, RELAY_JOURNAL_DEFER_MS, &relay_save_deferred)) {
+      return;
+    }
+    persist_flash_begin();
+    relay_states_dirty = !journal_append(relay_snapshot_mask, relay_snapshot_version);
+    persist_flash_end();
+    if (!relay_states_dirty) {
+      relay_save_deferred = false; // written; a failed append stays the same pending write
+    }
+  } else {
+    relay_states_dirty = false;
+    persist_mark_dirty(relay_persist_id);
+  }
+}
+
+// Configure the relay pins as outputs (once) and precompute their register bits
+static void relays_gpio_init(void) {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  done = true;
 
-void relays_init(void) {
   gpio_config_t io_conf = {
       .pin_bit_mask = 0,
       .mode = GPIO_MODE_OUTPUT,
@@ -26,45 +254,245 @@ void relays_init(void) {
   // Build the pin mask
   for (int i = 0; i < NUM_RELAYS; i++) {
     io_conf.pin_bit_mask |= (1ULL << relays[i]);
+    relay_gpio_bits[i] = relays[i] < 16 ? (1UL << relays[i]) : 0;
   }
 
   gpio_config(&io_conf);
+}
+
+/**
+ * Restore relay outputs from the RTC mirror after a warm reset (watchdog, panic,
+ * software restart). Call first thing in app_main: it needs neither NVS nor the
+ * flash journal, so relays are back in their state within a few ms of boot.
+ * Returns false on cold boot or if the mirror doesn't check out.
+ */
+bool relays_early_restore(void) {
+  switch (esp_reset_reason()) {
+  case ESP_RST_SW:
+  case ESP_RST_PANIC:
+  case ESP_RST_INT_WDT:
+  case ESP_RST_TASK_WDT:
+  case ESP_RST_WDT:
+    break;
+  default:
+    return false;  // RTC memory doesn't survive power loss
+  }
+
+  if (relay_rtc_mirror.magic != RELAY_RTC_MAGIC || relay_rtc_mirror.check != relay_rtc_check(&relay_rtc_mirror)) {
+    return false;
+  }
 
-  // Try to load saved states from NVS
-  if (pairing_load_relay_states(relay_states, NUM_RELAYS)) {
+  relay_mask_t restored = relay_rtc_mirror.mask & RELAY_MASK_ALL;
+  relays_gpio_init();
+  relays_write_outputs(RELAY_MASK_ALL, restored);
+
+  for (int i = 0; i < NUM_RELAYS; i++) {
+    relay_states[i] = (restored >> i) & 1;
+  }
+  relays_publish(restored, relay_rtc_mirror.version);
+  relay_rtc_restored = true;
+
+  ESP_LOGI(TAG, "Warm reset: relay states 0x%08X restored from RTC memory", (unsigned)restored);
+  return true;
+}
+
+void relays_init(void) {
+  relays_gpio_init();
+
+  relay_mask_t restored = 0;
+  uint32_t journalled = 0;
+
+  // Prefer the journal; NVS holds states saved before it existed (or without it)
+  bool from_journal = journal_init(&journalled);
+  if (!journal_available()) {
+    relay_persist_id = persist_register(NVS_KEY_RELAY_STATE, relay_states, NUM_RELAYS, PERSIST_BLOB, RELAY_SAVE_DELAY_MS,
+                                        RELAY_SAVE_MAX_MS);
+  }
+
+  if (relay_rtc_restored) {
+    // Outputs are already set; the journal may have missed the last change before the reset
+    relay_states_dirty = journal_available() && (!from_journal || journalled != relay_snapshot_mask);
+    return;
+  }
+
+  if (from_journal) {
+    restored = journalled & RELAY_MASK_ALL;
+    for (int i = 0; i < NUM_RELAYS; i++) {
+      relay_states[i] = (restored >> i) & 1;
+      ESP_LOGI(TAG, "Relay %d (GPIO %d) restored -> %s", i + 1, relays[i], relay_states[i] ? "ON" : "OFF");
+    }
+  } else if (pairing_load_relay_states(relay_states, NUM_RELAYS)) {
     ESP_LOGI(TAG, "Restored relay states from NVS");
-    // Apply restored states
     for (int i = 0; i < NUM_RELAYS; i++) {
-      gpio_set_level(relays[i], relay_states[i]);
+      if (relay_states[i]) {
+        restored |= (relay_mask_t)1 << i;
+      }
       ESP_LOGI(TAG, "Relay %d (GPIO %d) restored -> %s", i + 1, relays[i], 
                relay_states[i] ? "ON" : "OFF");
     }
+    relay_states_dirty = journal_available();  // Seed the journal
   } else {
     ESP_LOGI(TAG, "No saved states, initializing relays to OFF");
-    // Turn all off initially
-    for (int i = 0; i < NUM_RELAYS; i++) {
-      relay_states[i] = 0;
-      gpio_set_level(relays[i], 0);
+    memset(relay_states, 0, sizeof(relay_states));
+  }
+
+  relays_write_outputs(RELAY_MASK_ALL, restored);
+  relays_publish(restored, 0);
+}
+
+/**
+ * Relay owner task: drain the queue, fold the batch into one state word, apply it
+ * with a single output write and wake everyone who waited on a command in it,
+ * then persist the result.
+ */
+static void relays_task(void* pvParameters) {
+  relay_cmd_t cmd;
+
+  // Anything left dirty by relays_init() (journal seeding, warm restore)
+  relays_check_save();
+
+  while (1) {
+    // Poll for a quiet RF window while a journal write is pending (or for the end of its backoff)
+    uint32_t retry_ms = journal_retry_wait_ms();
+    TickType_t wait = !relay_states_dirty ? portMAX_DELAY
+                      : pdMS_TO_TICKS(retry_ms > RELAY_JOURNAL_RETRY_MS ? retry_ms : RELAY_JOURNAL_RETRY_MS);
+    if (xQueueReceive(relay_queue, &cmd, wait) != pdTRUE) {
+      relays_check_save();
+      continue;
+    }
+
+    int64_t start = esp_timer_get_time();
+    relay_mask_t state = relay_snapshot_mask;
+    relay_mask_t touched = 0;
+    relay_cmd_t batch[RELAY_QUEUE_LEN];
+    uint32_t count = 0;
+
+    // Applying the folded result equals applying each command in order;
+    // only the intermediate states (e.g. a double toggle) are skipped
+    do {
+      if (cmd.op == RELAY_OP_TOGGLE) {
+        state ^= cmd.mask;
+      } else {
+        state = (state & ~cmd.mask) | (cmd.value & cmd.mask);
+      }
+      touched |= cmd.mask;
+      batch[count++] = cmd;
+    } while (count < RELAY_QUEUE_LEN && xQueueReceive(relay_queue, &cmd, 0) == pdTRUE);
+
+    relays_apply(touched, state);
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (batch[i].waiter != NULL) {
+        *batch[i].done = true;
+        xTaskNotify(batch[i].waiter, RELAYS_NOTIFY_DONE, eSetBits);
+      }
+    }
+
+    // Journal after waking the callers; they don't need to wait for flash
+    relays_check_save();
+
+    uint32_t elapsed_us = esp_timer_get_time() - start;
+    relay_stats.commands += count;
+    relay_stats.batches++;
+    relay_stats.apply_us_total += elapsed_us;
+    if (count > relay_stats.max_batch) {
+      relay_stats.max_batch = count;
+    }
+    if (elapsed_us > relay_stats.apply_us_max) {
+      relay_stats.apply_us_max = elapsed_us;
     }
   }
 }
 
-// Control by relay number (0-based index)
-void relay_set(uint8_t relay_num, uint8_t state) {
-  if (relay_num >= NUM_RELAYS) {
-    ESP_LOGE(TAG, "Invalid relay number: %d", relay_num);
+/**
+ * Get told about state changes as they are published, instead of polling the version.
+ * The hook runs in the actor, so it must be quick and must not submit commands.
+ */
+void relays_set_change_hook(relays_change_hook_t hook) {
+  relays_change_hook = hook;
+}
+
+// Start the relay owner task; call once after relays_init()
+void relays_start(void) {
+  relay_queue = xQueueCreate(RELAY_QUEUE_LEN, sizeof(relay_cmd_t));
+  if (relay_queue == NULL) {
+    ESP_LOGE(TAG, "Failed to create relay queue");
     return;
   }
+  xTaskCreate(relays_task, "relay_task", 2048, NULL, RELAY_TASK_PRIORITY, &relay_task_handle);
+}
+
+/**
+ * Queue a command and block until the actor has applied it, so the caller can
+ * read back the result. Before the actor runs (early boot) it is applied directly.
+ * Returns false if the queue stayed full and the command was dropped.
+ */
+static bool relays_submit(relay_op_t op, relay_mask_t mask, relay_mask_t value) {
+  if (relay_task_handle == NULL) {
+    relay_mask_t state = relay_snapshot_mask;
+    relays_apply(mask, op == RELAY_OP_TOGGLE ? state ^ mask : value);
+    return true;
+  }
 
-  uint8_t pin = relays[relay_num];
-  gpio_set_level(pin, state);
-  relay_states[relay_num] = state;
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  volatile bool done = false;
+  relay_cmd_t cmd = {
+      .op = op,
+      .mask = mask,
+      .value = value,
+      .waiter = self == relay_task_handle ? NULL : self,
+      .done = &done,
+  };
 
-  // Mark as dirty and update timestamp - actual save happens later
-  relay_states_dirty = true;
-  last_relay_change_time = esp_timer_get_time() / 1000;
+  if (xQueueSend(relay_queue, &cmd, pdMS_TO_TICKS(100)) != pdTRUE) {
+    relay_stats.queue_full++;
+    ESP_LOGW(TAG, "Relay queue full, command dropped");
+    return false;
+  }
+
+  // done lives on our stack, so wait for it even if unrelated notifications arrive
+  while (cmd.waiter != NULL && !done) {
+    xTaskNotifyWait(0, RELAYS_NOTIFY_DONE, NULL, portMAX_DELAY);
+  }
+  return true;
+}
+
+// Set the relays selected by mask to the corresponding bits in value, all at once; false if busy
+bool relays_set_mask(relay_mask_t mask, relay_mask_t value) {
+  return relays_submit(RELAY_OP_SET, mask, value);
+}
+
+// Invert the relays selected by mask, all at once; false if busy
+bool relays_toggle_mask(relay_mask_t mask) {
+  return relays_submit(RELAY_OP_TOGGLE, mask, 0);
+}
 
-  ESP_LOGI(TAG, "Relay %d (GPIO %d) -> %s", relay_num + 1, pin, state ? "ON" : "OFF");
+// Read states and version as one consistent pair without locking
+void relays_snapshot(relay_mask_t* mask, uint32_t* version) {
+  uint32_t seq;
+  do {
+    seq = relay_snapshot_seq;
+    __sync_synchronize();
+    *mask = relay_snapshot_mask;
+    *version = relay_snapshot_version;
+    __sync_synchronize();
+  } while ((seq & 1) || seq != relay_snapshot_seq);
+}
+
+// Control by relay number (0-based index); false if the number is invalid or the relays are busy
+bool relay_set(uint8_t relay_num, uint8_t state) {
+  if (relay_num >= NUM_RELAYS) {
+    ESP_LOGE(TAG, "Invalid relay number: %d", relay_num);
+    return false;
+  }
+
+  relay_mask_t bit = (relay_mask_t)1 << relay_num;
+  return relays_set_mask(bit, state ? bit : 0);
+}
+
+// Get all relay states as a bitmask (bit n = relay n)
+relay_mask_t relay_get_mask(void) {
+  return relay_snapshot_mask;
 }
 
 // Get relay state
@@ -72,19 +500,30 @@ uint8_t relay_get(uint8_t relay_num) {
   if (relay_num >= NUM_RELAYS) {
     return 0;
   }
-  return relay_states[relay_num];
+  return (relay_get_mask() >> relay_num) & 1;
 }
 
-// Check if relay states need to be saved (call from main loop)
-void relays_check_save(void) {
-  if (relay_states_dirty) {
-    uint32_t now = esp_timer_get_time() / 1000;
-    if (now - last_relay_change_time >= RELAY_SAVE_DELAY_MS) {
-      ESP_LOGD(TAG, "Saving relay states to NVS");
-      pairing_save_relay_states(relay_states, NUM_RELAYS);
-      relay_states_dirty = false;
-    }
+// Toggle one relay (read the new state with relay_get); false if the number is invalid or the relays are busy
+bool relay_toggle(uint8_t relay_num) {
+  if (relay_num >= NUM_RELAYS) {
+    ESP_LOGE(TAG, "Invalid relay number: %d", relay_num);
+    return false;
   }
+
+  return relays_toggle_mask((relay_mask_t)1 << relay_num);
+}
+
+// Monotonic counter of relay state changes
+uint32_t relay_get_version(void) {
+  relay_mask_t mask;
+  uint32_t version;
+  relays_snapshot(&mask, &version);
+  return version;
+}
+
+// Copy of the actuation counters (diagnostics only, may be slightly torn)
+void relays_get_stats(relay_stats_t* out) {
+  *out = relay_stats;
 }
 
 #endif /* RELAYS_H */
\ No newline at end of file
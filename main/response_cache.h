@@ -0,0 +1,221 @@
+/**
+ * @file response_cache.h
+ * @brief Prebuilt binary protocol responses for DESCRIBE and config queries
+ *
+ * DESCRIBE never changes at runtime and is serialized once. The config
+ * responses are rebuilt only when relay_config_mark_dirty() bumps the config
+ * generation; relay states are patched into the cached frames in place, so
+ * relay_set() never forces a rebuild.
+ */
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "config.h"
+#include "protocol.h"
+#include "relays.h"
+#include "relay_config.h"
+
+// [ID TLV:3][NAME TLV:2+31][ROOM TLV:2+23][ICON, ALEXA, STATE TLVs:9]
+#define RESP_CACHE_RELAY_CONFIG_MAX (3 + 3 + (2 + RELAY_NAME_MAX_LEN - 1) + (2 + RELAY_ROOM_MAX_LEN - 1) + 9)
+
+typedef struct {
+    uint32_t generation;            // relay_config generation the frame was built from
+    uint16_t len;                   // 0 = not built yet
+    uint16_t state_off;             // offset of the relay state byte in frame
+    uint8_t frame[RESP_CACHE_RELAY_CONFIG_MAX];
+} resp_cache_relay_t;
+
+typedef struct {
+    uint32_t generation;
+    uint16_t len;
+    uint16_t state_off[NUM_RELAYS]; // 0 = relay didn't fit in the v2 frame
+    uint8_t frame[MAX_RESP_FRAME];
+} resp_cache_all_t;
+
+// [long header:4][count:1] then per relay [id][name_len][name][room_len][room][icon][alexa][state]
+#define RESP_CACHE_ALL_V3_MAX (4 + 1 + NUM_RELAYS * (6 + (RELAY_NAME_MAX_LEN - 1) + (RELAY_ROOM_MAX_LEN - 1)))
+
+typedef struct {
+    uint32_t generation;
+    uint16_t len;
+    uint16_t state_off[NUM_RELAYS];
+    uint8_t frame[RESP_CACHE_ALL_V3_MAX];
+} resp_cache_all_v3_t;
+
+static uint8_t resp_cache_describe_frame[64];
+static uint16_t resp_cache_describe_len = 0;
+static resp_cache_relay_t resp_cache_relay[NUM_RELAYS];
+static resp_cache_all_t resp_cache_all;
+static resp_cache_all_v3_t resp_cache_all_v3;
+
+/**
+ * @brief Append a TLV to a response payload, returns the new payload length
+ */
+static size_t resp_cache_put_tlv(uint8_t* data, size_t idx, uint8_t type, const void* value, uint8_t len) {
+    data[idx++] = type;
+    data[idx++] = len;
+    memcpy(&data[idx], value, len);
+    return idx + len;
+}
+
+/**
+ * @brief Get the DESCRIBE response frame
+ */
+const uint8_t* resp_cache_describe(size_t* len) {
+    if (resp_cache_describe_len == 0) {
+        uint8_t* data = resp_cache_describe_frame + 3;
+        size_t idx = 0;
+        uint8_t relay_count = (uint8_t)NUM_RELAYS;
+        uint8_t capabilities = CAP_RELAY | CAP_ALEXA | CAP_WIDE_MASK;
+
+        idx = resp_cache_put_tlv(data, idx, DESC_DEVICE_TYPE, "switch", 6);
+        idx = resp_cache_put_tlv(data, idx, DESC_MODEL, "SR-4", 4);
+        idx = resp_cache_put_tlv(data, idx, DESC_RELAY_COUNT, &relay_count, 1);
+        idx = resp_cache_put_tlv(data, idx, DESC_CAPABILITIES, &capabilities, 1);
+        idx = resp_cache_put_tlv(data, idx, DESC_FW_VERSION, "2.0.0", 5);
+
+        resp_cache_describe_len = proto_build_response(resp_cache_describe_frame, RESP_DESCRIBE, data, idx);
+    }
+
+    *len = resp_cache_describe_len;
+    return resp_cache_describe_frame;
+}
+
+/**
+ * @brief Get the GET_RELAY_CONFIG response frame for one relay
+ * @return NULL for an invalid relay
+ */
+const uint8_t* resp_cache_relay_config(uint8_t relay_id, size_t* len) {
+    if (relay_id >= NUM_RELAYS) {
+        return NULL;
+    }
+
+    resp_cache_relay_t* entry = &resp_cache_relay[relay_id];
+    uint32_t generation = relay_config_get_generation();
+
+    if (entry->len == 0 || entry->generation != generation) {
+        const relay_config_entry_t* cfg = relay_config_get(relay_id);
+        uint8_t* data = entry->frame + 3;
+        size_t idx = 0;
+        uint8_t state = 0;
+
+        idx = resp_cache_put_tlv(data, idx, CFG_RELAY_ID, &relay_id, 1);
+        idx = resp_cache_put_tlv(data, idx, CFG_RELAY_NAME, cfg->name, strnlen(cfg->name, RELAY_NAME_MAX_LEN - 1));
+        idx = resp_cache_put_tlv(data, idx, CFG_RELAY_ROOM, cfg->room, strnlen(cfg->room, RELAY_ROOM_MAX_LEN - 1));
+        idx = resp_cache_put_tlv(data, idx, CFG_RELAY_ICON, &cfg->icon, 1);
+        idx = resp_cache_put_tlv(data, idx, CFG_RELAY_ALEXA, &cfg->alexa_enabled, 1);
+        idx = resp_cache_put_tlv(data, idx, CFG_RELAY_STATE, &state, 1);
+
+        entry->state_off = 3 + idx - 1;
+        entry->len = proto_build_response(entry->frame, RESP_CONFIG, data, idx);
+        entry->generation = generation;
+    }
+
+    entry->frame[entry->state_off] = relay_get(relay_id);
+
+    *len = entry->len;
+    return entry->frame;
+}
+
+/**
+ * @brief Get the GET_ALL_CONFIG response frame
+ *
+ * Format: [count:1] then for each: [id:1][name_len:1][name:N][state:1][alexa:1]
+ * Relays whose names no longer fit in a v2 frame are left out of it (and of count).
+ */
+const uint8_t* resp_cache_all_config(size_t* len) {
+    resp_cache_all_t* entry = &resp_cache_all;
+    uint32_t generation = relay_config_get_generation();
+
+    if (entry->len == 0 || entry->generation != generation) {
+        uint8_t* data = entry->frame + 3;
+        size_t idx = 0;
+
+        // Offsets from the previous build would point into the new names
+        memset(entry->state_off, 0, sizeof(entry->state_off));
+        data[idx++] = 0;  // count, set below
+
+        for (int i = 0; i < NUM_RELAYS; i++) {
+            const relay_config_entry_t* cfg = relay_config_get(i);
+            uint8_t name_len = strnlen(cfg->name, RELAY_NAME_MAX_LEN - 1);
+
+            if (idx + 4 + name_len > MAX_RESP_DATA) {
+                break;  // Only a v2 frame; the relays that don't fit are left out
+            }
+            data[0]++;
+
+            data[idx++] = i;  // relay id
+            data[idx++] = name_len;
+            memcpy(&data[idx], cfg->name, name_len);
+            idx += name_len;
+
+            entry->state_off[i] = 3 + idx;
+            data[idx++] = 0;  // state, patched below
+            data[idx++] = cfg->alexa_enabled;
+        }
+
+        entry->len = proto_build_response(entry->frame, RESP_CONFIG, data, idx);
+        entry->generation = generation;
+    }
+
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        if (entry->state_off[i]) {
+            entry->frame[entry->state_off[i]] = relay_get(i);
+        }
+    }
+
+    *len = entry->len;
+    return entry->frame;
+}
+
+/**
+ * @brief Get the GET_ALL_CONFIG_V3 long response frame
+ *
+ * Covers every relay regardless of NUM_RELAYS.
+ * Format: [count:1] then for each: [id:1][name_len:1][name:N][room_len:1][room:N][icon:1][alexa:1][state:1]
+ */
+const uint8_t* resp_cache_all_config_v3(size_t* len) {
+    resp_cache_all_v3_t* entry = &resp_cache_all_v3;
+    uint32_t generation = relay_config_get_generation();
+
+    if (entry->len == 0 || entry->generation != generation) {
+        uint8_t* data = entry->frame + 4;
+        size_t idx = 0;
+
+        data[idx++] = NUM_RELAYS;
+
+        for (int i = 0; i < NUM_RELAYS; i++) {
+            const relay_config_entry_t* cfg = relay_config_get(i);
+            uint8_t name_len = strnlen(cfg->name, RELAY_NAME_MAX_LEN - 1);
+            uint8_t room_len = strnlen(cfg->room, RELAY_ROOM_MAX_LEN - 1);
+
+            data[idx++] = i;
+            data[idx++] = name_len;
+            memcpy(&data[idx], cfg->name, name_len);
+            idx += name_len;
+            data[idx++] = room_len;
+            memcpy(&data[idx], cfg->room, room_len);
+            idx += room_len;
+            data[idx++] = cfg->icon;
+            data[idx++] = cfg->alexa_enabled;
+
+            entry->state_off[i] = 4 + idx;
+            data[idx++] = 0;  // state, patched below
+        }
+
+        entry->len = proto_long_response_header(entry->frame, RESP_CONFIG, idx) + idx;
+        entry->generation = generation;
+    }
+
+    for (int i = 0; i < NUM_RELAYS; i++) {
+        entry->frame[entry->state_off[i]] = relay_get(i);
+    }
+
+    *len = entry->len;
+    return entry->frame;
+}
+
+#endif // RESPONSE_CACHE_H
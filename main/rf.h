@@ -9,13 +9,18 @@
 #ifndef RF_H
 #define RF_H
 
+#include <stdlib.h>
+#include <string.h>
 #include "esp_log.h"
 #include "esp_timer.h"
+#include "nvs.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "rfcodes/rfcodes.h"
 #include "relays.h"
 #include "pairing.h"
+#include "persist.h"
+#include "boot_profile.h"
 #include "status_led.h"
 
 #define RF_TAG "RF433"
@@ -28,92 +33,102 @@
 static signal_parser_t rf_parser;
 static signal_collector_t rf_collector;
 
-// Last received code for debouncing
-static char last_rf_code[MAX_SEQUENCE_LENGTH + PROTNAME_LEN + 2] = {0};
-static uint32_t last_rf_time = 0;
-#define RF_DEBOUNCE_MS 200  // Quick debounce for duplicate signals
+// Last received frame for debouncing
+static signal_frame_t last_rf_frame = {0};
+static uint32_t last_rf_time = 0;        // last frame decoded, of any protocol
+static uint32_t last_rf_press_time = 0;  // last frame that could pair or toggle
+#define RF_DEBOUNCE_MS 200  // Frames closer together than this belong to one press
 
 // Per-button hold detection - tracks last toggle time for each relay
 static uint32_t last_toggle_time[4] = {0, 0, 0, 0};
 
-/**
- * @brief Extract address from EV1527 sequence
- * @param sequence Full sequence (s + 20 address + 4 data)
- * @param address Output buffer for address (must be 21 bytes)
- * @param data Output for 4-bit data value
- * @return true if valid EV1527 sequence
- */
-static bool rf_parse_ev1527(const char *sequence, char *address, uint8_t *data) {
-    if (strlen(sequence) != 25 || sequence[0] != 's') {
-        return false;
-    }
-    
-    // Extract address (20 bits)
-    strncpy(address, sequence + 1, 20);
-    address[20] = '\0';
-    
-    // Extract and convert data (4 bits)
-    *data = 0;
-    for (int i = 0; i < 4; i++) {
-        *data = (*data << 1) | (sequence[21 + i] == '1' ? 1 : 0);
-    }
-    
-    return true;
-}
+// Task notification bit set by the receive ISR (distinct from RELAYS_NOTIFY_DONE, which this task also waits on)
+#define RF_NOTIFY_TIMINGS 0x00000001
+// Timings that never complete a frame are decoded after this long, so they don't hold off flash writes
+#define RF_LEFTOVER_DRAIN_MS 100
+
+// Flash writes wait until no frame has been decoded for this long (remotes repeat frames while held)
+#define RF_FLASH_QUIET_MS 300
+// Frames lost within this long of a flash write are blamed on it
+#define RF_FLASH_BLAME_MS 50
+
+typedef struct {
+    uint32_t frames;             // sequences decoded
+    uint32_t broken_frames;      // sequences lost part-way
+    uint32_t overflows;          // timings dropped on a full ring buffer
+    uint32_t lost_during_flash;  // broken frames + overflows coinciding with flash writes
+    uint32_t rejected_spikes;    // noise spikes dropped by the glitch filter
+    uint32_t buffer_high_water;  // most timings waiting for the decoder at once
+    uint32_t buffer_size;
+    uint32_t learn_rejected;     // remotes learned whose protocol does not fit the decoder slots left
+} rf_stats_t;
+
+static rf_stats_t rf_stats;
+
+#define RF_EV1527_BITS 24  // 20 address + 4 data bits
+
+// Protocol learned from a remote none of the built-in definitions decode (see rf_learn_observe)
+#define NVS_KEY_RF_LEARNED "rf_learned"
+#define RF_LEARN_BUFFER 512    // timings kept while learning, enough for SIGNAL_LEARN_REPEATS 64-bit frames
+#define RF_LEARN_MAX_BITS 36   // learned frames are read like EV1527: 4 button bits below the address
+
+static signal_learned_t rf_learned;              // persisted; version 0 = none
+static signal_protocol_t* rf_learned_protocol;   // built from rf_learned and loaded into rf_parser
+static int rf_learned_persist_id = -1;
+static signal_learner_t* rf_learner;             // allocated while pairing mode is active
+static bool rf_learn_done;                       // one protocol per pairing session
+static signal_learned_t rf_learn_result;         // inferred by the observer, installed by rf_learn_apply()
+static bool rf_learn_ready;
 
 /**
  * @brief Callback function called when a valid RF code is received
- * @param code The received code string in format "<protocol> <sequence>"
+ * @param frame The decoded frame
  */
-static void rf_code_received_callback(const char *code) {
+static void rf_code_received_callback(const signal_frame_t *frame) {
     uint32_t now = esp_timer_get_time() / 1000;  // Convert to ms
     
     // Basic debounce: ignore if same code received within short time
-    if (strcmp(code, last_rf_code) == 0 && (now - last_rf_time < RF_DEBOUNCE_MS)) {
-        return;
-    }
-    
-    // Store for debouncing
-    strncpy(last_rf_code, code, sizeof(last_rf_code) - 1);
-    last_rf_code[sizeof(last_rf_code) - 1] = '\0';
+    bool repeat = frame->protocol_id == last_rf_frame.protocol_id && frame->bits == last_rf_frame.bits &&
+                  frame->payload == last_rf_frame.payload && (now - last_rf_time < RF_DEBOUNCE_MS);
+
+    // Store for debouncing; repeats count too, so a held button stays one press
+    last_rf_frame = *frame;
     last_rf_time = now;
-    
-    ESP_LOGI(RF_TAG, "Received: %s", code);
-    
-    // Parse the code to extract protocol and sequence
-    const char *space = strchr(code, ' ');
-    if (!space) {
-        return;
+
+    // Only EV1527 and the learned protocol (same layout, other timings or length) pair or toggle.
+    // One press acts once: it repeats while held, and may decode as both of them
+    bool actionable = (frame->protocol_id == PROTOCOL_ID_EV1527 && frame->bits == RF_EV1527_BITS) ||
+                      frame->protocol_id == PROTOCOL_ID_LEARNED;
+    bool same_press = actionable && now - last_rf_press_time < RF_DEBOUNCE_MS;
+    if (actionable) {
+        last_rf_press_time = now;
     }
-    
-    char protocol[PROTNAME_LEN] = {0};
-    int proto_len = space - code;
-    if (proto_len >= PROTNAME_LEN) {
+
+    if (repeat) {
         return;
     }
-    strncpy(protocol, code, proto_len);
-    const char *sequence = space + 1;
     
-    ESP_LOGI(RF_TAG, "Protocol: %s, Sequence: %s", protocol, sequence);
+    rf_stats.frames++;
+    
+    ESP_LOGI(RF_TAG, "Received: %s, %d bits: 0x%08X",
+             signal_parser_get_protocol_name(&rf_parser, frame->protocol_id), frame->bits, (uint32_t)frame->payload);
     
-    // Only handle EV1527 protocol
-    if (strcmp(protocol, "ev1527") != 0) {
+    if (!actionable) {
         return;
     }
-    
-    // Parse EV1527 sequence
-    char address[21];
-    uint8_t data;
-    if (!rf_parse_ev1527(sequence, address, &data)) {
-        ESP_LOGW(RF_TAG, "Invalid EV1527 sequence");
+    if (same_press) {
+        ESP_LOGD(RF_TAG, "Same press as the last frame - ignoring");
         return;
     }
     
-    ESP_LOGD(RF_TAG, "Address: %s, Data: 0x%X", address, data);
+    uint32_t address = (uint32_t)(frame->payload >> 4);
+    uint8_t data = frame->payload & 0xF;
+    
+    ESP_LOGD(RF_TAG, "Address: 0x%05X, Data: 0x%X", address, data);
     
     // Check if in pairing mode
     if (pairing_is_active()) {
-        ESP_LOGI(RF_TAG, "Pairing mode: Learning address %s", address);
+        ESP_LOGI(RF_TAG, "Pairing mode: Learning address 0x%05X", address);
         if (pairing_save_address(address)) {
             ESP_LOGI(RF_TAG, "Remote paired successfully!");
             pairing_exit_mode();
@@ -131,8 +146,8 @@ static void rf_code_received_callback(const char *code) {
     }
     
     // Verify address matches paired remote
-    if (strcmp(address, pairing_get_address()) != 0) {
-        ESP_LOGW(RF_TAG, "Unknown remote address: %s (expected: %s)", 
+    if (address != pairing_get_address()) {
+        ESP_LOGW(RF_TAG, "Unknown remote address: 0x%05X (expected: 0x%05X)", 
                  address, pairing_get_address());
         return;
     }
@@ -178,10 +193,13 @@ static void rf_code_received_callback(const char *code) {
         return;
     }
     
-    // Toggle the relay
-    uint8_t current_state = relay_get(relay_num);
-    uint8_t new_state = !current_state;
-    relay_set(relay_num, new_state);
+    // Toggle the relay; if the relays are busy, the remote's next repeat or press retries
+    if (!relay_toggle(relay_num)) {
+        ESP_LOGW(RF_TAG, "Button %s pressed, relays busy - ignored", button_name);
+        return;
+    }
+    uint8_t new_state = relay_get(relay_num);
+    boot_mark(BOOT_FIRST_RF_CONTROL);
     
     // Update last toggle time
     last_toggle_time[relay_num] = now;
@@ -190,6 +208,167 @@ static void rf_code_received_callback(const char *code) {
              button_name, relay_num + 1, new_state ? "ON" : "OFF");
 }
 
+/**
+ * @brief Load a learned protocol in place of the current one
+ * @return false if it can't be used; the current one stays loaded
+ */
+static bool rf_learned_install(const signal_learned_t* learned) {
+    if (learned->bits * learned->data_codes > RF_LEARN_MAX_BITS) {
+        ESP_LOGW(RF_TAG, "Learned protocol has %d bits, at most %d can be paired",
+                 learned->bits * learned->data_codes, RF_LEARN_MAX_BITS);
+        return false;
+    }
+    if (rf_learned_protocol == NULL) {
+        rf_learned_protocol = (signal_protocol_t*)malloc(sizeof(signal_protocol_t));
+        if (rf_learned_protocol == NULL) {
+            return false;
+        }
+    }
+
+    signal_parser_unload(&rf_parser, PROTOCOL_ID_LEARNED);
+    if (signal_learner_build(learned, rf_learned_protocol) && signal_parser_load(&rf_parser, rf_learned_protocol)) {
+        return true;
+    }
+
+    // Keep the previously learned remote working
+    if (signal_learner_build(&rf_learned, rf_learned_protocol)) {
+        signal_parser_load(&rf_parser, rf_learned_protocol);
+    }
+    return false;
+}
+
+/**
+ * @brief Load the protocol learned before the last reset, if any
+ */
+static void rf_learned_load(void) {
+    rf_learned_persist_id = persist_register(NVS_KEY_RF_LEARNED, &rf_learned, sizeof(rf_learned), PERSIST_BLOB, 0, 0);
+
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    size_t size = sizeof(rf_learned);
+    if (nvs_get_blob(nvs_handle, NVS_KEY_RF_LEARNED, &rf_learned, &size) != ESP_OK || size != sizeof(rf_learned)) {
+        memset(&rf_learned, 0, sizeof(rf_learned));
+    }
+    nvs_close(nvs_handle);
+
+    if (rf_learned.version != 0) {
+        if (rf_learned_install(&rf_learned)) {
+            ESP_LOGI(RF_TAG, "Learned protocol loaded: base %u us, %d bits", rf_learned.base_time,
+                     rf_learned.bits * rf_learned.data_codes);
+        } else {
+            ESP_LOGW(RF_TAG, "Saved learned protocol is unusable");
+        }
+    }
+}
+
+/**
+ * @brief Timing observer while pairing: infer a protocol from repeats of an unknown remote
+ *
+ * Runs in the decode task, inside signal_collector_loop() while the parser is
+ * walking its protocol list, so it only keeps the result; rf_learn_apply()
+ * loads it once the pass has returned.
+ */
+static void rf_learn_observe(code_time_t duration) {
+    if (rf_learn_done || !signal_learner_add(rf_learner, duration) ||
+        !signal_learner_infer(rf_learner, &rf_learn_result)) {
+        return;
+    }
+    rf_learn_done = true;
+
+    // The built-in protocols take most of the decoder; a remote that can't be loaded must not look learned
+    int needed = signal_learner_slots(&rf_learn_result);
+    int left = SIGNAL_MAX_SLOTS - rf_parser.slot_count + signal_parser_get_slots(&rf_parser, PROTOCOL_ID_LEARNED);
+    if (needed > left) {
+        ESP_LOGW(RF_TAG, "Remote not learned: its protocol needs %d decoder slots, %d are left", needed, left);
+        rf_stats.learn_rejected++;
+        return;
+    }
+    rf_learn_ready = true;
+}
+
+/**
+ * @brief Load a protocol the observer inferred, after the collector pass that found it
+ *
+ * From then on the remote's repeats decode as PROTOCOL_ID_LEARNED and pair like
+ * an EV1527 remote.
+ */
+static void rf_learn_apply(void) {
+    if (!rf_learn_ready) {
+        return;
+    }
+    rf_learn_ready = false;
+
+    if (memcmp(&rf_learn_result, &rf_learned, sizeof(rf_learn_result)) == 0) {
+        return;  // already loaded
+    }
+    if (!rf_learned_install(&rf_learn_result)) {
+        ESP_LOGW(RF_TAG, "Could not use the protocol learned from this remote");
+        return;
+    }
+
+    rf_learned = rf_learn_result;
+    persist_mark_dirty(rf_learned_persist_id);
+    ESP_LOGI(RF_TAG, "Learned protocol: base %u us, %d%% tolerance, %d bits", rf_learned.base_time,
+             rf_learned.tolerance, rf_learned.bits * rf_learned.data_codes);
+}
+
+/**
+ * @brief Start learning when pairing mode is entered and stop when it ends
+ */
+static void rf_learn_update(void) {
+    bool active = pairing_is_active();
+    if (active && rf_learner == NULL) {
+        rf_learner = (signal_learner_t*)malloc(sizeof(signal_learner_t) + RF_LEARN_BUFFER * sizeof(uint16_t));
+        if (rf_learner != NULL) {
+            signal_learner_init(rf_learner, (uint16_t*)(rf_learner + 1), RF_LEARN_BUFFER);
+            rf_learn_done = false;
+            rf_learn_ready = false;
+            signal_collector_attach_observer(&rf_collector, rf_learn_observe);
+        }
+    } else if (!active && rf_learner != NULL) {
+        signal_collector_attach_observer(&rf_collector, NULL);
+        free(rf_learner);
+        rf_learner = NULL;
+    }
+}
+
+/**
+ * @brief Whether RF reception is in progress (flash writes should wait)
+ */
+static bool rf_is_busy(void) {
+    uint32_t now = esp_timer_get_time() / 1000;
+    return signal_collector_is_busy(&rf_collector) || now - last_rf_time < RF_FLASH_QUIET_MS;
+}
+
+/**
+ * @brief Account for frames lost since the last call, blaming recent flash writes
+ */
+static void rf_update_loss_stats(void) {
+    uint32_t broken = rf_parser.broken_frames;
+    uint32_t overflows = signal_collector_get_overflows(&rf_collector);
+    uint32_t lost = (broken - rf_stats.broken_frames) + (overflows - rf_stats.overflows);
+
+    if (lost > 0) {
+        if (persist_flash_recent(RF_FLASH_BLAME_MS)) {
+            rf_stats.lost_during_flash += lost;
+        }
+        rf_stats.broken_frames = broken;
+        rf_stats.overflows = overflows;
+    }
+}
+
+/**
+ * @brief Copy of the RF reception counters
+ */
+void rf_get_stats(rf_stats_t* out) {
+    *out = rf_stats;
+    out->rejected_spikes = signal_collector_get_rejected_spikes(&rf_collector);
+    out->buffer_high_water = signal_collector_get_high_water(&rf_collector);
+    out->buffer_size = signal_collector_get_buffer_size(&rf_collector);
+}
+
 /**
  * @brief Initialize the RF receiver
  */
@@ -200,20 +379,30 @@ void rf_receiver_init(void) {
     // Initialize the signal parser
     signal_parser_init(&rf_parser);
     
-    // Load EV1527 protocol only
-    signal_parser_load(&rf_parser, &protocol_ev1527, 0);
+    // All protocols are decoded in one pass per timing; only EV1527 frames switch relays
+    signal_parser_load(&rf_parser, &protocol_it1);
+    signal_parser_load(&rf_parser, &protocol_it2);
+    signal_parser_load(&rf_parser, &protocol_sc5);
+    signal_parser_load(&rf_parser, &protocol_ev1527);
+    signal_parser_load(&rf_parser, &protocol_cw);
+    rf_learned_load();
+    signal_parser_report_sizes(&rf_parser);
     
     // Attach callback for received codes
     signal_parser_attach_callback(&rf_parser, rf_code_received_callback);
     
     // Initialize the signal collector (handles GPIO and interrupts)
     signal_collector_init(&rf_collector, &rf_parser, RF_RCV_PIN, RF_SEND_PIN, 0);
+    signal_collector_set_min_pulse(&rf_collector, RF_MIN_PULSE_US);
+
+    // Keep NVS and journal writes out of reception windows
+    persist_set_busy_check(rf_is_busy);
     
     ESP_LOGI(RF_TAG, "RF receiver initialized on GPIO %d", RF_RCV_PIN);
     
     // Check pairing status
     if (pairing_is_paired()) {
-        ESP_LOGI(RF_TAG, "Remote paired: %s", pairing_get_address());
+        ESP_LOGI(RF_TAG, "Remote paired: 0x%05X", pairing_get_address());
     } else {
         ESP_LOGW(RF_TAG, "No remote paired - touch pairing wires to pair");
     }
@@ -225,13 +414,19 @@ void rf_receiver_init(void) {
  */
 void rf_decode_task(void *pvParameters) {
     ESP_LOGI(RF_TAG, "RF decode task started");
+    signal_collector_set_notify(&rf_collector, xTaskGetCurrentTaskHandle(), RF_NOTIFY_TIMINGS);
     
     while (1) {
-        // Process any buffered RF signals
+        // Decode everything buffered in one go (learning from it in pairing mode)
+        rf_learn_update();
         signal_collector_loop(&rf_collector);
+        rf_learn_apply();
+        rf_update_loss_stats();
         
-        // Small delay to prevent task starvation
-        vTaskDelay(pdMS_TO_TICKS(10));
+        // Sleep until the ISR reports a possible frame end; leftovers are picked up after a while
+        bool pending = signal_collector_get_buffer_count(&rf_collector) > 0 || signal_parser_in_sequence(&rf_parser) ||
+                       rf_learner != NULL;
+        xTaskNotifyWait(0, RF_NOTIFY_TIMINGS, NULL, pending ? pdMS_TO_TICKS(RF_LEFTOVER_DRAIN_MS) : portMAX_DELAY);
     }
 }
 
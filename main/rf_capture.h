@@ -0,0 +1,237 @@
+/**
+ * @file rf_capture.h
+ * @brief Raw RF timing capture over TCP
+ *
+ * A client connected to RF_CAPTURE_PORT receives every pulse duration the RF
+ * decoder consumes, so noise and unknown remotes can be recorded from an
+ * installed device. Decoding carries on as normal. One client at a time.
+ *
+ * The stream is a sequence of packets, all values little-endian:
+ *
+ *   [MAGIC:1 = 0x52][VERSION:1][COUNT:2][TAP_DROPS:4][OVERFLOWS:4][TIMING:2] x COUNT
+ *
+ * TIMING is a pulse in µs, saturated at 0xFFFF (anything that long is a gap).
+ * TAP_DROPS counts timings dropped since the client connected because it did
+ * not read fast enough (the tap ring filled up while sends were blocked);
+ * OVERFLOWS counts timings the receive ISR could not buffer. Both are
+ * cumulative, so a change between packets marks where data is missing.
+ */
+
+#ifndef RF_CAPTURE_H
+#define RF_CAPTURE_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include "config.h"
+#include "rf.h"
+
+#define RF_CAPTURE_TAG "RFCAP"
+#define RF_CAPTURE_MAGIC 0x52
+#define RF_CAPTURE_VERSION 1
+#define RF_CAPTURE_HEADER 12
+#define RF_CAPTURE_TAP_SIZE 1024     // timings buffered for the client (power of two, 2 bytes each)
+#define RF_CAPTURE_PACKET_TIMINGS 256
+#define RF_CAPTURE_FLUSH_MS 50       // a packet goes out at least this often while timings arrive
+
+typedef struct {
+    uint32_t clients;       // connections accepted
+    uint32_t rejected;      // connections refused because a client was already attached
+    uint32_t packets;
+    uint32_t timings;       // timings sent
+    uint32_t tap_drops;     // timings dropped while sends were blocked (all sessions)
+    uint32_t send_stalls;   // sends that had to wait for the client
+    bool connected;
+} rf_capture_stats_t;
+
+static rf_capture_stats_t rf_capture_stats;
+
+/**
+ * @brief Copy of the capture counters
+ */
+void rf_capture_get_stats(rf_capture_stats_t* out) {
+    *out = rf_capture_stats;
+}
+
+static void rf_capture_put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/**
+ * @brief Build the next packet from the tap ring
+ * @return packet length, 0 if no timings are waiting
+ */
+static size_t rf_capture_fill(uint8_t* packet, uint32_t drops_base) {
+    uint16_t* timings = (uint16_t*)(packet + RF_CAPTURE_HEADER);
+    uint32_t n = signal_collector_tap_read(&rf_collector, timings, RF_CAPTURE_PACKET_TIMINGS);
+    if (n == 0) {
+        return 0;
+    }
+
+    // The ring holds host-order values; the wire is little-endian like the ESP8266
+    for (uint32_t i = 0; i < n; i++) {
+        uint16_t t = timings[i];
+        packet[RF_CAPTURE_HEADER + 2 * i] = t;
+        packet[RF_CAPTURE_HEADER + 2 * i + 1] = t >> 8;
+    }
+
+    packet[0] = RF_CAPTURE_MAGIC;
+    packet[1] = RF_CAPTURE_VERSION;
+    packet[2] = n;
+    packet[3] = n >> 8;
+    rf_capture_put_u32(packet + 4, signal_collector_get_tap_drops(&rf_collector) - drops_base);
+    rf_capture_put_u32(packet + 8, signal_collector_get_overflows(&rf_collector));
+
+    rf_capture_stats.packets++;
+    rf_capture_stats.timings += n;
+    return RF_CAPTURE_HEADER + 2 * n;
+}
+
+static int rf_capture_listen(void) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        ESP_LOGE(RF_CAPTURE_TAG, "Failed to create socket");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(RF_CAPTURE_PORT);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+        ESP_LOGE(RF_CAPTURE_TAG, "Failed to listen on port %d", RF_CAPTURE_PORT);
+        close(sock);
+        return -1;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    ESP_LOGI(RF_CAPTURE_TAG, "Raw RF capture on port %d", RF_CAPTURE_PORT);
+    return sock;
+}
+
+/**
+ * @brief Capture server task: streams the tap ring to the connected client
+ */
+void rf_capture_task(void* pvParameters) {
+    int listen_sock = rf_capture_listen();
+    if (listen_sock < 0) {
+        vTaskDelete(NULL);
+        return;
+    }
+
+    // Allocated on the first connection and kept: the decode loop may still hold the tap pointer
+    uint16_t* tap = NULL;
+    uint8_t* packet = NULL;
+    int client = -1;
+    size_t out_len = 0, out_sent = 0;
+    uint32_t drops_base = 0;
+    bool backlog = false;  // the last packet was full: more timings are probably waiting
+
+    while (1) {
+        fd_set read_fds, write_fds;
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+        FD_SET(listen_sock, &read_fds);
+        int max_fd = listen_sock;
+
+        if (client >= 0) {
+            FD_SET(client, &read_fds);
+            if (out_sent < out_len) {
+                FD_SET(client, &write_fds);
+            }
+            if (client > max_fd) {
+                max_fd = client;
+            }
+        }
+
+        struct timeval tick = {.tv_sec = 0, .tv_usec = backlog ? 0 : RF_CAPTURE_FLUSH_MS * 1000};
+        if (client < 0) {
+            tick.tv_sec = 1;
+            tick.tv_usec = 0;
+        }
+        int ready = select(max_fd + 1, &read_fds, &write_fds, NULL, &tick);
+        if (ready < 0) {
+            ESP_LOGE(RF_CAPTURE_TAG, "select failed (errno %d)", errno);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        if (FD_ISSET(listen_sock, &read_fds)) {
+            int sock = accept(listen_sock, NULL, NULL);
+            if (sock >= 0 && client >= 0) {
+                rf_capture_stats.rejected++;
+                close(sock);
+            } else if (sock >= 0) {
+                if (tap == NULL) {
+                    tap = (uint16_t*)malloc(RF_CAPTURE_TAP_SIZE * sizeof(uint16_t));
+                    packet = (uint8_t*)malloc(RF_CAPTURE_HEADER + 2 * RF_CAPTURE_PACKET_TIMINGS);
+                }
+                if (packet == NULL || !signal_collector_tap_enable(&rf_collector, tap, RF_CAPTURE_TAP_SIZE)) {
+                    ESP_LOGE(RF_CAPTURE_TAG, "No memory for capture buffers");
+                    close(sock);
+                } else {
+                    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+                    client = sock;
+                    out_len = out_sent = 0;
+                    drops_base = signal_collector_get_tap_drops(&rf_collector);
+                    rf_capture_stats.clients++;
+                    rf_capture_stats.connected = true;
+                    ESP_LOGI(RF_CAPTURE_TAG, "Capture client connected");
+                }
+            }
+        }
+
+        if (client < 0) {
+            continue;
+        }
+
+        // Anything from the client is ignored; EOF or an error ends the capture
+        bool closed = false;
+        if (FD_ISSET(client, &read_fds)) {
+            uint8_t discard[16];
+            int n = recv(client, discard, sizeof(discard), 0);
+            closed = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+
+        if (!closed && out_sent == out_len) {
+            out_len = rf_capture_fill(packet, drops_base);
+            out_sent = 0;
+            backlog = out_len == RF_CAPTURE_HEADER + 2 * RF_CAPTURE_PACKET_TIMINGS;
+        }
+
+        // Never block: while the client is slow, timings pile up in the tap ring and are dropped there
+        if (!closed && out_sent < out_len) {
+            int n = send(client, packet + out_sent, out_len - out_sent, 0);
+            if (n > 0) {
+                out_sent += n;
+                if (out_sent < out_len) {
+                    rf_capture_stats.send_stalls++;
+                }
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                rf_capture_stats.send_stalls++;
+            } else {
+                closed = true;
+            }
+        }
+
+        if (closed) {
+            signal_collector_tap_disable(&rf_collector);
+            rf_capture_stats.tap_drops += signal_collector_get_tap_drops(&rf_collector) - drops_base;
+            rf_capture_stats.connected = false;
+            close(client);
+            client = -1;
+            backlog = false;
+            ESP_LOGI(RF_CAPTURE_TAG, "Capture client disconnected");
+        }
+    }
+}
+
+#endif // RF_CAPTURE_H
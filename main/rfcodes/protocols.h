@@ -11,95 +11,105 @@
 #  include "signal_parser.h"
 
 // ===== Protocol Definitions =====
+// Timing windows are computed by the compiler and the definitions are const, so they live in flash.
 
 /**
  * Definition of the "older" intertechno protocol with fixed 12 bits of data
  */
+#  define IT1(n) SIGNAL_TIMING(400, 25, n)
 __attribute__((unused))
-static signal_protocol_t protocol_it1 = {.name = "it1",
-                                         .min_code_len = 1 + 12,
-                                         .max_code_len = 1 + 12,
-                                         .tolerance = 25,
-                                         .send_repeat = 4,
-                                         .base_time = 400,
-                                         .codes = {
-                                             {.type = CODE_TYPE_START, .name = 'B', .time = {1, 31, 0}},
-                                             {.type = CODE_TYPE_DATA, .name = '0', .time = {1, 3, 3, 1, 0}},
-                                             {.type = CODE_TYPE_DATA, .name = '1', .time = {1, 3, 1, 3, 0}},
-                                             {.name = 0} // Terminator
-                                         }};
+static const signal_protocol_t protocol_it1 = {.name = "it1",
+                                               .id = PROTOCOL_ID_IT1,
+                                               .min_code_len = 1 + 12,
+                                               .max_code_len = 1 + 12,
+                                               .tolerance = 25,
+                                               .send_repeat = 4,
+                                               .base_time = 400,
+                                               SIGNAL_CODES(
+                                                   SIGNAL_CODE(CODE_TYPE_START, 'B', 0, 0, IT1(1), IT1(31)),
+                                                   SIGNAL_CODE(CODE_TYPE_DATA, '0', 1, 0, IT1(1), IT1(3), IT1(3), IT1(1)),
+                                                   SIGNAL_CODE(CODE_TYPE_DATA, '1', 1, 1, IT1(1), IT1(3), IT1(1), IT1(3)))};
 
 /**
  * Definition of the "newer" intertechno protocol with 32 - 46 data bits
+ * The dim code 'D' replaces the on/off bit and decodes as 0; dim frames are told apart by their 36+ bits
  */
+#  define IT2(n) SIGNAL_TIMING(280, 25, n)
 __attribute__((unused))
-static signal_protocol_t protocol_it2 = {.name = "it2",
-                                         .min_code_len = 34,
-                                         .max_code_len = 48,
-                                         .tolerance = 25,
-                                         .send_repeat = 10,
-                                         .base_time = 280, // base time in µsecs
-                                         .codes = {
-                                             {.type = CODE_TYPE_START, .name = 's', .time = {1, 10, 0}},
-                                             {.type = CODE_TYPE_DATA, .name = '_', .time = {1, 1, 1, 5, 0}},
-                                             {.type = CODE_TYPE_DATA, .name = '#', .time = {1, 5, 1, 1, 0}},
-                                             {.type = CODE_TYPE_DATA, .name = 'D', .time = {1, 1, 1, 1, 0}},
-                                             {.type = CODE_TYPE_END, .name = 'x', .time = {1, 38, 0}},
-                                             {.name = 0} // Terminator
-                                         }};
+static const signal_protocol_t protocol_it2 = {.name = "it2",
+                                               .id = PROTOCOL_ID_IT2,
+                                               .min_code_len = 34,
+                                               .max_code_len = 48,
+                                               .tolerance = 25,
+                                               .send_repeat = 10,
+                                               .base_time = 280, // base time in µsecs
+                                               SIGNAL_CODES(
+                                                   SIGNAL_CODE(CODE_TYPE_START, 's', 0, 0, IT2(1), IT2(10)),
+                                                   SIGNAL_CODE(CODE_TYPE_DATA, '_', 1, 0, IT2(1), IT2(1), IT2(1), IT2(5)),
+                                                   SIGNAL_CODE(CODE_TYPE_DATA, '#', 1, 1, IT2(1), IT2(5), IT2(1), IT2(1)),
+                                                   SIGNAL_CODE(CODE_TYPE_DATA, 'D', 1, 0, IT2(1), IT2(1), IT2(1), IT2(1)),
+                                                   SIGNAL_CODE(CODE_TYPE_END, 'x', 0, 0, IT2(1), IT2(38)))};
 
 /**
  * Definition of the protocol from SC5272 and similar chips with 12 data bits
+ * Each tri-state code decodes to 2 bits: 0 = '0', 1 = '1', 2 = 'f' (floating)
  */
+#  define SC5(n) SIGNAL_TIMING(100, 25, n)
 __attribute__((unused))
-static signal_protocol_t protocol_sc5 = {.name = "sc5",
-                                         .min_code_len = 1 + 12,
-                                         .max_code_len = 1 + 12,
-                                         .tolerance = 25,
-                                         .send_repeat = 3,
-                                         .base_time = 100,
-                                         .codes = {
-                                             {.type = CODE_TYPE_ANYDATA, .name = '0', .time = {4, 12, 4, 12, 0}},
-                                             {.type = CODE_TYPE_ANYDATA, .name = '1', .time = {12, 4, 12, 4, 0}},
-                                             {.type = CODE_TYPE_ANYDATA, .name = 'f', .time = {4, 12, 12, 4, 0}},
-                                             {.type = CODE_TYPE_END, .name = 'S', .time = {4, 124, 0}},
-                                             {.name = 0} // Terminator
-                                         }};
+static const signal_protocol_t protocol_sc5 = {.name = "sc5",
+                                               .id = PROTOCOL_ID_SC5,
+                                               .min_code_len = 1 + 12,
+                                               .max_code_len = 1 + 12,
+                                               .tolerance = 25,
+                                               .send_repeat = 3,
+                                               .base_time = 100,
+                                               SIGNAL_CODES(
+                                                   SIGNAL_CODE(CODE_TYPE_ANYDATA, '0', 2, 0, SC5(4), SC5(12), SC5(4), SC5(12)),
+                                                   SIGNAL_CODE(CODE_TYPE_ANYDATA, '1', 2, 1, SC5(12), SC5(4), SC5(12), SC5(4)),
+                                                   SIGNAL_CODE(CODE_TYPE_ANYDATA, 'f', 2, 2, SC5(4), SC5(12), SC5(12), SC5(4)),
+                                                   SIGNAL_CODE(CODE_TYPE_END, 'S', 0, 0, SC5(4), SC5(124)))};
 
 /**
  * Definition of the protocol from EV1527 and similar chips with 20 address and 4 data bits
+ * Decodes to 24 bits: address in bits 23..4, data in bits 3..0
  */
-static signal_protocol_t protocol_ev1527 = {.name = "ev1527",
-                                            .min_code_len = 1 + 20 + 4,
-                                            .max_code_len = 1 + 20 + 4,
-                                            .tolerance = 25,
-                                            .send_repeat = 3,
-                                            .base_time = 320,
-                                            .codes = {
-                                                {.type = CODE_TYPE_START, .name = 's', .time = {1, 31, 0}},
-                                                {.type = CODE_TYPE_DATA, .name = '0', .time = {1, 3, 0}},
-                                                {.type = CODE_TYPE_DATA, .name = '1', .time = {3, 1, 0}},
-                                                {.name = 0} // Terminator
-                                            }};
+#  define EV1527(n) SIGNAL_TIMING(320, 25, n)
+static const signal_protocol_t protocol_ev1527 = {.name = "ev1527",
+                                                  .id = PROTOCOL_ID_EV1527,
+                                                  .min_code_len = 1 + 20 + 4,
+                                                  .max_code_len = 1 + 20 + 4,
+                                                  .tolerance = 25,
+                                                  .send_repeat = 3,
+                                                  .base_time = 320,
+                                                  SIGNAL_CODES(
+                                                      SIGNAL_CODE(CODE_TYPE_START, 's', 0, 0, EV1527(1), EV1527(31)),
+                                                      SIGNAL_CODE(CODE_TYPE_DATA, '0', 1, 0, EV1527(1), EV1527(3)),
+                                                      SIGNAL_CODE(CODE_TYPE_DATA, '1', 1, 1, EV1527(3), EV1527(1)))};
 
 /**
  * Register the cresta protocol with a length of 59 codes
  * Used for sensor data transmissions
  * See /docs/cresta_protocol.md
  */
+#  define CW(n) SIGNAL_TIMING(500, 16, n)
 __attribute__((unused))
-static signal_protocol_t protocol_cw = {.name = "cw",
-                                        .min_code_len = 59,
-                                        .max_code_len = 59,
-                                        .tolerance = 16,
-                                        .send_repeat = 3,
-                                        .base_time = 500,
-                                        .codes = {
-                                            {.type = CODE_TYPE_START, .name = 'H', .time = {2, 2, 2, 2, 2, 0}},
-                                            {.type = CODE_TYPE_DATA, .name = 's', .time = {1, 1, 0}},
-                                            {.type = CODE_TYPE_DATA, .name = 'l', .time = {2, 0}},
-                                            {.name = 0} // Terminator
-                                        }};
+static const signal_protocol_t protocol_cw = {.name = "cw",
+                                              .id = PROTOCOL_ID_CW,
+                                              .min_code_len = 59,
+                                              .max_code_len = 59,
+                                              .tolerance = 16,
+                                              .send_repeat = 3,
+                                              .base_time = 500,
+                                              SIGNAL_CODES(
+                                                  SIGNAL_CODE(CODE_TYPE_START, 'H', 0, 0, CW(2), CW(2), CW(2), CW(2), CW(2)),
+                                                  SIGNAL_CODE(CODE_TYPE_DATA, 's', 1, 0, CW(1), CW(1)),
+                                                  SIGNAL_CODE(CODE_TYPE_DATA, 'l', 1, 1, CW(2)))};
+
+#  undef IT1
+#  undef IT2
+#  undef SC5
+#  undef EV1527
+#  undef CW
 
 #endif // SIGNAL_PARSER_PROTOCOLS_H_
 
@@ -20,8 +20,8 @@
  *
  * // Initialize parser
  * signal_parser_init(&parser);
- * signal_parser_load(&parser, &protocol_ev1527, 0);
- * signal_parser_attach_callback(&parser, my_callback);
+ * signal_parser_load(&parser, &protocol_ev1527);
+ * signal_parser_attach_callback(&parser, my_callback); // void my_callback(const signal_frame_t* frame)
  *
  * // Initialize collector
  * signal_collector_init(&collector, &parser, RX_PIN, TX_PIN, 0);
@@ -39,6 +39,7 @@
 
 #include "protocols.h"
 #include "signal_collector.h"
+#include "signal_learner.h"
 #include "signal_parser.h"
 
 /**
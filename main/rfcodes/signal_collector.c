@@ -15,36 +15,114 @@
 
 #define TAG "SignalCollector"
 
-// ===== Static variables for ring buffer (accessible to ISR) =====
+// Keeps the compiler from moving ring accesses across index updates (single core, so no fence needed)
+#define SC_BARRIER() __asm__ __volatile__("" ::: "memory")
 
-static code_time_t* buf88 = NULL;               // allocated memory
-static volatile code_time_t* ring_write = NULL; // write pointer
-static volatile code_time_t* buf88_read = NULL; // read pointer
-static code_time_t* buf88_end = NULL;           // end of buffer+1 pointer for wrapping
-static volatile unsigned int buf88_cnt = 0;     // number of bytes in buffer
+// ===== Edge timestamps =====
 
-static uint64_t last_time = 0; // last time the interrupt was called
+#if defined(__XTENSA__)
+#  define SC_TICKS_PER_US CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ
 
-static int recv_pin_global = -1; // Global recv pin for ISR
+/** CPU cycle counter: a single register read, unlike the 64-bit esp_timer_get_time() */
+static inline uint32_t IRAM_ATTR sc_timestamp(void) {
+  uint32_t ccount;
+  __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+  return ccount;
+}
+#else
+// Host builds (tests, benchmarks) have no cycle counter
+#  define SC_TICKS_PER_US 1
+
+static inline uint32_t sc_timestamp(void) {
+  return (uint32_t)esp_timer_get_time();
+}
+#endif
+
+// ===== Ring buffer =====
+
+/** Append a timing; called by the single producer only (ISR, or task code with the ISR masked) */
+static inline void IRAM_ATTR ring_put(signal_collector_t* collector, code_time_t t) {
+  uint32_t head = collector->head;
+  uint32_t fill = head - collector->tail;
+
+  if (fill > collector->ring_mask) {
+    collector->overflows++;
+    return;
+  }
+
+  collector->ring[head & collector->ring_mask] = t;
+  SC_BARRIER(); // slot is written before it is published
+  collector->head = head + 1;
+
+  if (fill + 1 > collector->high_water) {
+    collector->high_water = fill + 1;
+  }
+}
+
+static inline uint32_t ring_count(signal_collector_t* collector) {
+  return collector->head - collector->tail;
+}
+
+/** Copy a consumed timing to the tap ring; called by the decode loop only */
+static inline void tap_put(signal_collector_t* collector, code_time_t t) {
+  uint32_t head = collector->tap_head;
+
+  if (head - collector->tap_tail > collector->tap_mask) {
+    collector->tap_drops++;
+    return;
+  }
+
+  collector->tap[head & collector->tap_mask] = t < 0xFFFF ? t : 0xFFFF;
+  SC_BARRIER(); // slot is written before it is published
+  collector->tap_head = head + 1;
+}
 
 // ===== ISR Handler =====
 
 static void IRAM_ATTR signal_change_handler(void* arg) {
-  uint64_t now = esp_timer_get_time();
-  code_time_t t = (code_time_t)(now - last_time);
+  signal_collector_t* collector = (signal_collector_t*)arg;
+  uint32_t now = sc_timestamp();
+  uint32_t t = now - collector->last_edge; // wraps correctly; gaps over 2^32 ticks (~27 s at 160 MHz) alias
+  collector->last_edge = now;
+
+  // Glitch filter. A finished pulse waits in pending until the next edge shows
+  // that no spike cut into it, so every timing reaches the ring buffer (and the
+  // decoder) one edge late: the gap that ends a frame is only published, and
+  // the decoder woken, by the second edge after it.
+  if (t < collector->min_pulse_ticks) {
+    // Spike: drop both its edges; the pulse it interrupted continues in pending
+    collector->pending += t;
+    collector->merging = !collector->merging;
+    collector->rejected_spikes++;
+    return;
+  }
 
-  // Write to ring buffer
-  if (buf88_cnt < SC_BUFFERSIZE) {
-    *ring_write++ = t;
-    buf88_cnt++;
+  if (collector->merging) {
+    // Rest of the pulse that was interrupted by a spike
+    collector->pending += t;
+    collector->merging = false;
+    return;
+  }
 
-    // Reset pointer to the start when reaching end
-    if (ring_write == buf88_end) {
-      ring_write = buf88;
+  // The previous pulse can no longer be merged: publish it
+  code_time_t done = collector->pending;
+  collector->pending = t;
+  if (done == 0) {
+    return; // first edge after init
+  }
+  ring_put(collector, done);
+
+  // Wake the decoder only at points where a frame may have completed
+  uint16_t edges = ++collector->edges_since_notify;
+  if (collector->notify_task &&
+      (done >= collector->gap_ticks || edges >= collector->notify_edges || ring_count(collector) >= collector->notify_fill)) {
+    BaseType_t woken = pdFALSE;
+    collector->edges_since_notify = 0;
+    xTaskNotifyFromISR(collector->notify_task, collector->notify_bits, eSetBits, &woken);
+    if (woken) {
+      portYIELD_FROM_ISR();
     }
   }
-
-  last_time = now;
 }
 
 // ===== Helper functions =====
@@ -64,26 +142,58 @@ static void strcpy_protname(char* target, const char* signal) {
 // ===== Public functions =====
 
 void signal_collector_init(signal_collector_t* collector, signal_parser_t* parser, int recv_pin, int send_pin, int trim) {
+  code_time_t* buffer = (code_time_t*)malloc(SC_BUFFERSIZE * sizeof(code_time_t));
+  if (buffer == NULL) {
+    ERROR_MSG(TAG, "No memory for the ring buffer");
+    return;
+  }
+  signal_collector_init_buffered(collector, parser, recv_pin, send_pin, trim, buffer, SC_BUFFERSIZE);
+}
+
+bool signal_collector_init_buffered(signal_collector_t* collector, signal_parser_t* parser, int recv_pin, int send_pin,
+                                    int trim, code_time_t* buffer, uint32_t size) {
   TRACE_MSG(TAG, "Initializing signal collector hardware");
 
+  if (size == 0 || (size & (size - 1)) != 0) {
+    ERROR_MSG(TAG, "Ring size %u is not a power of two", size);
+    return false;
+  }
+
   collector->parser = parser;
   collector->recv_pin = recv_pin;
   collector->send_pin = send_pin;
   collector->trim = trim;
-
-  // Allocate ring buffer if not already allocated
-  if (buf88 == NULL) {
-    buf88 = (code_time_t*)malloc(SC_BUFFERSIZE * sizeof(code_time_t));
-    ring_write = buf88;
-    buf88_read = buf88;
-    buf88_end = buf88 + SC_BUFFERSIZE;
-    buf88_cnt = 0;
-  }
+  collector->notify_task = NULL;
+  collector->notify_bits = 0;
+  collector->notify_edges = 0;
+  collector->edges_since_notify = 0;
+
+  collector->ring = buffer;
+  collector->ring_mask = size - 1;
+  collector->head = 0;
+  collector->tail = 0;
+  collector->overflows = 0;
+  collector->high_water = 0;
+  collector->notify_fill = size / 4;
+
+  collector->ticks_per_us = SC_TICKS_PER_US;
+  collector->last_edge = sc_timestamp();
+  collector->min_pulse_ticks = SC_MIN_PULSE_US * SC_TICKS_PER_US;
+  collector->gap_ticks = SC_NOTIFY_GAP_US * SC_TICKS_PER_US;
+  collector->pending = 0;
+  collector->merging = false;
+  collector->rejected_spikes = 0;
+
+  collector->tap = NULL;
+  collector->tap_mask = 0;
+  collector->tap_active = false;
+  collector->tap_head = 0;
+  collector->tap_tail = 0;
+  collector->tap_drops = 0;
+  collector->observer = NULL;
 
   // Receiving mode
   if (recv_pin >= 0) {
-    recv_pin_global = recv_pin;
-
     gpio_config_t io_conf = {
         .pin_bit_mask = (1ULL << recv_pin),
         .mode = GPIO_MODE_INPUT,
@@ -95,7 +205,7 @@ void signal_collector_init(signal_collector_t* collector, signal_parser_t* parse
 
     // Install ISR service if not already installed
     gpio_install_isr_service(0);
-    gpio_isr_handler_add(recv_pin, signal_change_handler, NULL);
+    gpio_isr_handler_add(recv_pin, signal_change_handler, collector);
 
     INFO_MSG(TAG, "Receiver initialized on GPIO %d", recv_pin);
   }
@@ -114,6 +224,7 @@ void signal_collector_init(signal_collector_t* collector, signal_parser_t* parse
 
     INFO_MSG(TAG, "Transmitter initialized on GPIO %d", send_pin);
   }
+  return true;
 }
 
 void signal_collector_send(signal_collector_t* collector, const char* signal) {
@@ -155,48 +266,124 @@ void signal_collector_send(signal_collector_t* collector, const char* signal) {
   }
 }
 
-void signal_collector_loop(signal_collector_t* collector) {
-  while (buf88_cnt > 0) {
-    code_time_t t = *buf88_read++;
-    buf88_cnt--;
+void signal_collector_set_notify(signal_collector_t* collector, TaskHandle_t task, uint32_t bits) {
+  int edges = signal_parser_min_frame_timings(collector->parser);
+  collector->notify_edges = edges > 0 && (uint32_t)edges < collector->notify_fill ? (uint32_t)edges : collector->notify_fill;
+  collector->notify_bits = bits;
+  collector->edges_since_notify = 0;
+  collector->notify_task = task;
+}
 
+void signal_collector_loop(signal_collector_t* collector) {
+  uint32_t tail = collector->tail;
+  uint32_t head = collector->head;
+  SC_BARRIER(); // slots up to head are read after head
+
+  while (tail != head) {
+    code_time_t t = collector->ring[tail & collector->ring_mask] / collector->ticks_per_us;
+    if (collector->tap_active) {
+      tap_put(collector, t);
+    }
+    if (collector->observer) {
+      collector->observer(t);
+    }
     signal_parser_parse(collector->parser, t);
+    tail++;
+    collector->tail = tail; // free the slot
 
-    // Reset pointer to the start when reaching end
-    if (buf88_read == buf88_end) {
-      buf88_read = buf88;
+    if (tail == head) {
+      head = collector->head; // pick up timings that arrived while parsing
+      SC_BARRIER();
     }
-
-    vTaskDelay(0); // Yield to other tasks
   }
 }
 
 uint32_t signal_collector_get_buffer_count(signal_collector_t* collector) {
-  return buf88_cnt;
+  return ring_count(collector);
+}
+
+bool signal_collector_is_busy(signal_collector_t* collector) {
+  return ring_count(collector) > 0 || signal_parser_in_sequence(collector->parser);
+}
+
+uint32_t signal_collector_get_overflows(signal_collector_t* collector) {
+  return collector->overflows;
+}
+
+void signal_collector_set_min_pulse(signal_collector_t* collector, code_time_t min_us) {
+  collector->min_pulse_ticks = min_us * collector->ticks_per_us;
+}
+
+uint32_t signal_collector_get_rejected_spikes(signal_collector_t* collector) {
+  return collector->rejected_spikes;
+}
+
+uint32_t signal_collector_get_high_water(signal_collector_t* collector) {
+  return collector->high_water;
+}
+
+uint32_t signal_collector_get_buffer_size(signal_collector_t* collector) {
+  return collector->ring_mask + 1;
 }
 
 void signal_collector_get_buffer_data(signal_collector_t* collector, code_time_t* buffer, int len) {
   len--; // keep space for final '0'
-  if (len > SC_BUFFERSIZE) {
-    len = SC_BUFFERSIZE;
+  if ((uint32_t)len > collector->ring_mask + 1) {
+    len = collector->ring_mask + 1;
   }
 
-  code_time_t* p = (code_time_t*)buf88_read - len;
-  if (p < buf88) {
-    p += SC_BUFFERSIZE;
+  // The last len timings consumed
+  uint32_t i = collector->tail - len;
+  while (len) {
+    *buffer++ = collector->ring[i++ & collector->ring_mask] / collector->ticks_per_us;
+    len--;
   }
+  *buffer = 0;
+}
 
-  // Copy timings to buffer
-  while (len) {
-    *buffer++ = *p++;
+void signal_collector_attach_observer(signal_collector_t* collector, signal_timing_callback_t observer) {
+  collector->observer = observer;
+}
 
-    // Reset pointer to the start when reaching end
-    if (p == buf88_end) {
-      p = buf88;
+bool signal_collector_tap_enable(signal_collector_t* collector, uint16_t* buffer, uint32_t size) {
+  if (collector->tap == NULL) {
+    if (buffer == NULL || size == 0 || (size & (size - 1)) != 0) {
+      ERROR_MSG(TAG, "Tap size %u is not a power of two", size);
+      return false;
     }
-    len--;
+    collector->tap_mask = size - 1;
+    SC_BARRIER();
+    collector->tap = buffer;
   }
-  *buffer = 0;
+
+  // Head and tail are never reset, so a decode loop still finishing a put can't corrupt them
+  collector->tap_tail = collector->tap_head;
+  SC_BARRIER();
+  collector->tap_active = true;
+  return true;
+}
+
+void signal_collector_tap_disable(signal_collector_t* collector) {
+  collector->tap_active = false;
+}
+
+uint32_t signal_collector_tap_read(signal_collector_t* collector, uint16_t* out, uint32_t max) {
+  uint32_t tail = collector->tap_tail;
+  uint32_t head = collector->tap_head;
+  uint32_t n = 0;
+  SC_BARRIER(); // slots up to head are read after head
+
+  while (tail != head && n < max) {
+    out[n++] = collector->tap[tail & collector->tap_mask];
+    tail++;
+  }
+  SC_BARRIER();
+  collector->tap_tail = tail; // free the slots
+  return n;
+}
+
+uint32_t signal_collector_get_tap_drops(signal_collector_t* collector) {
+  return collector->tap_drops;
 }
 
 void signal_collector_dump_timings(code_time_t* raw) {
@@ -219,18 +406,14 @@ void signal_collector_dump_timings(code_time_t* raw) {
 }
 
 void signal_collector_inject_timing(signal_collector_t* collector, code_time_t t) {
-  // Write to ring buffer
-  if (buf88_cnt < SC_BUFFERSIZE) {
-    *ring_write++ = t;
-    buf88_cnt++;
-
-    // Reset pointer to the start when reaching end
-    if (ring_write == buf88_end) {
-      ring_write = buf88;
-    }
-  }
+  // The ISR is the ring's producer; keep it out while we write
+  portENTER_CRITICAL();
+  ring_put(collector, t * collector->ticks_per_us);
+  portEXIT_CRITICAL();
 
-  last_time = esp_timer_get_time();
+  if (collector->notify_task) {
+    xTaskNotify(collector->notify_task, collector->notify_bits, eSetBits);
+  }
 }
 
 // End.
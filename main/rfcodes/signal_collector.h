@@ -9,11 +9,16 @@
 #define SIGNAL_COLLECTOR_H_
 
 #include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "signal_parser.h"
 
 #define NO_PIN (-1)
 
-#define SC_BUFFERSIZE 512
+#define SC_BUFFERSIZE 512 // default ring size in timings (power of two)
+
+#define SC_NOTIFY_GAP_US 3000 // a pulse this long separates frames: wake the decoder
+#define SC_MIN_PULSE_US 100   // default glitch filter: shorter pulses are noise spikes
 
 // SignalCollector structure (replaces C++ class)
 typedef struct {
@@ -21,6 +26,42 @@ typedef struct {
   int recv_pin; // IO Pin number for receiving signals
   int send_pin; // IO Pin number for sending signals
   int trim;     // timing factor
+
+  // Single-producer (receive ISR) / single-consumer (decode loop) ring of timings in ticks.
+  // head and tail run freely and are masked on access; head - tail is the fill level.
+  code_time_t* ring;
+  uint32_t ring_mask;          // ring size - 1
+  volatile uint32_t head;      // written only by the producer
+  volatile uint32_t tail;      // written only by the consumer
+  volatile uint32_t overflows; // timings dropped on a full ring
+  uint32_t high_water;         // highest fill level seen
+  uint32_t notify_fill;        // wake the decoder at this fill level
+
+  // Edge capture: timestamps are CPU cycle counts ("ticks"), converted to µs by the decode loop
+  uint32_t ticks_per_us;
+  uint32_t last_edge;                // tick count of the previous edge
+  uint32_t min_pulse_ticks;          // glitch filter threshold
+  uint32_t gap_ticks;                // SC_NOTIFY_GAP_US in ticks
+  uint32_t pending;                  // last complete pulse, held back one edge so a following glitch can be merged into it
+  bool merging;                      // the next pulse continues pending
+  volatile uint32_t rejected_spikes; // spikes dropped by the glitch filter
+
+  // Decoder wake-up from the ISR (see signal_collector_set_notify)
+  TaskHandle_t notify_task;
+  uint32_t notify_bits;
+  uint16_t notify_edges;                // timings in the shortest complete frame after its start gap
+  volatile uint16_t edges_since_notify;
+
+  // Raw capture: a second ring, filled by the decode loop with every timing it consumes (in µs)
+  uint16_t* tap;
+  uint32_t tap_mask;
+  volatile bool tap_active;
+  volatile uint32_t tap_head;  // written only by the decode loop
+  volatile uint32_t tap_tail;  // written only by the tap reader
+  volatile uint32_t tap_drops; // timings dropped on a full tap ring
+
+  // Called by the decode loop with every timing before it is parsed (see signal_collector_attach_observer)
+  signal_timing_callback_t observer;
 } signal_collector_t;
 
 // ===== Public Functions =====
@@ -35,6 +76,20 @@ typedef struct {
  */
 void signal_collector_init(signal_collector_t* collector, signal_parser_t* parser, int recv_pin, int send_pin, int trim);
 
+/**
+ * @brief Initialize like signal_collector_init, with a caller-provided ring buffer
+ * @param collector Pointer to collector structure
+ * @param parser Pointer to signal parser
+ * @param recv_pin GPIO pin for receiving (-1 to disable)
+ * @param send_pin GPIO pin for sending (-1 to disable)
+ * @param trim Timing adjustment factor
+ * @param buffer Storage for the ring (must outlive the collector)
+ * @param size Number of timings in buffer; must be a power of two
+ * @return false if size is not a power of two
+ */
+bool signal_collector_init_buffered(signal_collector_t* collector, signal_parser_t* parser, int recv_pin, int send_pin,
+                                    int trim, code_time_t* buffer, uint32_t size);
+
 /**
  * @brief Send out a new code
  * @param collector Pointer to collector structure
@@ -43,7 +98,19 @@ void signal_collector_init(signal_collector_t* collector, signal_parser_t* parse
 void signal_collector_send(signal_collector_t* collector, const char* code);
 
 /**
- * @brief Process buffered data - must be called regularly from main loop
+ * @brief Let the receive ISR wake a task when there is something to decode
+ *
+ * The task is notified (eSetBits) after a long gap, once enough timings for
+ * the shortest loaded frame have arrived since the last notification, or when
+ * the ring buffer is a quarter full. Call after all protocols are loaded.
+ * @param collector Pointer to collector structure
+ * @param task Task to notify (NULL to stop notifying)
+ * @param bits Notification bits to set
+ */
+void signal_collector_set_notify(signal_collector_t* collector, TaskHandle_t task, uint32_t bits);
+
+/**
+ * @brief Decode all buffered timings
  * @param collector Pointer to collector structure
  */
 void signal_collector_loop(signal_collector_t* collector);
@@ -63,6 +130,92 @@ uint32_t signal_collector_get_buffer_count(signal_collector_t* collector);
  */
 void signal_collector_get_buffer_data(signal_collector_t* collector, code_time_t* buffer, int len);
 
+/**
+ * @brief Check for RF reception in progress
+ * @param collector Pointer to collector structure
+ * @return true while timings are waiting to be parsed or a sequence is partially received
+ */
+bool signal_collector_is_busy(signal_collector_t* collector);
+
+/**
+ * @brief Number of timings dropped because the ring buffer was full
+ * @param collector Pointer to collector structure
+ */
+uint32_t signal_collector_get_overflows(signal_collector_t* collector);
+
+/**
+ * @brief Set the glitch filter threshold
+ *
+ * A pulse shorter than this is treated as a spike: both of its edges are
+ * dropped and the pulses around it are merged back into one.
+ * @param collector Pointer to collector structure
+ * @param min_us Minimum pulse width in µs (0 disables the filter)
+ */
+void signal_collector_set_min_pulse(signal_collector_t* collector, code_time_t min_us);
+
+/**
+ * @brief Number of spikes dropped by the glitch filter (each removes two edges)
+ * @param collector Pointer to collector structure
+ */
+uint32_t signal_collector_get_rejected_spikes(signal_collector_t* collector);
+
+/**
+ * @brief Highest number of timings that were waiting in the ring buffer at once
+ * @param collector Pointer to collector structure
+ */
+uint32_t signal_collector_get_high_water(signal_collector_t* collector);
+
+/**
+ * @brief Size of the ring buffer in timings
+ * @param collector Pointer to collector structure
+ */
+uint32_t signal_collector_get_buffer_size(signal_collector_t* collector);
+
+/**
+ * @brief Let a function see every timing the decode loop takes, in µs, before it is parsed
+ *
+ * Runs in the decode loop's task, so it may change the parser (e.g. load a protocol).
+ * @param collector Pointer to collector structure
+ * @param observer Function to call (NULL to stop)
+ */
+void signal_collector_attach_observer(signal_collector_t* collector, signal_timing_callback_t observer);
+
+/**
+ * @brief Start copying every decoded timing into a tap ring for raw capture
+ *
+ * The decode loop is the tap's producer and signal_collector_tap_read() its
+ * consumer. Timings are in µs, saturated to 0xFFFF. When the reader falls
+ * behind, timings are dropped and counted. The buffer is installed by the first
+ * call and kept for the collector's lifetime; later calls ignore buffer and size
+ * and discard whatever was left unread.
+ * @param collector Pointer to collector structure
+ * @param buffer Storage for the tap ring (first call only)
+ * @param size Number of timings in buffer; must be a power of two
+ * @return false if no tap ring could be installed
+ */
+bool signal_collector_tap_enable(signal_collector_t* collector, uint16_t* buffer, uint32_t size);
+
+/**
+ * @brief Stop copying timings into the tap ring
+ * @param collector Pointer to collector structure
+ */
+void signal_collector_tap_disable(signal_collector_t* collector);
+
+/**
+ * @brief Take timings out of the tap ring (single reader)
+ * @param collector Pointer to collector structure
+ * @param out Target buffer
+ * @param max Size of out in timings
+ * @return Number of timings copied
+ */
+uint32_t signal_collector_tap_read(signal_collector_t* collector, uint16_t* out, uint32_t max);
+
+/**
+ * @brief Number of timings dropped because the tap ring was full
+ * @param collector Pointer to collector structure
+ */
+uint32_t signal_collector_get_tap_drops(signal_collector_t* collector);
+
 /**
  * @brief Dump the data from a table of timings that end with a 0 time
  * @param raw Pointer to raw timings data
@@ -70,7 +223,7 @@ void signal_collector_get_buffer_data(signal_collector_t* collector, code_time_t
 void signal_collector_dump_timings(code_time_t* raw);
 
 /**
- * @brief Inject a test timing into the ring buffer
+ * @brief Inject a test timing into the ring buffer (task context; briefly masks the receive interrupt)
  * @param collector Pointer to collector structure
  * @param t Timing value to inject
  */
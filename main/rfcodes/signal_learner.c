@@ -0,0 +1,306 @@
+/**
+ * @file signal_learner.c
+ * @brief Protocol inference from repeated transmissions
+ */
+
+#include "signal_learner.h"
+#include <string.h>
+
+#define TAG "SignalLearner"
+
+// Filled buckets at most this far apart belong to the same cluster
+#define LEARN_MERGE_BUCKETS 2
+// Cluster means may be this far (percent) from a multiple of the base time
+#define LEARN_MULTIPLE_ERROR 12
+// The base time may be the shortest duration divided by up to this
+#define LEARN_MAX_DIVISOR 4
+
+// ===== Private functions =====
+
+/** Histogram bucket of a duration, -1 if the parser could not match it */
+static int hist_bucket(code_time_t duration) {
+  if ((duration < (1u << SIGNAL_LUT_MIN_EXP)) || (duration >= (1u << SIGNAL_LUT_MAX_EXP))) {
+    return -1;
+  }
+  int e = 31 - __builtin_clz(duration);
+  int m = (duration >> (e - SIGNAL_LEARN_HIST_STEP_BITS)) & ((1 << SIGNAL_LEARN_HIST_STEP_BITS) - 1);
+  return ((e - SIGNAL_LUT_MIN_EXP) << SIGNAL_LEARN_HIST_STEP_BITS) + m;
+}
+
+/**
+ * Group durations into runs of filled histogram buckets, shortest first
+ * @return number of clusters, 0 if a duration is out of range or there are too many
+ */
+static int cluster_timings(signal_learner_t* learner, int first, int n, uint32_t* sum, uint16_t* count) {
+  const uint16_t* t = learner->timings + first;
+
+  memset(learner->hist, 0, sizeof(learner->hist));
+  for (int i = 0; i < n; i++) {
+    int b = hist_bucket(t[i]);
+    if (b < 0) {
+      return 0;
+    }
+    learner->hist[b]++;
+  }
+
+  int clusters = 0;
+  int last = -LEARN_MERGE_BUCKETS - 2;
+  for (int b = 0; b < SIGNAL_LEARN_HIST_BUCKETS; b++) {
+    if (learner->hist[b] == 0) {
+      continue;
+    }
+    if (b - last > LEARN_MERGE_BUCKETS) {
+      if (clusters == SIGNAL_LEARN_MAX_CLUSTERS) {
+        return 0;
+      }
+      sum[clusters] = 0;
+      count[clusters] = 0;
+      clusters++;
+    }
+    learner->cluster_of[b] = clusters - 1;
+    last = b;
+  }
+
+  for (int i = 0; i < n; i++) {
+    int c = learner->cluster_of[hist_bucket(t[i])];
+    sum[c] += t[i];
+    count[c]++;
+  }
+  return clusters;
+}
+
+/** Base-time multiple of a (clustered) duration */
+static uint8_t multiple_of(signal_learner_t* learner, const uint8_t* multiples, uint16_t duration) {
+  return multiples[learner->cluster_of[hist_bucket(duration)]];
+}
+
+/**
+ * Split a frame into a start code of start_len timings at its end (before the next repeat) and data codes
+ * of width timings each, with at most four distinct data codes
+ */
+static bool try_layout(signal_learner_t* learner, const uint8_t* multiples, int first, int len, int start_len,
+                       int width, signal_learned_t* learned) {
+  int data_len = len - start_len;
+  if ((data_len % width) != 0 || data_len / width < SIGNAL_LEARN_MIN_CODES) {
+    return false;
+  }
+
+  uint8_t codes[4][MAX_TIMELENGTH];
+  int code_count = 0;
+
+  for (int i = 0; i < data_len; i += width) {
+    uint8_t code[MAX_TIMELENGTH];
+    for (int j = 0; j < width; j++) {
+      code[j] = multiple_of(learner, multiples, learner->timings[first + i + j]);
+    }
+
+    int c = 0;
+    while (c < code_count && memcmp(codes[c], code, width) != 0) {
+      c++;
+    }
+    if (c == code_count) {
+      if (code_count == 4) {
+        return false;
+      }
+      memcpy(codes[code_count++], code, width);
+    }
+  }
+
+  int bits = code_count > 2 ? 2 : 1;
+  if (code_count < 2 || (data_len / width) * bits > SIGNAL_MAX_PAYLOAD_BITS) {
+    return false;
+  }
+
+  // Values follow the order of the timings, so a short-long code is 0 and long-short is 1
+  for (int a = 1; a < code_count; a++) {
+    for (int b = a; b > 0 && memcmp(codes[b - 1], codes[b], width) > 0; b--) {
+      uint8_t tmp[MAX_TIMELENGTH];
+      memcpy(tmp, codes[b], width);
+      memcpy(codes[b], codes[b - 1], width);
+      memcpy(codes[b - 1], tmp, width);
+    }
+  }
+
+  learned->code_length = 1 + code_count;
+  learned->bits = bits;
+  learned->data_codes = data_len / width;
+  learned->time_length[0] = start_len;
+  for (int j = 0; j < start_len; j++) {
+    learned->multiple[0][j] = multiple_of(learner, multiples, learner->timings[first + data_len + j]);
+  }
+  for (int c = 0; c < code_count; c++) {
+    learned->time_length[1 + c] = width;
+    memcpy(learned->multiple[1 + c], codes[c], width);
+  }
+  return true;
+}
+
+// ===== Public functions =====
+
+void signal_learner_init(signal_learner_t* learner, uint16_t* buffer, uint16_t size) {
+  learner->timings = buffer;
+  learner->size = size;
+  learner->count = 0;
+}
+
+bool signal_learner_add(signal_learner_t* learner, code_time_t duration) {
+  if (learner->count == learner->size) {
+    uint16_t drop = learner->size / 2;
+    memmove(learner->timings, learner->timings + drop, (learner->size - drop) * sizeof(uint16_t));
+    learner->count -= drop;
+  }
+  learner->timings[learner->count++] = duration > 0xFFFF ? 0xFFFF : duration;
+  return duration >= SIGNAL_LEARN_GAP_US;
+}
+
+bool signal_learner_infer(signal_learner_t* learner, signal_learned_t* learned) {
+  const uint16_t* t = learner->timings;
+  int end = learner->count - 1;
+  if (end < 0 || t[end] < SIGNAL_LEARN_GAP_US) {
+    return false;
+  }
+
+  // Repeats are separated by gaps at least half as long as the one ending the latest frame
+  code_time_t split = t[end] / 2 > SIGNAL_LEARN_GAP_US ? t[end] / 2 : SIGNAL_LEARN_GAP_US;
+  int prev = end - 1;
+  while (prev >= 0 && t[prev] < split) {
+    prev--;
+  }
+  int len = end - prev;
+  int first = end + 1 - SIGNAL_LEARN_REPEATS * len;
+  if (prev < 0 || first < 0 || len < 2 * SIGNAL_LEARN_MIN_CODES + 1) {
+    return false;
+  }
+  for (int i = first; i < end; i++) {
+    if ((t[i] >= split) != ((i - first) % len == len - 1)) {
+      return false; // earlier frames have a different length
+    }
+  }
+
+  uint32_t sum[SIGNAL_LEARN_MAX_CLUSTERS];
+  uint16_t count[SIGNAL_LEARN_MAX_CLUSTERS];
+  int clusters = cluster_timings(learner, first, end + 1 - first, sum, count);
+  if (clusters < 3) {
+    return false; // need at least two data durations and a gap
+  }
+
+  // The repeats must be the same frame, not just the same length
+  for (int j = 0; j < len; j++) {
+    uint8_t c = learner->cluster_of[hist_bucket(t[first + j])];
+    for (int k = 1; k < SIGNAL_LEARN_REPEATS; k++) {
+      if (learner->cluster_of[hist_bucket(t[first + k * len + j])] != c) {
+        return false;
+      }
+    }
+  }
+
+  // Base time: the shortest cluster divided by the smallest divisor that makes every cluster a whole multiple
+  uint8_t multiples[SIGNAL_LEARN_MAX_CLUSTERS];
+  uint32_t shortest = sum[0] / count[0];
+  int divisor;
+  for (divisor = 1; divisor <= LEARN_MAX_DIVISOR; divisor++) {
+    bool fits = true;
+    for (int c = 0; c < clusters && fits; c++) {
+      uint32_t scaled = sum[c] / count[c] * divisor;
+      uint32_t n = (scaled + shortest / 2) / shortest;
+      uint32_t error = scaled > n * shortest ? scaled - n * shortest : n * shortest - scaled;
+      fits = n >= 1 && n <= 255 && (c == 0 || n > multiples[c - 1]) && error * 100 <= LEARN_MULTIPLE_ERROR * n * shortest;
+      multiples[c] = n;
+    }
+    if (fits) {
+      break;
+    }
+  }
+  if (divisor > LEARN_MAX_DIVISOR) {
+    return false;
+  }
+
+  uint32_t total = 0, units = 0;
+  for (int c = 0; c < clusters; c++) {
+    total += sum[c];
+    units += count[c] * multiples[c];
+  }
+  uint32_t base = (total + units / 2) / units;
+
+  // Widest tolerance that keeps neighbouring windows apart; every received duration must fit its window
+  uint32_t tolerance = SIGNAL_LEARN_MAX_TOLERANCE;
+  for (int c = 1; c < clusters; c++) {
+    uint32_t apart = (multiples[c] - multiples[c - 1]) * 100 / (multiples[c] + multiples[c - 1]);
+    if (apart < 2) {
+      return false;
+    }
+    if (apart - 1 < tolerance) {
+      tolerance = apart - 1;
+    }
+  }
+  for (int i = first; i <= end; i++) {
+    uint32_t expected = base * multiple_of(learner, multiples, t[i]);
+    uint32_t error = t[i] > expected ? t[i] - expected : expected - t[i];
+    if (error * 100 > tolerance * expected) {
+      return false;
+    }
+  }
+
+  memset(learned, 0, sizeof(signal_learned_t));
+  learned->version = SIGNAL_LEARNED_VERSION;
+  learned->tolerance = tolerance;
+  learned->base_time = base;
+
+  // Usually a pulse and the gap start each frame (they end the previous repeat), then pulse pairs carry the data
+  static const uint8_t layouts[][2] = {{2, 2}, {2, 4}, {1, 2}, {1, 4}}; // start code timings, data code timings
+  for (unsigned l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+    if (try_layout(learner, multiples, first, len, layouts[l][0], layouts[l][1], learned)) {
+      INFO_MSG(TAG, "learned: base %u µs, %d%%, %d codes of %d bits", (unsigned)base, (int)tolerance,
+               learned->data_codes, learned->bits);
+      return true;
+    }
+  }
+  return false;
+}
+
+int signal_learner_slots(const signal_learned_t* learned) {
+  int slots = 0;
+  for (int c = 0; c < learned->code_length && c < MAX_CODELENGTH; c++) {
+    slots += learned->time_length[c];
+  }
+  return slots;
+}
+
+bool signal_learner_build(const signal_learned_t* learned, signal_protocol_t* protocol) {
+  if (learned->version != SIGNAL_LEARNED_VERSION || learned->code_length < 3 ||
+      learned->code_length > MAX_CODELENGTH || learned->bits == 0 || learned->data_codes == 0 ||
+      learned->bits * learned->data_codes > SIGNAL_MAX_PAYLOAD_BITS || learned->base_time == 0 ||
+      learned->tolerance == 0 || learned->tolerance > SIGNAL_LEARN_MAX_TOLERANCE) {
+    return false;
+  }
+
+  memset(protocol, 0, sizeof(signal_protocol_t));
+  strcpy(protocol->name, "learned");
+  protocol->id = PROTOCOL_ID_LEARNED;
+  protocol->code_length = learned->code_length;
+  protocol->min_code_len = 1 + learned->data_codes;
+  protocol->max_code_len = 1 + learned->data_codes;
+  protocol->tolerance = learned->tolerance;
+  protocol->send_repeat = 4;
+  protocol->base_time = learned->base_time;
+
+  for (int c = 0; c < learned->code_length; c++) {
+    signal_code_t* code = &(protocol->codes[c]);
+    if (learned->time_length[c] == 0 || learned->time_length[c] > MAX_TIMELENGTH) {
+      return false;
+    }
+    code->type = c == 0 ? CODE_TYPE_START : CODE_TYPE_DATA;
+    code->name = c == 0 ? 's' : '0' + (c - 1);
+    code->bits = c == 0 ? 0 : learned->bits;
+    code->value = c == 0 ? 0 : c - 1;
+    code->time_length = learned->time_length[c];
+    for (int j = 0; j < code->time_length; j++) {
+      code_time_t n = learned->multiple[c][j];
+      if (n == 0) {
+        return false;
+      }
+      code->time[j] = (signal_timing_t)SIGNAL_TIMING(protocol->base_time, protocol->tolerance, n);
+    }
+  }
+  return true;
+}
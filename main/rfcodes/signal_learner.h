@@ -0,0 +1,93 @@
+/**
+ * @file signal_learner.h
+ * @brief Infer a protocol definition from repeated transmissions of an unknown remote
+ *
+ * The learner keeps the most recent timings. Once the same frame has been
+ * received SIGNAL_LEARN_REPEATS times in a row, its durations are clustered
+ * into multiples of a base time and the frame is split into a start code
+ * (the pulse and gap between repeats) and 2- or 4-timing data codes. The
+ * result is a compact signal_learned_t that can be persisted and turned into
+ * a signal_protocol_t for signal_parser_load().
+ */
+
+#ifndef SIGNAL_LEARNER_H_
+#define SIGNAL_LEARNER_H_
+
+#include "signal_parser.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SIGNAL_LEARN_GAP_US 2000 // shortest duration that can separate two repeats of a frame
+#define SIGNAL_LEARN_REPEATS 3   // identical frames in a row needed to infer a protocol
+#define SIGNAL_LEARN_MIN_CODES 8 // data codes a frame needs to be taken for a remote
+#define SIGNAL_LEARN_MAX_CLUSTERS 8
+#define SIGNAL_LEARN_MAX_TOLERANCE 25
+
+// Clustering histogram: 16 log-spaced buckets per octave over the parser's duration range
+#define SIGNAL_LEARN_HIST_STEP_BITS 4
+#define SIGNAL_LEARN_HIST_BUCKETS ((SIGNAL_LUT_MAX_EXP - SIGNAL_LUT_MIN_EXP) << SIGNAL_LEARN_HIST_STEP_BITS)
+
+#define SIGNAL_LEARNED_VERSION 1
+
+// A learned protocol in base-time multiples (what gets persisted)
+typedef struct {
+  uint8_t version;     // SIGNAL_LEARNED_VERSION, 0 if nothing was learned
+  uint8_t tolerance;   // percent
+  uint16_t base_time;  // µs
+  uint8_t code_length; // codes[0] is the start code, codes[1..] the data codes with values 0, 1, ...
+  uint8_t bits;        // payload bits per data code
+  uint8_t data_codes;  // data codes per frame
+  uint8_t time_length[MAX_CODELENGTH];
+  uint8_t multiple[MAX_CODELENGTH][MAX_TIMELENGTH];
+} signal_learned_t;
+
+typedef struct {
+  uint16_t* timings; // most recent timings in µs, saturated at 0xFFFF
+  uint16_t size;
+  uint16_t count;
+
+  // Scratch space for signal_learner_infer()
+  uint16_t hist[SIGNAL_LEARN_HIST_BUCKETS];
+  uint8_t cluster_of[SIGNAL_LEARN_HIST_BUCKETS];
+} signal_learner_t;
+
+/**
+ * @brief Initialize a learner
+ * @param learner Pointer to learner structure
+ * @param buffer Storage for timings; should hold SIGNAL_LEARN_REPEATS of the longest frame to learn
+ * @param size Number of timings in buffer
+ */
+void signal_learner_init(signal_learner_t* learner, uint16_t* buffer, uint16_t size);
+
+/**
+ * @brief Add a timing; the oldest half of the buffer is dropped when it is full
+ * @param learner Pointer to learner structure
+ * @param duration Duration in µs
+ * @return true if the timing can end a frame, so signal_learner_infer() is worth calling
+ */
+bool signal_learner_add(signal_learner_t* learner, code_time_t duration);
+
+/**
+ * @brief Try to infer a protocol from the frames that end with the latest timing
+ * @param learner Pointer to learner structure
+ * @param learned Receives the protocol
+ * @return true if the last SIGNAL_LEARN_REPEATS frames were identical and fit a protocol
+ */
+bool signal_learner_infer(signal_learner_t* learner, signal_learned_t* learned);
+
+/**
+ * @brief Decoder slots the protocol built from a learned one takes (one per code timing)
+ * @param learned Learned protocol
+ * @return Slot count, to check against what the parser has left of SIGNAL_MAX_SLOTS
+ */
+int signal_learner_slots(const signal_learned_t* learned);
+
+/**
+ * @brief Build a protocol definition (PROTOCOL_ID_LEARNED, named "learned") from a learned one
+ * @param learned Learned protocol, e.g. read back from flash
+ * @param protocol Receives the definition; must stay valid while a parser has it loaded
+ * @return false if learned is not a valid learned protocol
+ */
+bool signal_learner_build(const signal_learned_t* learned, signal_protocol_t* protocol);
+
+#endif // SIGNAL_LEARNER_H_
@@ -12,34 +12,34 @@
 
 #define TAG "SignalParser"
 
+// RAM each protocol took as a mutable signal_protocol_t on the ESP8266, before definitions moved to flash
+#define SIGNAL_PARSER_RAM_DEFINITION_BYTES 960
+
 // ===== Private function declarations =====
 
-static signal_protocol_t* find_protocol(signal_parser_t* parser, char* name);
-static signal_code_t* find_code(signal_protocol_t* protocol, char code_name);
-static void reset_codes(signal_protocol_t* protocol);
-static void reset_protocol(signal_parser_t* parser, signal_protocol_t* protocol);
-static void use_callback(signal_parser_t* parser, signal_protocol_t* protocol);
-static void parse_protocol(signal_parser_t* parser, signal_protocol_t* protocol, code_time_t duration);
-static void recalc_protocol(signal_protocol_t* protocol, code_time_t base_time);
+static const signal_protocol_t* find_protocol(signal_parser_t* parser, char* name);
+static const signal_code_t* find_code(const signal_protocol_t* protocol, char code_name);
+static void reset_protocol(signal_parser_t* parser, signal_decoder_t* d);
+static void use_callback(signal_parser_t* parser, signal_decoder_t* d);
+static bool add_code(signal_parser_t* parser, signal_decoder_t* d, const signal_code_t* c);
+static bool compile_parser(signal_parser_t* parser);
 
 // ===== Private functions =====
 
 /** Find protocol by name */
-static signal_protocol_t* find_protocol(signal_parser_t* parser, char* name) {
-  signal_protocol_t* p = NULL;
-
+static const signal_protocol_t* find_protocol(signal_parser_t* parser, char* name) {
   for (int n = 0; n < parser->protocol_count; n++) {
-    p = parser->protocols[n];
+    const signal_protocol_t* p = parser->decoders[n].protocol;
     if (strcmp(name, p->name) == 0) {
-      break;
+      return p;
     }
   }
-  return p;
+  return NULL;
 }
 
 /** Find code by name */
-static signal_code_t* find_code(signal_protocol_t* protocol, char code_name) {
-  signal_code_t* c = protocol->codes;
+static const signal_code_t* find_code(const signal_protocol_t* protocol, char code_name) {
+  const signal_code_t* c = protocol->codes;
   int cnt = protocol->code_length;
 
   while (c && cnt) {
@@ -52,170 +52,209 @@ static signal_code_t* find_code(signal_protocol_t* protocol, char code_name) {
   return (cnt ? c : NULL);
 }
 
-/** Reset all codes in a protocol */
-static void reset_codes(signal_protocol_t* protocol) {
-  signal_code_t* c = protocol->codes;
-  int c_cnt = protocol->code_length;
-
-  while (c && c_cnt) {
-    c->valid = true;
-    c->cnt = 0;
-    c->total = 0;
-    c++;
-    c_cnt--;
+/** Reset the whole protocol to start capturing from scratch */
+static void reset_protocol(signal_parser_t* parser, signal_decoder_t* d) {
+  TRACE_MSG(TAG, "  reset prot: %s", d->protocol->name);
+  if (d->seq_len > 0 && d->seq_len * 2 >= d->protocol->min_code_len) {
+    parser->broken_frames++; // got well into a frame, then lost it
   }
+  d->seq_len = 0;
+  d->payload = 0;
+  d->payload_bits = 0;
 }
 
-/** Reset the whole protocol to start capturing from scratch */
-static void reset_protocol(signal_parser_t* parser, signal_protocol_t* protocol) {
-  TRACE_MSG(TAG, "  reset prot: %s", protocol->name);
-  protocol->seq_len = 0;
-  protocol->seq[0] = NUL;
-  reset_codes(protocol);
-  recalc_protocol(protocol, protocol->base_time);
+/** Use the callback function when registered, passing the decoded bits */
+static void use_callback(signal_parser_t* parser, signal_decoder_t* d) {
+  if (parser->callback_func) {
+    signal_frame_t frame = {
+        .protocol_id = d->protocol->id,
+        .bits = d->payload_bits,
+        .payload = d->payload,
+    };
+    parser->callback_func(&frame);
+  }
 }
 
-/** Use the callback function when registered using format <protocolname> <sequence> */
-static void use_callback(signal_parser_t* parser, signal_protocol_t* protocol) {
-  if (protocol && parser->callback_func) {
-    char code[PROTNAME_LEN + MAX_SEQUENCE_LENGTH + 2];
-    snprintf(code, sizeof(code), "%s %s", protocol->name, protocol->seq);
-    parser->callback_func(code);
+/** A code of the protocol has been received completely; returns true if it completed a frame */
+static bool add_code(signal_parser_t* parser, signal_decoder_t* d, const signal_code_t* c) {
+  if (d->seq_len == 0) {
+    d->seq_start = parser->position - c->time_length + 1;
+  }
+  d->seq_len++;
+  if (c->bits) {
+    d->payload = (d->payload << c->bits) | c->value;
+    d->payload_bits += c->bits;
+  }
+  TRACE_MSG(TAG, "  add '%c' to %s (%d bits)", c->name, d->protocol->name, d->payload_bits);
+
+  if ((c->type == CODE_TYPE_END) && (d->seq_len < d->protocol->min_code_len)) {
+    // End packet found but sequence was not started early enough
+    TRACE_MSG(TAG, "  end fragment: %d codes", d->seq_len);
+    reset_protocol(parser, d);
+
+  } else if ((c->type & CODE_TYPE_END) && (d->seq_len >= d->protocol->min_code_len)) {
+    TRACE_MSG(TAG, "  found-1: %d bits", d->payload_bits);
+    use_callback(parser, d);
+    d->seq_len = 0; // delivered, not broken
+    reset_protocol(parser, d);
+    return true;
+
+  } else if ((d->seq_len == d->protocol->max_code_len)) {
+    TRACE_MSG(TAG, "  found-2: %d bits", d->payload_bits);
+    use_callback(parser, d);
+    d->seq_len = 0; // delivered, not broken
+    reset_protocol(parser, d);
+    return true;
   }
+  return false;
 }
 
-/** Check if the duration fits for the protocol */
-static void parse_protocol(signal_parser_t* parser, signal_protocol_t* protocol, code_time_t duration) {
-  signal_code_t* c = protocol->codes;
-  int c_cnt = protocol->code_length;
-  bool any_valid = false;
-  bool retry_candidate = false;
-
-  while (c && c_cnt) {
-    if (c->valid) {
-      // Check if timing fits into this code
-      int8_t i = c->cnt;
-      code_type_t type = c->type;
-      bool matched = false; // until found that the new duration fits
-
-      TRACE_MSG(TAG, "check: %c", c->name);
-
-      if ((protocol->seq_len == 0) && !(type & CODE_TYPE_START)) {
-        // Codes other than start codes are not acceptable as a first code in the sequence
-        // TRACE_MSG(TAG, "  not start");
-
-      } else if ((protocol->seq_len > 0) && !(type & CODE_TYPE_ANY)) {
-        // Codes other than data and end codes are not acceptable during receiving
-        // TRACE_MSG(TAG, "  not data");
-
-      } else if ((duration < c->min_time[i]) || (duration > c->max_time[i])) {
-        // This timing is not matching
-        // TRACE_MSG(TAG, "  no fitting timing");
-
-        if ((i == 1) && (protocol->seq_len == 0)) {
-          // Reanalyze this duration as a first duration for starting
-          retry_candidate = true;
-          // TRACE_MSG(TAG, "  --retry");
-        }
-
-      } else {
-        matched = true; // this code matches
-        c->total += duration;
-      }
-
-      // Write back to code
-      c->valid = matched;
-      any_valid = any_valid || matched;
-
-      if (retry_candidate) {
-        // Reset this code only and try again
-        TRACE_MSG(TAG, "  start retry...");
-        reset_protocol(parser, protocol);
-
-      } else if (matched) {
-        // This timing is matching
-        TRACE_MSG(TAG, "  matched.");
-        c->cnt = i = i + 1;
-
-        if (i == c->time_length) {
-          // All timings received so add code-character
-          if (protocol->seq_len == 0) {
-            TRACE_MSG(TAG, "start: %s %d", protocol->name, c->total);
-            int all_times = 0;
-            for (int tl = 0; tl < c->time_length; tl++) {
-              all_times += c->time[tl];
-            }
-            recalc_protocol(protocol, c->total / all_times);
-          }
+/** Bucket of a duration in the lookup table, -1 if outside the table */
+static inline int lut_bucket(code_time_t duration) {
+  if ((duration < (1u << SIGNAL_LUT_MIN_EXP)) || (duration >= (1u << SIGNAL_LUT_MAX_EXP))) {
+    return -1;
+  }
+  int e = 31 - __builtin_clz(duration);
+  int m = (duration >> (e - SIGNAL_LUT_STEP_BITS)) & (SIGNAL_LUT_STEPS - 1);
+  return (e - SIGNAL_LUT_MIN_EXP) * SIGNAL_LUT_STEPS + m;
+}
 
-          protocol->seq[protocol->seq_len++] = c->name;
-          protocol->seq[protocol->seq_len] = NUL;
-          TRACE_MSG(TAG, "  add '%s'", protocol->seq);
+/** Timing window clamped to a slot's 16 bits; durations that long never reach the exact check */
+static inline uint16_t slot_time(code_time_t t) {
+  return (t > UINT16_MAX) ? UINT16_MAX : (uint16_t)t;
+}
 
-          reset_codes(protocol); // reset all codes but not the protocol
+/** Number the code timings of all protocols and build the duration lookup table; false if out of memory */
+static bool compile_parser(signal_parser_t* parser) {
+  int slot_count = 0;
+  for (int n = 0; n < parser->protocol_count; n++) {
+    const signal_protocol_t* p = parser->decoders[n].protocol;
+    for (int cl = 0; cl < p->code_length; cl++) {
+      slot_count += p->codes[cl].time_length;
+    }
+  }
+  if (slot_count > parser->slot_alloc) {
+    signal_slot_t* slots = (signal_slot_t*)realloc(parser->slots, slot_count * sizeof(signal_slot_t));
+    if (slots == NULL) {
+      return false;
+    }
+    parser->slots = slots;
+    parser->slot_alloc = slot_count;
+  }
 
-          if ((type == CODE_TYPE_END) && (protocol->seq_len < protocol->min_code_len)) {
-            // End packet found but sequence was not started early enough
-            TRACE_MSG(TAG, "  end fragment: %s", protocol->seq);
-            reset_protocol(parser, protocol);
+  int slot = 0;
+  parser->last_slots = 0;
+  parser->expect = 0;
 
-          } else if ((type & CODE_TYPE_END) && (protocol->seq_len >= protocol->min_code_len)) {
-            TRACE_MSG(TAG, "  found-1: %s", protocol->seq);
-            use_callback(parser, protocol);
-            reset_protocol(parser, protocol);
+  for (int n = 0; n < parser->protocol_count; n++) {
+    signal_decoder_t* d = &(parser->decoders[n]);
+    const signal_protocol_t* p = d->protocol;
+    d->slot_mask = 0;
+    d->start_slots = 0;
+    d->next_slots = 0;
+    d->sync_slots = 0;
+
+    for (int cl = 0; cl < p->code_length; cl++) {
+      const signal_code_t* c = &(p->codes[cl]);
+
+      if (c->type & CODE_TYPE_START) {
+        d->start_slots |= 1ULL << slot;
+      }
+      if (c->type & CODE_TYPE_ANY) {
+        d->next_slots |= 1ULL << slot;
+      }
 
-          } else if ((protocol->seq_len == protocol->max_code_len)) {
-            TRACE_MSG(TAG, "  found-2: %s", protocol->seq);
-            use_callback(parser, protocol);
-            reset_protocol(parser, protocol);
-          }
-          break; // no more code checking in this protocol
+      for (int tl = 0; tl < c->time_length; tl++, slot++) {
+        uint64_t bit = 1ULL << slot;
+        d->slot_mask |= bit;
+        if (!(c->type & CODE_TYPE_ANY)) {
+          d->sync_slots |= bit;
+        }
+        parser->slots[slot].min_time = slot_time(c->time[tl].min_time);
+        parser->slots[slot].max_time = slot_time(c->time[tl].max_time);
+        parser->slots[slot].protocol = n;
+        parser->slots[slot].code = cl;
+        if (tl == c->time_length - 1) {
+          parser->last_slots |= bit;
         }
       }
     }
 
-    if (retry_candidate) {
-      // Only loop once
-      retry_candidate = false;
-    } else {
-      // Next code
-      c++;
-      c_cnt--;
-    }
-  }
-
-  if (!any_valid) {
-    TRACE_MSG(TAG, "  no codes.");
-    reset_protocol(parser, protocol);
+    reset_protocol(parser, d);
+    parser->expect |= d->start_slots;
   }
-}
-
-/** Recalculate adjusted timings */
-static void recalc_protocol(signal_protocol_t* protocol, code_time_t base_time) {
-  // Calc min and max and codes_length
-  if (protocol->base_time != base_time) {
-    TRACE_MSG(TAG, "recalc %d", base_time);
-  }
-
-  for (int cl = 0; cl < protocol->code_length; cl++) {
-    signal_code_t* c = &(protocol->codes[cl]);
+  parser->slot_count = slot;
+
+  // A bucket holds a slot if any duration in it falls into the timing window; if only some
+  // do, the window is checked exactly so buckets don't widen it
+  parser->class_count = 0;
+  for (int b = 0; b < SIGNAL_LUT_BUCKETS; b++) {
+    int e = SIGNAL_LUT_MIN_EXP + b / SIGNAL_LUT_STEPS;
+    code_time_t lo = (code_time_t)(SIGNAL_LUT_STEPS + b % SIGNAL_LUT_STEPS) << (e - SIGNAL_LUT_STEP_BITS);
+    code_time_t hi = lo + (1u << (e - SIGNAL_LUT_STEP_BITS)); // exclusive
+    signal_lut_class_t bucket = {0, 0};
+
+    for (int sl = 0; sl < parser->slot_count; sl++) {
+      const signal_slot_t* w = &(parser->slots[sl]);
+      if ((hi > w->min_time) && (lo <= w->max_time)) {
+        bucket.slots |= 1ULL << sl;
+        if ((lo < w->min_time) || (hi - 1 > w->max_time)) {
+          bucket.edge |= 1ULL << sl;
+        }
+      }
+    }
 
-    for (int tl = 0; tl < c->time_length; tl++) {
-      code_time_t t = base_time * c->time[tl];
-      int radius = (t * protocol->tolerance) / 100;
-      c->min_time[tl] = t - radius;
-      c->max_time[tl] = t + radius;
+    int c = 0;
+    if (bucket.slots) {
+      while ((c < parser->class_count) &&
+             ((parser->classes[c].slots != bucket.slots) || (parser->classes[c].edge != bucket.edge))) {
+        c++;
+      }
+      if (c == parser->class_count) {
+        if (c == parser->class_alloc) {
+          int alloc = parser->class_alloc + 8;
+          signal_lut_class_t* classes = (signal_lut_class_t*)realloc(parser->classes, alloc * sizeof(signal_lut_class_t));
+          if (classes == NULL) {
+            return false;
+          }
+          parser->classes = classes;
+          parser->class_alloc = alloc;
+        }
+        parser->classes[c] = bucket;
+        parser->class_count++;
+      }
+      c++; // class numbers start at 1
     }
+    parser->lut[b] = c;
   }
+  return true;
 }
 
 // ===== Public functions =====
 
 void signal_parser_init(signal_parser_t* parser) {
-  parser->protocols = NULL;
+  parser->decoders = NULL;
   parser->protocol_alloc = 0;
   parser->protocol_count = 0;
   parser->callback_func = NULL;
+  parser->broken_frames = 0;
+  parser->position = 0;
+  memset(parser->lut, 0, sizeof(parser->lut));
+  parser->classes = NULL;
+  parser->class_count = 0;
+  parser->class_alloc = 0;
+  parser->slots = NULL;
+  parser->slot_count = 0;
+  parser->slot_alloc = 0;
+  parser->last_slots = 0;
+  parser->expect = 0;
+}
+
+void signal_parser_free(signal_parser_t* parser) {
+  free(parser->decoders);
+  free(parser->classes);
+  free(parser->slots);
+  signal_parser_init(parser);
 }
 
 void signal_parser_attach_callback(signal_parser_t* parser, signal_callback_t callback) {
@@ -223,16 +262,130 @@ void signal_parser_attach_callback(signal_parser_t* parser, signal_callback_t ca
 }
 
 int signal_parser_get_send_repeat(signal_parser_t* parser, char* name) {
-  signal_protocol_t* p = find_protocol(parser, name);
+  const signal_protocol_t* p = find_protocol(parser, name);
   return (p ? p->send_repeat : 0);
 }
 
 void signal_parser_parse(signal_parser_t* parser, code_time_t duration) {
   TRACE_MSG(TAG, "(%d)", duration);
 
+  // Advance all codes of all protocols at once: a slot survives if the duration fits its window,
+  // and then expects the following timing of its code
+  parser->position++;
+  int b = lut_bucket(duration);
+  const signal_lut_class_t* cls = ((b >= 0) && parser->lut[b]) ? &(parser->classes[parser->lut[b] - 1]) : NULL;
+  uint64_t matched = cls ? (parser->expect & cls->slots) : 0;
+  for (uint64_t edge = cls ? (matched & cls->edge) : 0; edge; edge &= edge - 1) {
+    int slot = __builtin_ctzll(edge);
+    if ((duration < parser->slots[slot].min_time) || (duration > parser->slots[slot].max_time)) {
+      matched &= ~(1ULL << slot);
+    }
+  }
+  uint64_t completed = matched & parser->last_slots;
+  uint64_t next = (matched & ~parser->last_slots) << 1;
+
+  // Completed codes (the first one in table order wins within a protocol)
+  while (completed) {
+    signal_decoder_t* d = &(parser->decoders[parser->slots[__builtin_ctzll(completed)].protocol]);
+    uint64_t done = completed & d->slot_mask;
+    uint64_t data = done & ~d->sync_slots;
+    completed &= ~d->slot_mask;
+
+    if ((d->seq_len > 0) && !data) {
+      // A sync code only restarts a sequence that cannot go on
+      if (next & d->slot_mask & ~d->sync_slots) {
+        continue;
+      }
+      TRACE_MSG(TAG, "  restart: %s", d->protocol->name);
+      reset_protocol(parser, d);
+    } else if (d->seq_len > 0) {
+      done = data;
+    }
+
+    next &= ~(d->slot_mask & ~d->sync_slots); // other partial codes of this protocol are dropped
+    int slot = __builtin_ctzll(done);
+    bool delivered = add_code(parser, d, &(d->protocol->codes[parser->slots[slot].code]));
+    if (d->seq_len > 0) {
+      next |= d->next_slots;
+    } else {
+      // Delivered or dropped: a sync code that began inside that frame cannot start the next one
+      next &= ~d->slot_mask;
+    }
+
+    // Protocols with the same timings (it1 repeats are valid sc5 frames, shifted by the sync) would report
+    // one transmission twice: a delivered frame wins over sequences of other protocols that began inside it
+    for (int n = 0; delivered && n < parser->protocol_count; n++) {
+      signal_decoder_t* o = &(parser->decoders[n]);
+      if ((o != d) && (o->seq_len > 0) && ((int16_t)(o->seq_start - d->seq_start) > 0)) {
+        TRACE_MSG(TAG, "  overlapped by %s: %s", d->protocol->name, o->protocol->name);
+        o->seq_len = 0; // superseded, not broken
+        reset_protocol(parser, o);
+        completed &= ~o->slot_mask;
+        next &= ~o->slot_mask;
+      }
+    }
+  }
+
+  for (int n = 0; n < parser->protocol_count; n++) {
+    signal_decoder_t* d = &(parser->decoders[n]);
+
+    if ((d->seq_len > 0) && !(next & d->slot_mask & ~d->sync_slots)) {
+      TRACE_MSG(TAG, "  no codes: %s", d->protocol->name);
+      reset_protocol(parser, d);
+    }
+
+    // Outside a sequence every duration may start one; inside, sync codes are watched for a restart
+    next |= (d->seq_len == 0) ? d->start_slots : (d->start_slots & d->sync_slots);
+  }
+
+  parser->expect = next;
+}
+
+bool signal_parser_in_sequence(signal_parser_t* parser) {
   for (int n = 0; n < parser->protocol_count; n++) {
-    parse_protocol(parser, parser->protocols[n], duration);
+    if (parser->decoders[n].seq_len > 0) {
+      return true;
+    }
   }
+  return false;
+}
+
+int signal_parser_min_frame_timings(signal_parser_t* parser) {
+  int min_timings = 0;
+
+  for (int n = 0; n < parser->protocol_count; n++) {
+    const signal_protocol_t* p = parser->decoders[n].protocol;
+    int shortest = MAX_TIMELENGTH;
+    for (int cl = 0; cl < p->code_length; cl++) {
+      if ((p->codes[cl].type & CODE_TYPE_ANY) && p->codes[cl].time_length < shortest) {
+        shortest = p->codes[cl].time_length;
+      }
+    }
+    int timings = (p->min_code_len - 1) * shortest;
+    if (min_timings == 0 || timings < min_timings) {
+      min_timings = timings;
+    }
+  }
+  return min_timings;
+}
+
+int signal_parser_get_slots(signal_parser_t* parser, uint8_t id) {
+  int slots = 0;
+  for (int n = 0; n < parser->protocol_count; n++) {
+    if (parser->decoders[n].protocol->id == id) {
+      slots += __builtin_popcountll(parser->decoders[n].slot_mask);
+    }
+  }
+  return slots;
+}
+
+const char* signal_parser_get_protocol_name(signal_parser_t* parser, uint8_t id) {
+  for (int n = 0; n < parser->protocol_count; n++) {
+    if (parser->decoders[n].protocol->id == id) {
+      return parser->decoders[n].protocol->name;
+    }
+  }
+  return "?";
 }
 
 void signal_parser_compose(signal_parser_t* parser, const char* sequence, code_time_t* timings, int len) {
@@ -250,16 +403,16 @@ void signal_parser_compose(signal_parser_t* parser, const char* sequence, code_t
       }
       *tar = NUL;
     }
-    signal_protocol_t* p = find_protocol(parser, protname);
+    const signal_protocol_t* p = find_protocol(parser, protname);
 
     s++; // to start of code characters
 
     if (p && timings) {
       while (*s && len) {
-        signal_code_t* c = find_code(p, *s);
+        const signal_code_t* c = find_code(p, *s);
         if (c) {
           for (int i = 0; i < c->time_length; i++) {
-            *timings++ = (c->min_time[i] + c->max_time[i]) / 2;
+            *timings++ = (c->time[i].min_time + c->time[i].max_time) / 2;
           }
         }
         s++;
@@ -270,48 +423,82 @@ void signal_parser_compose(signal_parser_t* parser, const char* sequence, code_t
   }
 }
 
-void signal_parser_load(signal_parser_t* parser, signal_protocol_t* protocol, code_time_t other_base_time) {
+bool signal_parser_load(signal_parser_t* parser, const signal_protocol_t* protocol) {
   if (protocol) {
     TRACE_MSG(TAG, "loading protocol %s", protocol->name);
 
-    // Get space for protocol definition
+    // Every code timing needs a slot in the compiled decoder
+    int slots = 0;
+    for (int n = 0; n < protocol->code_length; n++) {
+      slots += protocol->codes[n].time_length;
+    }
+    if (parser->slot_count + slots > SIGNAL_MAX_SLOTS) {
+      ERROR_MSG(TAG, "%s: needs %d slots, %d of %d left, not loaded", protocol->name, slots,
+                SIGNAL_MAX_SLOTS - parser->slot_count, SIGNAL_MAX_SLOTS);
+      return false;
+    }
+
+    // Get space for the decoder state
     if (parser->protocol_count >= parser->protocol_alloc) {
+      TRACE_MSG(TAG, "alloc %d", parser->protocol_alloc + 8);
+      signal_decoder_t* decoders =
+          (signal_decoder_t*)realloc(parser->decoders, (parser->protocol_alloc + 8) * sizeof(signal_decoder_t));
+      if (decoders == NULL) {
+        ERROR_MSG(TAG, "%s: out of memory, not loaded", protocol->name);
+        return false;
+      }
+      parser->decoders = decoders;
       parser->protocol_alloc += 8;
-      TRACE_MSG(TAG, "alloc %d", parser->protocol_alloc);
-      parser->protocols = (signal_protocol_t**)realloc(parser->protocols, parser->protocol_alloc * sizeof(signal_protocol_t*));
     }
 
     // Fill last one
-    parser->protocols[parser->protocol_count] = protocol;
+    signal_decoder_t* d = &(parser->decoders[parser->protocol_count]);
+    memset(d, 0, sizeof(signal_decoder_t));
+    d->protocol = protocol;
     TRACE_MSG(TAG, "_p[%d]=%p", parser->protocol_count, (void*)protocol);
     parser->protocol_count += 1;
 
-    code_time_t base_time = protocol->base_time;
-
-    // Calc c->time_length and p->code_length
-    int cl = 0;
-    while ((cl < MAX_CODELENGTH) && (protocol->codes[cl].name)) {
-      signal_code_t* c = &(protocol->codes[cl]);
-
-      int tl = 0;
-      while ((tl < MAX_TIMELENGTH) && (c->time[tl])) {
-        tl++;
+    // Longer sequences keep only their last SIGNAL_MAX_PAYLOAD_BITS bits
+    int max_bits = 0;
+    for (int n = 0; n < protocol->code_length; n++) {
+      if (protocol->codes[n].bits > max_bits) {
+        max_bits = protocol->codes[n].bits;
       }
-      c->time_length = tl;
-      cl++;
     }
-    protocol->code_length = cl; // no need to specify code_length
+    if (max_bits * protocol->max_code_len > SIGNAL_MAX_PAYLOAD_BITS) {
+      ERROR_MSG(TAG, "%s: up to %d payload bits, only %d kept", protocol->name, max_bits * protocol->max_code_len,
+                SIGNAL_MAX_PAYLOAD_BITS);
+    }
 
-    recalc_protocol(protocol, base_time);
-    reset_protocol(parser, protocol);
+    if (!compile_parser(parser)) {
+      // The tables still fit the protocols loaded before
+      ERROR_MSG(TAG, "%s: out of memory, not loaded", protocol->name);
+      parser->protocol_count -= 1;
+      compile_parser(parser);
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
 
-    for (int n = 0; n < parser->protocol_count; n++) {
-      TRACE_MSG(TAG, " reg[%d] = %p", n, (void*)parser->protocols[n]);
+int signal_parser_unload(signal_parser_t* parser, uint8_t id) {
+  int kept = 0;
+  for (int n = 0; n < parser->protocol_count; n++) {
+    if (parser->decoders[n].protocol->id != id) {
+      parser->decoders[kept++] = parser->decoders[n];
     }
   }
+
+  int removed = parser->protocol_count - kept;
+  if (removed > 0) {
+    parser->protocol_count = kept;
+    compile_parser(parser); // also drops any sequence in progress; fewer slots and classes always fit
+  }
+  return removed;
 }
 
-void signal_parser_dump_protocol(signal_protocol_t* protocol) {
+void signal_parser_dump_protocol(const signal_protocol_t* protocol) {
   TRACE_MSG(TAG, "dump %p", (void*)protocol);
 
   if (protocol) {
@@ -319,14 +506,14 @@ void signal_parser_dump_protocol(signal_protocol_t* protocol) {
     RAW_MSG("Protocol '%s', min:%d max:%d tol:%02u rep:%d\n", protocol->name, protocol->min_code_len, protocol->max_code_len,
             protocol->tolerance, protocol->send_repeat);
 
-    signal_code_t* c = protocol->codes;
+    const signal_code_t* c = protocol->codes;
     int cnt = protocol->code_length;
 
     while (c && cnt) {
       RAW_MSG("  '%c' |", c->name);
 
       for (int n = 0; n < c->time_length; n++) {
-        RAW_MSG("%5d -%5d |", c->min_time[n], c->max_time[n]);
+        RAW_MSG("%5d -%5d |", c->time[n].min_time, c->time[n].max_time);
       }
       RAW_MSG("\n");
 
@@ -337,10 +524,24 @@ void signal_parser_dump_protocol(signal_protocol_t* protocol) {
   }
 }
 
+void signal_parser_report_sizes(signal_parser_t* parser) {
+  for (int n = 0; n < parser->protocol_count; n++) {
+    const signal_decoder_t* d = &(parser->decoders[n]);
+    unsigned ram = sizeof(signal_decoder_t) + __builtin_popcountll(d->slot_mask) * sizeof(signal_slot_t);
+    INFO_MSG(TAG, "%s: %u bytes RAM, was %u (definition of %u bytes in flash)", d->protocol->name, ram,
+             (unsigned)SIGNAL_PARSER_RAM_DEFINITION_BYTES, (unsigned)sizeof(signal_protocol_t));
+  }
+  unsigned lut = sizeof(parser->lut) + parser->class_alloc * sizeof(signal_lut_class_t);
+  INFO_MSG(TAG, "%d protocols, %d slots, %u bytes parser state (lookup table %u bytes, %d classes)", parser->protocol_count,
+           parser->slot_count,
+           (unsigned)(sizeof(signal_parser_t) + parser->protocol_alloc * sizeof(signal_decoder_t) +
+                      parser->class_alloc * sizeof(signal_lut_class_t) + parser->slot_alloc * sizeof(signal_slot_t)),
+           lut, parser->class_count);
+}
+
 void signal_parser_dump_table(signal_parser_t* parser) {
   for (int n = 0; n < parser->protocol_count; n++) {
-    signal_protocol_t* p = parser->protocols[n];
-    signal_parser_dump_protocol(p);
+    signal_parser_dump_protocol(parser->decoders[n].protocol);
   }
 }
 
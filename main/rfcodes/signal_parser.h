@@ -24,6 +24,19 @@
 
 #define PROTNAME_LEN 12 // maximal protocol name len including ending '\0'
 
+#define SIGNAL_MAX_PAYLOAD_BITS 64 // decoded bits are accumulated into a uint64_t
+
+// Compiled decoder: every timing of every code of every loaded protocol is one bit ("slot") of a uint64_t
+#define SIGNAL_MAX_SLOTS 64
+
+// Durations are quantized into log-spaced buckets: SIGNAL_LUT_STEPS per octave from 2^SIGNAL_LUT_MIN_EXP µs
+// up to 2^SIGNAL_LUT_MAX_EXP µs. Shorter or longer durations match no code.
+#define SIGNAL_LUT_MIN_EXP 6
+#define SIGNAL_LUT_MAX_EXP 15
+#define SIGNAL_LUT_STEP_BITS 3
+#define SIGNAL_LUT_STEPS (1 << SIGNAL_LUT_STEP_BITS)
+#define SIGNAL_LUT_BUCKETS ((SIGNAL_LUT_MAX_EXP - SIGNAL_LUT_MIN_EXP) * SIGNAL_LUT_STEPS)
+
 // ===== Type definitions =====
 
 // Use-cases of a defined code (start, data, end)
@@ -35,56 +48,130 @@ typedef enum {
   CODE_TYPE_ANY = 0x06      // (DATA | END) A code with data that can end the sequence
 } code_type_t;
 
+// Identifies a protocol in decoded frames
+typedef enum {
+  PROTOCOL_ID_NONE = 0,
+  PROTOCOL_ID_IT1,
+  PROTOCOL_ID_IT2,
+  PROTOCOL_ID_SC5,
+  PROTOCOL_ID_EV1527,
+  PROTOCOL_ID_CW,
+  PROTOCOL_ID_LEARNED = 0x80, // inferred from a recording by signal_learner_infer()
+} signal_protocol_id_t;
+
+// A decoded sequence: the data codes' values concatenated, first code in the highest bits
+typedef struct {
+  uint8_t protocol_id; // signal_protocol_id_t
+  uint8_t bits;        // number of valid bits in payload
+  uint64_t payload;
+} signal_frame_t;
+
 // Timings are using code_time_t datatypes meaning µsecs
 typedef unsigned int code_time_t;
 
-// The Code structure is used to hold a specific timing sequence used in the protocol
+// One timing of a code: the range of durations accepted for it
 typedef struct {
-  code_type_t type; // type of usage of code
-  char name;        // single character name for this code used for the message string
+  code_time_t min_time;
+  code_time_t max_time;
+} signal_timing_t;
 
-  code_time_t time[MAX_TIMELENGTH]; // ideal time of the code part
+// Window for a timing of n base times with a tolerance in percent, computed by the compiler
+#define SIGNAL_TIMING(base, tolerance, n)                                                                              \
+  { (base) * (n) - (base) * (n) * (tolerance) / 100, (base) * (n) + (base) * (n) * (tolerance) / 100 }
 
-  // These members will be calculated:
-  int time_length;   // number of timings for this code
-  code_time_t total; // total time in this code
+// A code from its type, name, payload bits and value, followed by its SIGNAL_TIMING()s
+#define SIGNAL_CODE(_type, _name, _bits, _value, ...)                                                                  \
+  {                                                                                                                    \
+    .type = (_type), .name = (_name), .bits = (_bits), .value = (_value),                                              \
+    .time_length = sizeof((signal_timing_t[]){__VA_ARGS__}) / sizeof(signal_timing_t), .time = { __VA_ARGS__ }         \
+  }
 
-  code_time_t min_time[MAX_TIMELENGTH]; // minimum time of the code part
-  code_time_t max_time[MAX_TIMELENGTH]; // maximum time of the code part
+// The codes of a protocol, each a SIGNAL_CODE()
+#define SIGNAL_CODES(...)                                                                                              \
+  .code_length = sizeof((signal_code_t[]){__VA_ARGS__}) / sizeof(signal_code_t), .codes = { __VA_ARGS__ }
 
-  // These fields reflect the current status of the code
-  int cnt;    // number of discovered timings
-  bool valid; // is true while discovering and the code is still possible
+// The Code structure is used to hold a specific timing sequence used in the protocol
+typedef struct {
+  uint8_t type;        // code_type_t: type of usage of code
+  char name;           // single character name for this code used for the message string
+  uint8_t bits;        // number of payload bits this code adds (0 for pure start/end codes)
+  uint8_t value;       // value of those bits
+  uint8_t time_length; // number of timings for this code
+  signal_timing_t time[MAX_TIMELENGTH];
 } signal_code_t;
 
-// The Protocol structure is used to hold the basic settings for a protocol
+// The Protocol structure holds the definition of a protocol with precomputed timing windows.
+// Definitions are const so they stay in flash; the parser keeps a small signal_decoder_t per loaded protocol.
 typedef struct {
-  // These members must be initialized for load():
   char name[PROTNAME_LEN];   // name of the protocol
-  unsigned int min_code_len; // minimal number of codes in a row required by the protocol
-  unsigned int max_code_len; // maximum number of codes in a row defining a complete sequence
-  unsigned int tolerance;    // tolerance of the timings in percent
-  unsigned int send_repeat;  // Number of repeats when sending
+  uint8_t id;                // signal_protocol_id_t reported in decoded frames
+  uint8_t code_length;       // number of defined codes
+  uint16_t min_code_len;     // minimal number of codes in a row required by the protocol
+  uint16_t max_code_len;     // maximum number of codes in a row defining a complete sequence
+  uint8_t tolerance;         // tolerance of the timings in percent (already applied to the windows)
+  uint8_t send_repeat;       // Number of repeats when sending
   code_time_t base_time;     // base time for protocol
-  code_time_t real_base;     // calculated real base time
 
   signal_code_t codes[MAX_CODELENGTH];
-
-  // ===== These members are used while parsing:
-  int code_length;               // Number of defined codes in this table
-  char seq[MAX_SEQUENCE_LENGTH]; // current sequence being parsed
-  int seq_len;                   // length of current sequence
 } signal_protocol_t;
 
+// Decoder state of a loaded protocol
+typedef struct {
+  const signal_protocol_t* protocol;
+
+  // Set up when the parser is compiled:
+  uint64_t slot_mask;   // all slots of this protocol
+  uint64_t start_slots; // first timings of codes that may start a sequence
+  uint64_t next_slots;  // first timings of codes that may follow within a sequence
+  uint64_t sync_slots;  // all timings of pure start codes (these restart a broken sequence)
+
+  // Used while parsing:
+  uint64_t payload;     // bits decoded so far
+  uint8_t payload_bits; // number of bits in payload
+  uint16_t seq_len;     // number of codes in current sequence
+  uint16_t seq_start;   // parser position of the first timing of the sequence
+} signal_decoder_t;
+
+// A timing of a loaded code in the compiled decoder
+typedef struct {
+  uint16_t min_time; // timing window, clamped to 16 bits (longer durations are outside the lookup table)
+  uint16_t max_time;
+  uint8_t protocol;  // index into decoders
+  uint8_t code;      // index into the protocol's codes
+} signal_slot_t;
+
+// Slots of one or more duration buckets of the lookup table
+typedef struct {
+  uint64_t slots; // slots whose timing window overlaps the bucket
+  uint64_t edge;  // of those, slots whose window ends inside the bucket (checked exactly)
+} signal_lut_class_t;
+
 // Callback when a code sequence was detected
-typedef void (*signal_callback_t)(const char* code);
+typedef void (*signal_callback_t)(const signal_frame_t* frame);
+
+// Callback for raw timings in µs (see signal_collector_attach_observer)
+typedef void (*signal_timing_callback_t)(code_time_t duration);
 
 // SignalParser structure (replaces C++ class)
 typedef struct {
-  signal_protocol_t** protocols;
+  signal_decoder_t* decoders; // one per loaded protocol
   int protocol_alloc;
   int protocol_count;
   signal_callback_t callback_func;
+  uint32_t broken_frames; // sequences abandoned after reaching half their minimum length
+  uint16_t position;      // durations parsed so far (wraps), to order overlapping sequences
+
+  // Compiled decoder (rebuilt by signal_parser_load). Most buckets share their slots with a
+  // neighbour, so each bucket holds a class number and the classes are stored once.
+  uint8_t lut[SIGNAL_LUT_BUCKETS]; // class of each duration bucket, 0 for none
+  signal_lut_class_t* classes;     // class n at index n - 1
+  uint8_t class_count;
+  uint8_t class_alloc;
+  uint8_t slot_count;
+  uint8_t slot_alloc;
+  signal_slot_t* slots;
+  uint64_t last_slots; // slots holding the last timing of their code
+  uint64_t expect;     // slots that may take the next duration
 } signal_parser_t;
 
 // ===== Public Functions =====
@@ -95,6 +182,12 @@ typedef struct {
  */
 void signal_parser_init(signal_parser_t* parser);
 
+/**
+ * @brief Free the memory of a parser; it can be loaded again after signal_parser_init()
+ * @param parser Pointer to parser structure
+ */
+void signal_parser_free(signal_parser_t* parser);
+
 /**
  * @brief Attach a callback function that will get passed any new code
  * @param parser Pointer to parser structure
@@ -128,17 +221,68 @@ void signal_parser_compose(signal_parser_t* parser, const char* sequence, code_t
 
 /**
  * @brief Load a protocol to be used
+ *
+ * The definition is referenced, not copied, and must stay valid while the parser is used.
+ * Fails (protocol not loaded) if all loaded protocols together would have more
+ * than SIGNAL_MAX_SLOTS code timings, or if the decoder tables can't be allocated.
  * @param parser Pointer to parser structure
  * @param protocol Protocol to load
- * @param other_base_time Alternative base time (0 = use protocol default)
+ * @return true if the protocol was loaded
  */
-void signal_parser_load(signal_parser_t* parser, signal_protocol_t* protocol, code_time_t other_base_time);
+bool signal_parser_load(signal_parser_t* parser, const signal_protocol_t* protocol);
+
+/**
+ * @brief Unload all protocols with an id, e.g. before replacing a learned definition
+ * @param parser Pointer to parser structure
+ * @param id Protocol id
+ * @return Number of protocols unloaded
+ */
+int signal_parser_unload(signal_parser_t* parser, uint8_t id);
+
+/**
+ * @brief Check whether any protocol is in the middle of receiving a sequence
+ * @param parser Pointer to parser structure
+ * @return true while a sequence has been started but not completed or rejected
+ */
+bool signal_parser_in_sequence(signal_parser_t* parser);
+
+/**
+ * @brief Number of timings following the start code in the shortest frame of any loaded protocol
+ * @param parser Pointer to parser structure
+ * @return Timing count, 0 if no protocol is loaded
+ */
+int signal_parser_min_frame_timings(signal_parser_t* parser);
+
+/**
+ * @brief Decoder slots (code timings) taken by the loaded protocols with an id
+ * @param parser Pointer to parser structure
+ * @param id Protocol id
+ * @return Slot count, 0 if no loaded protocol has this id
+ */
+int signal_parser_get_slots(signal_parser_t* parser, uint8_t id);
+
+/**
+ * @brief Name of a loaded protocol
+ * @param parser Pointer to parser structure
+ * @param id Protocol id from a decoded frame
+ * @return Protocol name, "?" if no loaded protocol has this id
+ */
+const char* signal_parser_get_protocol_name(signal_parser_t* parser, uint8_t id);
 
 /**
  * @brief Dump protocol information for debugging
  * @param protocol Protocol to dump
  */
-void signal_parser_dump_protocol(signal_protocol_t* protocol);
+void signal_parser_dump_protocol(const signal_protocol_t* protocol);
+
+/**
+ * @brief Log the RAM used by each loaded protocol, against the mutable definition it used to need
+ *
+ * Definitions are in flash; a protocol's RAM is its decoder state and its slots in
+ * the compiled decoder. The lookup table is shared and logged with the total.
+ * @param parser Pointer to parser structure
+ */
+void signal_parser_report_sizes(signal_parser_t* parser);
 
 /**
  * @brief Dump all loaded protocols
@@ -1,22 +1,904 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <errno.h>
 #include "config.h"
 #include "lwip/sockets.h"
+#include "lwip/icmp.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ip4.h"
 #include "protocol.h"
 #include "wifi.h"
 #include "relays.h"
 #include "relay_config.h"
+#include "groups.h"
+#include "response_cache.h"
+#include "boot_profile.h"
+#include "latency.h"
 
-void relay_server_task(void* pvParameters) {
-  struct sockaddr_in server_addr, client_addr;
+// Receive buffer must hold the largest frame (header + 255 byte string)
+#define RELAY_SESSION_RECV_BUF 320
+// Responses of one pipelined batch are coalesced into a single send
+#define RELAY_SESSION_SEND_BUF 512
+// Persistent connections are dropped after this long without a request
+#define RELAY_SESSION_IDLE_MS 10000
+// When all slots are busy, a new client may evict one idle for at least this long
+#define RELAY_SESSION_EVICT_MS 1000
+// select() wakes at least this often to expire idle connections
+#define RELAY_SERVER_TICK_MS 1000
+// Without a wake socket, state changes are polled at this interval while anyone is subscribed
+#define RELAY_PUSH_POLL_MS 20
+// Keepalive for subscribers: probe after this long without traffic, then every
+// interval, and drop the peer after count unanswered probes (~45 s for a dead peer)
+#define RELAY_KEEPALIVE_IDLE_S 30
+#define RELAY_KEEPALIVE_INTERVAL_S 5
+#define RELAY_KEEPALIVE_COUNT 3
+// The gateway is pinged this often for the round-trip histogram; a reply later than the timeout counts as lost
+#define RELAY_PING_INTERVAL_MS 10000
+#define RELAY_PING_TIMEOUT_MS 2000
+#define RELAY_PING_ID 0x524C // "RL"
+// A group socket that could not be opened is retried this often
+#define RELAY_GROUP_RETRY_MS 1000
+// Recent UDP toggles remembered so a retried datagram is not applied twice
+#define RELAY_UDP_REPLAY_SLOTS 4
+
+/**
+ * Connection budget
+ *
+ * lwIP only has CONFIG_LWIP_MAX_SOCKETS sockets for the whole firmware. Leave room
+ * for the HTTP server (listener + client), SSDP, one WeMo listener per relay, the RF
+ * capture listener and client, and our own TCP listener, UDP (which also carries the
+ * wake datagrams), group and ping sockets; the rest can be used for binary protocol
+ * clients. The SDK caps CONFIG_LWIP_MAX_SOCKETS at 16, so adding relays or sockets
+ * elsewhere comes out of this budget.
+ */
+#define RELAY_SOCKETS_RESERVED (9 + (int)NUM_RELAYS)
+#define RELAY_MAX_CLIENTS (CONFIG_LWIP_MAX_SOCKETS - RELAY_SOCKETS_RESERVED)
+// One subscriber plus one request/response client (see CMD_SUBSCRIBE)
+#define RELAY_MIN_CLIENTS 2
+
+_Static_assert(RELAY_MAX_CLIENTS >= RELAY_MIN_CLIENTS, "Too few lwIP sockets left for binary protocol clients");
+
+// Per-connection state
+typedef struct {
+  int sock;             // -1 when the slot is free
+  uint32_t last_active; // ms timestamp of the last received data
+  uint16_t have;        // bytes buffered in recv_buf
+  bool subscribed;      // CMD_SUBSCRIBE active: push status on every change
+  bool subscribed_wide; // push RESP_STATUS_WIDE frames instead of v2 status
+  uint32_t pushed_version; // last relay state version sent to this subscriber
+  const uint8_t* direct_frame; // long response to send as-is after the current batch
+  size_t direct_len;
+  uint8_t recv_buf[RELAY_SESSION_RECV_BUF];
+} relay_conn_t;
+
+static relay_conn_t relay_conns[RELAY_MAX_CLIENTS];
+
+// The UDP socket, which the relay actor sends a loopback datagram to on state changes
+// so select() returns to push them; select() cannot wait on a task notification
+static int relay_wake_sock = -1;
+static struct sockaddr_in relay_wake_addr;
+static volatile bool relay_wake_pending = false; // a wake datagram is queued and not yet read
+static volatile bool relay_push_wanted = false;  // someone is subscribed
+
+// Gateway ping in flight, if any
+static uint16_t relay_ping_seq = 0;
+static int64_t relay_ping_sent_us = 0;
+static bool relay_ping_waiting = false;
+
+// Reply to a recent non-idempotent UDP request, keyed by sender and request ID
+typedef struct {
+  uint32_t addr;
+  uint16_t port;
+  uint16_t req_id;
+  uint8_t resp_len; // 0 = unused slot
+  uint8_t resp[8];
+} relay_udp_replay_t;
+
+static relay_udp_replay_t relay_udp_replay[RELAY_UDP_REPLAY_SLOTS];
+static uint8_t relay_udp_replay_next = 0;
+
+// Number of connections currently subscribed to pushes
+static int relay_subscriber_count(void) {
+  int count = 0;
+  for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+    if (relay_conns[i].sock >= 0 && relay_conns[i].subscribed) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Current status frame for a subscriber, in the format it subscribed with; records the version sent
+static size_t relay_status_push_frame(relay_conn_t* conn, uint8_t* buf) {
+  relay_mask_t states;
+  uint32_t version;
+  relays_snapshot(&states, &version);
+  conn->pushed_version = version;
+
+  if (conn->subscribed_wide) {
+    return proto_status_wide_response(buf, NUM_RELAYS, states, true, version);
+  }
+  return proto_status_version_response(buf, (uint8_t)states, version);
+}
+
+/**
+ * Handle a single request and build its response in send_buf (at least MAX_RESP_FRAME bytes).
+ * payload holds any bytes following the 4-byte header (relay name/room, wide masks).
+ * conn is the originating TCP connection, or NULL for connectionless requests.
+ * Responses too long for send_buf are left in conn->direct_frame instead.
+ */
+static size_t relay_handle_request(relay_conn_t* conn, const relay_request_t* req, const uint8_t* payload, size_t payload_len,
+                                   uint8_t* send_buf) {
+  size_t resp_len = 0;
+
+  boot_mark(BOOT_FIRST_NET_COMMAND);
+
+  switch (req->cmd) {
+  case CMD_PING:
+    ESP_LOGI(TAG, "PING");
+    resp_len = proto_pong_response(send_buf);
+    break;
+
+  case CMD_GET_STATUS: {
+    uint8_t states = (uint8_t)relay_get_mask(); // v2: relays 0-7 only
+    ESP_LOGI(TAG, "GET_STATUS: 0x%02X", states);
+    resp_len = proto_status_response(send_buf, states);
+    break;
+  }
+
+  case CMD_GET_STATUS_WIDE: {
+    relay_mask_t states = relay_get_mask();
+    ESP_LOGI(TAG, "GET_STATUS_WIDE: 0x%08X", (unsigned)states);
+    resp_len = proto_status_wide_response(send_buf, NUM_RELAYS, states, false, 0);
+    break;
+  }
+
+  case CMD_SET_RELAY:
+    if (req->relay_id < NUM_RELAYS) {
+      ESP_LOGI(TAG, "SET relay %d -> %d", req->relay_id, req->value);
+      bool ok = relay_set(req->relay_id, req->value != 0);
+      resp_len = ok ? proto_ok_response(send_buf) : proto_error_response(send_buf, ERR_BUSY);
+    } else {
+      resp_len = proto_error_response(send_buf, 0x01); // Invalid relay
+    }
+    break;
+
+  case CMD_TOGGLE_RELAY:
+    if (req->relay_id < NUM_RELAYS) {
+      bool ok = relay_toggle(req->relay_id);
+      ESP_LOGI(TAG, "TOGGLE relay %d -> %d", req->relay_id, relay_get(req->relay_id));
+      resp_len = ok ? proto_ok_response(send_buf) : proto_error_response(send_buf, ERR_BUSY);
+    } else {
+      resp_len = proto_error_response(send_buf, 0x01);
+    }
+    break;
+
+  case CMD_SET_ALL:
+    // v2 masks are 8 bits wide: relays beyond 7 are left alone rather than switched off
+    ESP_LOGI(TAG, "SET_ALL: 0x%02X", req->relay_id);
+    resp_len = relays_set_mask(0xFF, req->relay_id) ? proto_ok_response(send_buf)
+                                                    : proto_error_response(send_buf, ERR_BUSY);
+    break;
+
+  case CMD_SET_MASKED:
+    ESP_LOGI(TAG, "SET_MASKED: 0x%02X -> 0x%02X", req->relay_id, req->value);
+    resp_len = relays_set_mask(req->relay_id, req->value) ? proto_ok_response(send_buf)
+                                                          : proto_error_response(send_buf, ERR_BUSY);
+    break;
+
+  case CMD_SET_ALL_WIDE:
+  case CMD_SET_MASKED_WIDE: {
+    size_t width = req->value;
+    bool masked = req->cmd == CMD_SET_MASKED_WIDE;
+    if (width == 0 || width > MAX_MASK_BYTES || payload_len < (masked ? 2 : 1) * width) {
+      resp_len = proto_error_response(send_buf, ERR_INVALID_VALUE);
+      break;
+    }
+
+    relay_mask_t select = masked ? proto_get_mask(payload, width) : RELAY_MASK_ALL;
+    relay_mask_t states = proto_get_mask(payload + (masked ? width : 0), width);
+    ESP_LOGI(TAG, "SET_WIDE: 0x%08X -> 0x%08X", (unsigned)select, (unsigned)states);
+    resp_len = relays_set_mask(select, states) ? proto_ok_response(send_buf)
+                                               : proto_error_response(send_buf, ERR_BUSY);
+    break;
+  }
+
+  case CMD_SUBSCRIBE: {
+    if (conn == NULL) {
+      resp_len = proto_error_response(send_buf, ERR_UNKNOWN_CMD); // Needs a connection to push on
+      break;
+    }
+
+    // Subscribers are never evicted, so keep at least one slot free for request/response clients
+    if (req->value != 0 && !conn->subscribed && relay_subscriber_count() >= RELAY_MAX_CLIENTS - 1) {
+      ESP_LOGW(TAG, "SUBSCRIBE: refused, %d of %d slots already subscribed", relay_subscriber_count(), RELAY_MAX_CLIENTS);
+      resp_len = proto_error_response(send_buf, ERR_BUSY);
+      break;
+    }
+
+    conn->subscribed = req->value != 0;
+    conn->subscribed_wide = req->value == 2;
+    ESP_LOGI(TAG, "SUBSCRIBE: %s", conn->subscribed ? (conn->subscribed_wide ? "wide" : "on") : "off");
+
+    if (conn->subscribed) {
+      // Ack with the current snapshot; later changes are pushed in the same format
+      resp_len = relay_status_push_frame(conn, send_buf);
+
+      // Subscribers sit idle for long periods, let TCP detect dead peers instead.
+      // lwIP's default probes only start after 2 hours, holding the slot that long.
+      int keepalive = 1;
+      int idle = RELAY_KEEPALIVE_IDLE_S;
+      int interval = RELAY_KEEPALIVE_INTERVAL_S;
+      int count = RELAY_KEEPALIVE_COUNT;
+      setsockopt(conn->sock, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+      setsockopt(conn->sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+      setsockopt(conn->sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+      setsockopt(conn->sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    } else {
+      resp_len = proto_ok_response(send_buf);
+    }
+    break;
+  }
+
+  case CMD_DESCRIBE: {
+    ESP_LOGI(TAG, "DESCRIBE");
+    const uint8_t* frame = resp_cache_describe(&resp_len);
+    memcpy(send_buf, frame, resp_len);
+    break;
+  }
+
+  case CMD_GET_RELAY_CONFIG: {
+    const uint8_t* frame = resp_cache_relay_config(req->relay_id, &resp_len);
+    if (frame == NULL) {
+      resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
+      break;
+    }
+
+    ESP_LOGI(TAG, "GET_RELAY_CONFIG: relay %d", req->relay_id);
+    memcpy(send_buf, frame, resp_len);
+    break;
+  }
+
+  case CMD_SET_RELAY_NAME:
+  case CMD_SET_RELAY_NAME_V3: {
+    if (req->relay_id >= NUM_RELAYS) {
+      resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
+      break;
+    }
+
+    // Name follows the 4-byte header; proto_frame_length has already cut it to its length
+    if (payload_len > 0) {
+      if (payload_len >= RELAY_NAME_MAX_LEN) {
+        resp_len = proto_error_response(send_buf, ERR_NAME_TOO_LONG);
+        break;
+      }
+
+      char name[RELAY_NAME_MAX_LEN] = {0};
+      memcpy(name, payload, payload_len);
+      name[payload_len] = '\0';
+
+      ESP_LOGI(TAG, "SET_RELAY_NAME: relay %d -> '%s'", req->relay_id, name);
+      relay_config_set_name(req->relay_id, name);
+      resp_len = proto_ok_response(send_buf);
+    } else {
+      resp_len = proto_error_response(send_buf, ERR_INVALID_VALUE);
+    }
+    break;
+  }
+
+  case CMD_SET_RELAY_ROOM:
+  case CMD_SET_RELAY_ROOM_V3: {
+    if (req->relay_id >= NUM_RELAYS) {
+      resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
+      break;
+    }
+
+    if (payload_len > 0) {
+      if (payload_len >= RELAY_ROOM_MAX_LEN) {
+        resp_len = proto_error_response(send_buf, ERR_NAME_TOO_LONG);
+        break;
+      }
+
+      char room[RELAY_ROOM_MAX_LEN] = {0};
+      memcpy(room, payload, payload_len);
+      room[payload_len] = '\0';
+
+      ESP_LOGI(TAG, "SET_RELAY_ROOM: relay %d -> '%s'", req->relay_id, room);
+      relay_config_set_room(req->relay_id, room);
+      resp_len = proto_ok_response(send_buf);
+    } else {
+      resp_len = proto_error_response(send_buf, ERR_INVALID_VALUE);
+    }
+    break;
+  }
+
+  case CMD_SET_RELAY_ICON: {
+    if (req->relay_id >= NUM_RELAYS) {
+      resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
+      break;
+    }
+
+    ESP_LOGI(TAG, "SET_RELAY_ICON: relay %d -> %d", req->relay_id, req->value);
+    relay_config_set_icon(req->relay_id, req->value);
+    resp_len = proto_ok_response(send_buf);
+    break;
+  }
+
+  case CMD_SET_RELAY_ALEXA: {
+    if (req->relay_id >= NUM_RELAYS) {
+      resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
+      break;
+    }
+
+    ESP_LOGI(TAG, "SET_RELAY_ALEXA: relay %d -> %d", req->relay_id, req->value);
+    relay_config_set_alexa(req->relay_id, req->value != 0);
+    resp_len = proto_ok_response(send_buf);
+    break;
+  }
+
+  case CMD_GET_ALL_CONFIG: {
+    ESP_LOGI(TAG, "GET_ALL_CONFIG");
+    const uint8_t* frame = resp_cache_all_config(&resp_len);
+    memcpy(send_buf, frame, resp_len);
+    break;
+  }
+
+  case CMD_GET_ALL_CONFIG_V3: {
+    if (conn == NULL) {
+      resp_len = proto_error_response(send_buf, ERR_NEEDS_STREAM); // Won't fit a datagram reply
+      break;
+    }
+
+    ESP_LOGI(TAG, "GET_ALL_CONFIG_V3");
+    conn->direct_frame = resp_cache_all_config_v3(&conn->direct_len);
+    break;
+  }
+
+  case CMD_SET_GROUPS: {
+    uint16_t mask = req->relay_id | (req->value << 8);
+    ESP_LOGI(TAG, "SET_GROUPS: 0x%04X", mask);
+    groups_set_membership(mask);
+    resp_len = proto_ok_response(send_buf);
+    break;
+  }
+
+  case CMD_GET_GROUPS: {
+    uint16_t mask = groups_get_membership();
+    uint8_t data[2] = {mask & 0xFF, mask >> 8};
+    resp_len = proto_build_response(send_buf, RESP_CONFIG, data, sizeof(data));
+    break;
+  }
+
+  default:
+    ESP_LOGW(TAG, "Unknown command: 0x%02X", req->cmd);
+    resp_len = proto_error_response(send_buf, ERR_UNKNOWN_CMD); // Unknown command
+  }
+
+  return resp_len;
+}
+
+/**
+ * Send a complete buffer on a non-blocking socket.
+ * A client that stops reading is not worth blocking everyone else for: fail instead.
+ */
+static bool relay_conn_send(relay_conn_t* conn, const uint8_t* buf, size_t len) {
+  while (len > 0) {
+    int sent = send(conn->sock, buf, len, 0);
+    if (sent <= 0) {
+      ESP_LOGW(TAG, "Send failed (errno %d), dropping client", errno);
+      return false;
+    }
+    buf += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+/**
+ * Parse and answer every complete frame buffered for a connection, in order.
+ * A partial trailing frame is kept for the next recv.
+ * Returns false if the connection should be closed.
+ */
+static bool relay_session_process(relay_conn_t* conn) {
+  uint8_t send_buf[RELAY_SESSION_SEND_BUF];
+  const uint8_t* buf = conn->recv_buf;
+  size_t len = conn->have;
+  size_t send_len = 0;
+  size_t pos = 0;
+  bool ok = true;
+
+  while (ok && pos < len) {
+    if (buf[pos] != PROTO_MAGIC) {
+      // Lost framing: report once, then resynchronise on the next magic byte
+      ESP_LOGW(TAG, "Invalid magic byte");
+      send_len += proto_error_response(send_buf + send_len, ERR_INVALID_MAGIC);
+      while (pos < len && buf[pos] != PROTO_MAGIC) {
+        pos++;
+      }
+    } else {
+      size_t frame_len = proto_frame_length(buf + pos, len - pos);
+      if (frame_len == 0) {
+        break; // Wait for the rest of the frame
+      }
+
+      relay_request_t req;
+      proto_parse_request(buf + pos, frame_len, &req);
+      send_len += relay_handle_request(conn, &req, buf + pos + sizeof(relay_request_t), frame_len - sizeof(relay_request_t),
+                                       send_buf + send_len);
+      pos += frame_len;
+
+      // Long responses bypass the batch buffer; keep replies in request order
+      if (conn->direct_frame != NULL) {
+        ok = relay_conn_send(conn, send_buf, send_len) && relay_conn_send(conn, conn->direct_frame, conn->direct_len);
+        conn->direct_frame = NULL;
+        send_len = 0;
+      }
+    }
+
+    // Flush early if the next response might not fit
+    if (send_len + MAX_RESP_FRAME > sizeof(send_buf)) {
+      ok = relay_conn_send(conn, send_buf, send_len);
+      send_len = 0;
+    }
+  }
+
+  if (ok && send_len > 0) {
+    ok = relay_conn_send(conn, send_buf, send_len);
+  }
+
+  if (pos > 0 && pos < len) {
+    memmove(conn->recv_buf, conn->recv_buf + pos, len - pos);
+  }
+  conn->have = len - pos;
+
+  return ok;
+}
+
+static void relay_conn_close(relay_conn_t* conn) {
+  close(conn->sock);
+  conn->sock = -1;
+  conn->have = 0;
+  conn->subscribed = false;
+  conn->subscribed_wide = false;
+  conn->direct_frame = NULL;
+}
+
+/**
+ * Accept a pending client into a free slot.
+ * If all slots are busy the longest-idle client is evicted, provided it has been
+ * quiet for RELAY_SESSION_EVICT_MS and is not subscribed; otherwise the new client
+ * is turned away. CMD_SUBSCRIBE leaves at least one slot unsubscribed, so there is
+ * always a connection that can be evicted for a request/response client.
+ */
+static void relay_server_accept(int listen_sock) {
+  struct sockaddr_in client_addr;
   socklen_t client_addr_len = sizeof(client_addr);
-  int listen_sock, client_sock;
-  uint8_t recv_buf[64];
-  uint8_t send_buf[64];
 
-  xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, false, true, portMAX_DELAY);
-  ESP_LOGI(TAG, "Starting relay server on port %d", RELAY_PORT);
+  int sock = accept(listen_sock, (struct sockaddr*)&client_addr, &client_addr_len);
+  if (sock < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ESP_LOGE(TAG, "Accept failed");
+    }
+    return;
+  }
+
+  uint32_t now = esp_timer_get_time() / 1000;
+  relay_conn_t* slot = NULL;
+  relay_conn_t* oldest = NULL;
+
+  for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+    relay_conn_t* conn = &relay_conns[i];
+    if (conn->sock < 0) {
+      slot = conn;
+      break;
+    }
+    // Subscribers are idle by design; evicting one would silently cut off a push listener
+    if (!conn->subscribed && (oldest == NULL || (int32_t)(conn->last_active - oldest->last_active) < 0)) {
+      oldest = conn;
+    }
+  }
+
+  if (slot == NULL) {
+    if (oldest == NULL || now - oldest->last_active < RELAY_SESSION_EVICT_MS) {
+      ESP_LOGW(TAG, "Connection limit (%d) reached, rejecting %s", RELAY_MAX_CLIENTS, inet_ntoa(client_addr.sin_addr));
+      close(sock);
+      return;
+    }
+    ESP_LOGI(TAG, "Evicting idle client to make room");
+    relay_conn_close(oldest);
+    slot = oldest;
+  }
+
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+  // Responses are small; don't let Nagle hold them back
+  int nodelay = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  slot->sock = sock;
+  slot->last_active = now;
+  slot->have = 0;
+  slot->subscribed = false;
+  slot->subscribed_wide = false;
+  slot->direct_frame = NULL;
+
+  ESP_LOGI(TAG, "Client: %s", inet_ntoa(client_addr.sin_addr));
+}
+
+/**
+ * Read whatever is available for a connection and answer complete frames.
+ */
+static void relay_server_read(relay_conn_t* conn) {
+  int len = recv(conn->sock, conn->recv_buf + conn->have, sizeof(conn->recv_buf) - conn->have, 0);
+
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+
+  if (len <= 0) {
+    ESP_LOGI(TAG, "Client disconnected");
+    relay_conn_close(conn);
+    return;
+  }
+
+  int64_t start = esp_timer_get_time();
+  conn->have += len;
+  conn->last_active = start / 1000;
+
+  if (!relay_session_process(conn)) {
+    relay_conn_close(conn);
+  }
+  latency_record(LATENCY_TCP, esp_timer_get_time() - start);
+}
+
+/**
+ * Push the current relay states to every subscriber that hasn't seen them yet.
+ * Changes that happen between two polls are coalesced into one update.
+ * Returns true if any connection is subscribed.
+ */
+static bool relay_server_push(void) {
+  uint32_t version = relay_get_version();
+  bool any = false;
+
+  for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+    relay_conn_t* conn = &relay_conns[i];
+    if (conn->sock < 0 || !conn->subscribed) {
+      continue;
+    }
+    any = true;
+
+    if (conn->pushed_version != version) {
+      uint8_t frame[3 + 1 + MAX_MASK_BYTES + 4];
+      size_t len = relay_status_push_frame(conn, frame);
+      if (!relay_conn_send(conn, frame, len)) {
+        relay_conn_close(conn);
+      }
+    }
+  }
+
+  return any;
+}
+
+/**
+ * Drop connections that have been silent for RELAY_SESSION_IDLE_MS.
+ * Subscribers are expected to be quiet and are left to TCP keepalive.
+ */
+static void relay_server_expire(void) {
+  uint32_t now = esp_timer_get_time() / 1000;
+
+  for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+    relay_conn_t* conn = &relay_conns[i];
+    if (conn->sock >= 0 && !conn->subscribed && now - conn->last_active >= RELAY_SESSION_IDLE_MS) {
+      ESP_LOGI(TAG, "Closing idle client");
+      relay_conn_close(conn);
+    }
+  }
+}
+
+static relay_udp_replay_t* relay_udp_replay_find(const struct sockaddr_in* from, uint16_t req_id) {
+  for (int i = 0; i < RELAY_UDP_REPLAY_SLOTS; i++) {
+    relay_udp_replay_t* r = &relay_udp_replay[i];
+    if (r->resp_len > 0 && r->req_id == req_id && r->addr == from->sin_addr.s_addr && r->port == from->sin_port) {
+      return r;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Handle one request received by datagram and build its response in out.
+ * Retried TOGGLEs (same sender and request ID) get the original reply again.
+ */
+static size_t relay_udp_dispatch(const struct sockaddr_in* from, uint16_t req_id, const uint8_t* frame, size_t frame_len,
+                                 uint8_t* out) {
+  relay_request_t req;
+  if (!proto_parse_request(frame, frame_len, &req)) {
+    ESP_LOGW(TAG, "UDP: invalid magic byte");
+    return proto_error_response(out, ERR_INVALID_MAGIC);
+  }
+
+  if (req.cmd != CMD_TOGGLE_RELAY) {
+    // v2 name/room strings run to the end of the datagram; the _V3 forms give their length in VALUE
+    size_t used = proto_frame_length(frame, frame_len);
+    if (used == 0) {
+      used = frame_len;
+    }
+    return relay_handle_request(NULL, &req, frame + sizeof(relay_request_t), used - sizeof(relay_request_t), out);
+  }
+
+  // Toggling twice is not the same as toggling once: replay the original reply to retries
+  relay_udp_replay_t* r = relay_udp_replay_find(from, req_id);
+  if (r != NULL) {
+    ESP_LOGD(TAG, "UDP: replaying reply to request %u", req_id);
+    memcpy(out, r->resp, r->resp_len);
+    return r->resp_len;
+  }
+
+  size_t resp_len = relay_handle_request(NULL, &req, NULL, 0, out);
+  if (resp_len >= 4 && out[1] == RESP_ERROR && out[3] == ERR_BUSY) {
+    return resp_len; // Nothing was applied, so a retry must be tried again
+  }
+
+  r = &relay_udp_replay[relay_udp_replay_next];
+  relay_udp_replay_next = (relay_udp_replay_next + 1) % RELAY_UDP_REPLAY_SLOTS;
+  r->addr = from->sin_addr.s_addr;
+  r->port = from->sin_port;
+  r->req_id = req_id;
+  r->resp_len = resp_len <= sizeof(r->resp) ? resp_len : 0;
+  memcpy(r->resp, out, r->resp_len);
+
+  return resp_len;
+}
+
+/**
+ * Answer one datagram on the UDP socket.
+ * Each datagram holds a single request; the reply echoes its request ID.
+ */
+static void relay_server_udp(int sock) {
+  uint8_t recv_buf[PROTO_UDP_HEADER + RELAY_SESSION_RECV_BUF];
+  uint8_t send_buf[PROTO_UDP_HEADER + MAX_RESP_FRAME];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+
+  int len = recvfrom(sock, recv_buf, sizeof(recv_buf), 0, (struct sockaddr*)&from, &from_len);
+  if (len > 0 && from.sin_addr.s_addr == relay_wake_addr.sin_addr.s_addr && from.sin_port == relay_wake_addr.sin_port) {
+    // Our own wake datagram. Cleared before the push reads the version, so a later change sends a new wake
+    relay_wake_pending = false;
+    return;
+  }
+  if (len < PROTO_UDP_HEADER + (int)sizeof(relay_request_t)) {
+    return; // Nothing to reply to
+  }
+
+  int64_t start = esp_timer_get_time();
+  uint16_t req_id = recv_buf[0] | (recv_buf[1] << 8);
+  send_buf[0] = recv_buf[0];
+  send_buf[1] = recv_buf[1];
+
+  size_t resp_len = relay_udp_dispatch(&from, req_id, recv_buf + PROTO_UDP_HEADER, len - PROTO_UDP_HEADER,
+                                       send_buf + PROTO_UDP_HEADER);
+  if (resp_len > 0) {
+    sendto(sock, send_buf, PROTO_UDP_HEADER + resp_len, 0, (struct sockaddr*)&from, from_len);
+  }
+  latency_record(LATENCY_UDP, esp_timer_get_time() - start);
+}
+
+/**
+ * Apply one multicast group command if this device is a member of the group.
+ * Only relay control is accepted from the group channel; replies are unicast
+ * back to the sender when GROUP_FLAG_ACK is set.
+ */
+static void relay_server_group(int sock) {
+  uint8_t recv_buf[PROTO_GROUP_HEADER + PROTO_UDP_HEADER + sizeof(relay_request_t) + 2 * MAX_MASK_BYTES];
+  uint8_t send_buf[PROTO_UDP_HEADER + MAX_RESP_FRAME];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+
+  int len = recvfrom(sock, recv_buf, sizeof(recv_buf), 0, (struct sockaddr*)&from, &from_len);
+  if (len < PROTO_GROUP_HEADER + PROTO_UDP_HEADER + (int)sizeof(relay_request_t)) {
+    return;
+  }
+
+  uint8_t group_id = recv_buf[0];
+  uint8_t flags = recv_buf[1];
+  if (!groups_is_member(group_id)) {
+    return;
+  }
+
+  int64_t start = esp_timer_get_time();
+  const uint8_t* udp = recv_buf + PROTO_GROUP_HEADER;
+  const uint8_t* frame = udp + PROTO_UDP_HEADER;
+  uint16_t req_id = udp[0] | (udp[1] << 8);
+  size_t resp_len;
+
+  switch (frame[1]) {
+  case CMD_PING:
+  case CMD_GET_STATUS:
+  case CMD_SET_RELAY:
+  case CMD_TOGGLE_RELAY:
+  case CMD_SET_ALL:
+  case CMD_SET_MASKED:
+  case CMD_GET_STATUS_WIDE:
+  case CMD_SET_ALL_WIDE:
+  case CMD_SET_MASKED_WIDE:
+    ESP_LOGI(TAG, "Group %d command from %s", group_id, inet_ntoa(from.sin_addr));
+    resp_len = relay_udp_dispatch(&from, req_id, frame, len - PROTO_GROUP_HEADER - PROTO_UDP_HEADER,
+                                  send_buf + PROTO_UDP_HEADER);
+    break;
+
+  default:
+    ESP_LOGW(TAG, "Group %d: command 0x%02X not allowed", group_id, frame[1]);
+    resp_len = proto_error_response(send_buf + PROTO_UDP_HEADER, ERR_UNKNOWN_CMD);
+  }
+
+  if ((flags & GROUP_FLAG_ACK) && resp_len > 0) {
+    send_buf[0] = udp[0];
+    send_buf[1] = udp[1];
+    sendto(sock, send_buf, PROTO_UDP_HEADER + resp_len, 0, (struct sockaddr*)&from, from_len);
+  }
+  latency_record(LATENCY_GROUP, esp_timer_get_time() - start);
+}
+
+/**
+ * Open the multicast socket for group commands. Returns -1 on failure, which is
+ * logged unless quiet (retries of an attempt that already failed).
+ */
+static int relay_server_group_open(bool quiet) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    if (!quiet) {
+      ESP_LOGE(TAG, "Failed to create group socket, retrying every %d ms", RELAY_GROUP_RETRY_MS);
+    }
+    return -1;
+  }
+
+  int reuse = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(RELAY_GROUP_PORT);
+
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (!quiet) {
+      ESP_LOGE(TAG, "Failed to bind group port %d, retrying every %d ms", RELAY_GROUP_PORT, RELAY_GROUP_RETRY_MS);
+    }
+    close(sock);
+    return -1;
+  }
+
+  struct ip_mreq mreq;
+  mreq.imr_multiaddr.s_addr = inet_addr(RELAY_GROUP_MULTICAST_ADDR);
+  mreq.imr_interface.s_addr = INADDR_ANY;
+
+  if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+    ESP_LOGW(TAG, "Failed to join group multicast address");
+  }
+
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  ESP_LOGI(TAG, "Group commands on %s:%d (member of 0x%04X)", RELAY_GROUP_MULTICAST_ADDR, RELAY_GROUP_PORT,
+           groups_get_membership());
+  return sock;
+}
+
+/**
+ * Open the UDP socket for the connectionless transport. Returns -1 on failure.
+ */
+static int relay_server_udp_open(void) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Failed to create UDP socket");
+    return -1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(RELAY_UDP_PORT);
+
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    ESP_LOGE(TAG, "Failed to bind UDP port %d", RELAY_UDP_PORT);
+    close(sock);
+    return -1;
+  }
+
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  ESP_LOGI(TAG, "UDP server on port %d", RELAY_UDP_PORT);
+  return sock;
+}
+
+/**
+ * Relay change hook (actor context): wake the server task if a subscriber wants the change.
+ * One datagram is enough however many changes happen before the server reads it.
+ */
+static void relay_server_wake(void) {
+  if (!relay_push_wanted || relay_wake_pending) {
+    return;
+  }
+  relay_wake_pending = true;
+  uint8_t byte = 0;
+  sendto(relay_wake_sock, &byte, 1, 0, (struct sockaddr*)&relay_wake_addr, sizeof(relay_wake_addr));
+}
+
+static int relay_server_ping_open(void) {
+  int sock = socket(AF_INET, SOCK_RAW, IP_PROTO_ICMP);
+  if (sock < 0) {
+    ESP_LOGW(TAG, "No ICMP socket, gateway round trips not measured");
+    return -1;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  return sock;
+}
+
+/**
+ * Send the next gateway ping once the interval is up; an unanswered one is counted
+ * as lost after RELAY_PING_TIMEOUT_MS.
+ */
+static void relay_server_ping(int sock) {
+  int64_t now = esp_timer_get_time();
+  if (relay_ping_waiting && now - relay_ping_sent_us >= RELAY_PING_TIMEOUT_MS * 1000LL) {
+    latency_record_lost(LATENCY_GATEWAY);
+    relay_ping_waiting = false;
+  }
+  if (relay_ping_waiting || (relay_ping_seq != 0 && now - relay_ping_sent_us < RELAY_PING_INTERVAL_MS * 1000LL)) {
+    return;
+  }
+
+  tcpip_adapter_ip_info_t ip_info;
+  if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ip_info) != ESP_OK || ip_info.gw.addr == 0) {
+    return;
+  }
+
+  struct icmp_echo_hdr echo;
+  memset(&echo, 0, sizeof(echo));
+  ICMPH_TYPE_SET(&echo, ICMP_ECHO);
+  ICMPH_CODE_SET(&echo, 0);
+  echo.id = htons(RELAY_PING_ID);
+  echo.seqno = htons(++relay_ping_seq);
+  echo.chksum = inet_chksum(&echo, sizeof(echo));
+
+  struct sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = ip_info.gw.addr;
+
+  relay_ping_sent_us = now;
+  relay_ping_waiting = sendto(sock, &echo, sizeof(echo), 0, (struct sockaddr*)&to, sizeof(to)) == sizeof(echo);
+}
+
+// Raw ICMP sockets see every echo reply (with its IP header); only ours is timed
+static void relay_server_ping_reply(int sock) {
+  uint8_t buf[64];
+  int len;
+  while ((len = recv(sock, buf, sizeof(buf), 0)) > 0) {
+    const struct ip_hdr* ip = (const struct ip_hdr*)buf;
+    int hlen = IPH_HL(ip) * 4;
+    if (len < hlen + (int)sizeof(struct icmp_echo_hdr)) {
+      continue;
+    }
+    const struct icmp_echo_hdr* echo = (const struct icmp_echo_hdr*)(buf + hlen);
+    if (relay_ping_waiting && ICMPH_TYPE(echo) == ICMP_ER && echo->id == htons(RELAY_PING_ID) &&
+        echo->seqno == htons(relay_ping_seq)) {
+      latency_record(LATENCY_GATEWAY, esp_timer_get_time() - relay_ping_sent_us);
+      relay_ping_waiting = false;
+    }
+  }
+}
+
+void relay_server_task(void* pvParameters) {
+  struct sockaddr_in server_addr;
+  int listen_sock;
+
+  for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+    relay_conns[i].sock = -1;
+  }
+
+  // Bound to INADDR_ANY, so there is no need to wait for an IP
+  ESP_LOGI(TAG, "Starting relay server on port %d (max %d clients)", RELAY_PORT, RELAY_MAX_CLIENTS);
 
   listen_sock = socket(AF_INET, SOCK_STREAM, 0);
   if (listen_sock < 0) {
@@ -46,283 +928,113 @@ void relay_server_task(void* pvParameters) {
     return;
   }
 
-  ESP_LOGI(TAG, "Server listening...");
+  fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL, 0) | O_NONBLOCK);
 
-  while (1) {
-    client_sock = accept(listen_sock, (struct sockaddr*)&client_addr, &client_addr_len);
+  ESP_LOGI(TAG, "Server listening...");
 
-    if (client_sock < 0) {
-      ESP_LOGE(TAG, "Accept failed");
-      continue;
-    }
+  // TCP keeps working if the UDP transports can't be opened
+  int udp_sock = relay_server_udp_open();
+  int group_sock = -1; // Joining the multicast group needs an interface with an IP
+  bool group_failed = false;
+  uint32_t group_retry_at = 0;
+  int ping_sock = relay_server_ping_open();
+  if (udp_sock >= 0) {
+    // Changes wake the loop with a datagram to ourselves on the UDP socket, saving a socket of its own
+    relay_wake_addr.sin_family = AF_INET;
+    relay_wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    relay_wake_addr.sin_port = htons(RELAY_UDP_PORT);
+    relay_wake_sock = udp_sock;
+    relays_set_change_hook(relay_server_wake);
+  } else {
+    ESP_LOGW(TAG, "No wake socket, polling for pushes");
+  }
+  boot_mark(BOOT_SERVER_LISTENING);
 
-    ESP_LOGI(TAG, "Client: %s", inet_ntoa(client_addr.sin_addr));
+  bool have_subscribers = false;
 
-    int len = recv(client_sock, recv_buf, sizeof(recv_buf), 0);
-    if (len >= sizeof(relay_request_t)) {
-      relay_request_t req;
+  while (1) {
+    uint32_t now_ms = esp_timer_get_time() / 1000;
+    if (group_sock < 0 && (!group_failed || (int32_t)(now_ms - group_retry_at) >= 0) &&
+        (xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT)) {
+      group_sock = relay_server_group_open(group_failed);
+      group_failed = group_sock < 0;
+      group_retry_at = now_ms + RELAY_GROUP_RETRY_MS;
+    }
 
-      if (proto_parse_request(recv_buf, len, &req)) {
-        size_t resp_len = 0;
-
-        switch (req.cmd) {
-        case CMD_PING:
-          ESP_LOGI(TAG, "PING");
-          resp_len = proto_pong_response(send_buf);
-          break;
-
-        case CMD_GET_STATUS: {
-          uint8_t states = 0;
-          for (int i = 0; i < NUM_RELAYS; i++) {
-            if (relay_get(i)) {
-              states |= (1 << i);
-            }
-          }
-          ESP_LOGI(TAG, "GET_STATUS: 0x%02X", states);
-          resp_len = proto_status_response(send_buf, states);
-          break;
-        }
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(listen_sock, &read_fds);
+    int max_fd = listen_sock;
 
-        case CMD_SET_RELAY:
-          if (req.relay_id < NUM_RELAYS) {
-            ESP_LOGI(TAG, "SET relay %d -> %d", req.relay_id, req.value);
-            relay_set(req.relay_id, req.value != 0);
-            resp_len = proto_ok_response(send_buf);
-          } else {
-            resp_len = proto_error_response(send_buf, 0x01); // Invalid relay
-          }
-          break;
-
-        case CMD_TOGGLE_RELAY:
-          if (req.relay_id < NUM_RELAYS) {
-            bool new_state = !relay_get(req.relay_id);
-            ESP_LOGI(TAG, "TOGGLE relay %d -> %d", req.relay_id, new_state);
-            relay_set(req.relay_id, new_state);
-            resp_len = proto_ok_response(send_buf);
-          } else {
-            resp_len = proto_error_response(send_buf, 0x01);
-          }
-          break;
-
-        case CMD_SET_ALL:
-          ESP_LOGI(TAG, "SET_ALL: 0x%02X", req.relay_id);
-          for (int i = 0; i < NUM_RELAYS; i++) {
-            relay_set(i, (req.relay_id >> i) & 1);
-          }
-          resp_len = proto_ok_response(send_buf);
-          break;
-
-        case CMD_DESCRIBE: {
-          ESP_LOGI(TAG, "DESCRIBE");
-
-          // Build TLV descriptor response
-          uint8_t desc_data[64];
-          uint8_t idx = 0;
-
-          // Device type: "switch"
-          desc_data[idx++] = DESC_DEVICE_TYPE;
-          desc_data[idx++] = 6; // length
-          memcpy(&desc_data[idx], "switch", 6);
-          idx += 6;
-
-          // Model: "SR-4"
-          desc_data[idx++] = DESC_MODEL;
-          desc_data[idx++] = 4;
-          memcpy(&desc_data[idx], "SR-4", 4);
-          idx += 4;
-
-          // Relay count
-          desc_data[idx++] = DESC_RELAY_COUNT;
-          desc_data[idx++] = 1;
-          desc_data[idx++] = (uint8_t)NUM_RELAYS; // Explicit cast
-
-          // Capabilities (bitmask: bit 0 = relay control, bit 1 = alexa)
-          desc_data[idx++] = DESC_CAPABILITIES;
-          desc_data[idx++] = 1;
-          desc_data[idx++] = 0x03;  // relay + alexa
-
-          // Firmware version: "2.0.0"
-          desc_data[idx++] = DESC_FW_VERSION;
-          desc_data[idx++] = 5;
-          memcpy(&desc_data[idx], "2.0.0", 5);
-          idx += 5;
-
-          resp_len = proto_build_response(send_buf, RESP_DESCRIBE, desc_data, idx);
-          break;
-        }
+    if (udp_sock >= 0) {
+      FD_SET(udp_sock, &read_fds);
+      if (udp_sock > max_fd) {
+        max_fd = udp_sock;
+      }
+    }
 
-        case CMD_GET_RELAY_CONFIG: {
-          if (req.relay_id >= NUM_RELAYS) {
-            resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
-            break;
-          }
-
-          ESP_LOGI(TAG, "GET_RELAY_CONFIG: relay %d", req.relay_id);
-
-          const relay_config_entry_t* cfg = relay_config_get(req.relay_id);
-          uint8_t cfg_data[128];
-          uint8_t idx = 0;
-
-          // Relay ID
-          cfg_data[idx++] = CFG_RELAY_ID;
-          cfg_data[idx++] = 1;
-          cfg_data[idx++] = req.relay_id;
-
-          // Name
-          uint8_t name_len = strlen(cfg->name);
-          cfg_data[idx++] = CFG_RELAY_NAME;
-          cfg_data[idx++] = name_len;
-          memcpy(&cfg_data[idx], cfg->name, name_len);
-          idx += name_len;
-
-          // Room
-          uint8_t room_len = strlen(cfg->room);
-          cfg_data[idx++] = CFG_RELAY_ROOM;
-          cfg_data[idx++] = room_len;
-          memcpy(&cfg_data[idx], cfg->room, room_len);
-          idx += room_len;
-
-          // Icon
-          cfg_data[idx++] = CFG_RELAY_ICON;
-          cfg_data[idx++] = 1;
-          cfg_data[idx++] = cfg->icon;
-
-          // Alexa enabled
-          cfg_data[idx++] = CFG_RELAY_ALEXA;
-          cfg_data[idx++] = 1;
-          cfg_data[idx++] = cfg->alexa_enabled;
-
-          // Current state
-          cfg_data[idx++] = CFG_RELAY_STATE;
-          cfg_data[idx++] = 1;
-          cfg_data[idx++] = relay_get(req.relay_id);
-
-          resp_len = proto_build_response(send_buf, RESP_CONFIG, cfg_data, idx);
-          break;
-        }
+    if (group_sock >= 0) {
+      FD_SET(group_sock, &read_fds);
+      if (group_sock > max_fd) {
+        max_fd = group_sock;
+      }
+    }
 
-        case CMD_SET_RELAY_NAME: {
-          if (req.relay_id >= NUM_RELAYS) {
-            resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
-            break;
-          }
-
-          // Name follows the 4-byte header
-          if (len > sizeof(relay_request_t)) {
-            uint8_t name_len = len - sizeof(relay_request_t);
-            if (name_len >= RELAY_NAME_MAX_LEN) {
-              resp_len = proto_error_response(send_buf, ERR_NAME_TOO_LONG);
-              break;
-            }
-
-            char name[RELAY_NAME_MAX_LEN] = {0};
-            memcpy(name, &recv_buf[sizeof(relay_request_t)], name_len);
-            name[name_len] = '\0';
-
-            ESP_LOGI(TAG, "SET_RELAY_NAME: relay %d -> '%s'", req.relay_id, name);
-            relay_config_set_name(req.relay_id, name);
-            resp_len = proto_ok_response(send_buf);
-          } else {
-            resp_len = proto_error_response(send_buf, ERR_INVALID_VALUE);
-          }
-          break;
-        }
+    if (ping_sock >= 0) {
+      relay_server_ping(ping_sock);
+      FD_SET(ping_sock, &read_fds);
+      if (ping_sock > max_fd) {
+        max_fd = ping_sock;
+      }
+    }
 
-        case CMD_SET_RELAY_ROOM: {
-          if (req.relay_id >= NUM_RELAYS) {
-            resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
-            break;
-          }
-
-          if (len > sizeof(relay_request_t)) {
-            uint8_t room_len = len - sizeof(relay_request_t);
-            if (room_len >= RELAY_ROOM_MAX_LEN) {
-              resp_len = proto_error_response(send_buf, ERR_NAME_TOO_LONG);
-              break;
-            }
-
-            char room[RELAY_ROOM_MAX_LEN] = {0};
-            memcpy(room, &recv_buf[sizeof(relay_request_t)], room_len);
-            room[room_len] = '\0';
-
-            ESP_LOGI(TAG, "SET_RELAY_ROOM: relay %d -> '%s'", req.relay_id, room);
-            relay_config_set_room(req.relay_id, room);
-            resp_len = proto_ok_response(send_buf);
-          } else {
-            resp_len = proto_error_response(send_buf, ERR_INVALID_VALUE);
-          }
-          break;
+    for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+      if (relay_conns[i].sock >= 0) {
+        FD_SET(relay_conns[i].sock, &read_fds);
+        if (relay_conns[i].sock > max_fd) {
+          max_fd = relay_conns[i].sock;
         }
+      }
+    }
 
-        case CMD_SET_RELAY_ICON: {
-          if (req.relay_id >= NUM_RELAYS) {
-            resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
-            break;
-          }
-
-          ESP_LOGI(TAG, "SET_RELAY_ICON: relay %d -> %d", req.relay_id, req.value);
-          relay_config_set_icon(req.relay_id, req.value);
-          resp_len = proto_ok_response(send_buf);
-          break;
-        }
+    uint32_t tick_ms = have_subscribers && relay_wake_sock < 0 ? RELAY_PUSH_POLL_MS : RELAY_SERVER_TICK_MS;
+    struct timeval tick = {.tv_sec = tick_ms / 1000, .tv_usec = (tick_ms % 1000) * 1000};
+    int ready = select(max_fd + 1, &read_fds, NULL, NULL, &tick);
 
-        case CMD_SET_RELAY_ALEXA: {
-          if (req.relay_id >= NUM_RELAYS) {
-            resp_len = proto_error_response(send_buf, ERR_INVALID_RELAY);
-            break;
-          }
+    if (ready < 0) {
+      ESP_LOGE(TAG, "select failed (errno %d)", errno);
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
 
-          ESP_LOGI(TAG, "SET_RELAY_ALEXA: relay %d -> %d", req.relay_id, req.value);
-          relay_config_set_alexa(req.relay_id, req.value != 0);
-          resp_len = proto_ok_response(send_buf);
-          break;
+    if (ready > 0) {
+      for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+        if (relay_conns[i].sock >= 0 && FD_ISSET(relay_conns[i].sock, &read_fds)) {
+          relay_server_read(&relay_conns[i]);
         }
+      }
 
-        case CMD_GET_ALL_CONFIG: {
-          ESP_LOGI(TAG, "GET_ALL_CONFIG");
-
-          // Build response with all relay configs
-          // Format: [count:1] then for each: [id:1][name_len:1][name:N][state:1]
-          uint8_t cfg_data[200];
-          uint8_t idx = 0;
-
-          cfg_data[idx++] = NUM_RELAYS;
-
-          for (int i = 0; i < NUM_RELAYS; i++) {
-            const relay_config_entry_t* cfg = relay_config_get(i);
-
-            cfg_data[idx++] = i;  // relay id
-
-            uint8_t name_len = strlen(cfg->name);
-            cfg_data[idx++] = name_len;
-            memcpy(&cfg_data[idx], cfg->name, name_len);
-            idx += name_len;
-
-            cfg_data[idx++] = relay_get(i);  // state
-            cfg_data[idx++] = cfg->alexa_enabled;
-          }
+      if (udp_sock >= 0 && FD_ISSET(udp_sock, &read_fds)) {
+        relay_server_udp(udp_sock);
+      }
 
-          resp_len = proto_build_response(send_buf, RESP_CONFIG, cfg_data, idx);
-          break;
-        }
+      if (group_sock >= 0 && FD_ISSET(group_sock, &read_fds)) {
+        relay_server_group(group_sock);
+      }
 
-        default:
-          ESP_LOGW(TAG, "Unknown command: 0x%02X", req.cmd);
-          resp_len = proto_error_response(send_buf, ERR_UNKNOWN_CMD); // Unknown command
-        }
+      if (ping_sock >= 0 && FD_ISSET(ping_sock, &read_fds)) {
+        relay_server_ping_reply(ping_sock);
+      }
 
-        if (resp_len > 0) {
-          send(client_sock, send_buf, resp_len, 0);
-        }
-      } else {
-        ESP_LOGW(TAG, "Invalid magic byte");
-        size_t resp_len = proto_error_response(send_buf, 0xFF);
-        send(client_sock, send_buf, resp_len, 0);
+      if (FD_ISSET(listen_sock, &read_fds)) {
+        relay_server_accept(listen_sock);
       }
     }
 
-    close(client_sock);
+    have_subscribers = relay_server_push();
+    relay_push_wanted = have_subscribers;
+    relay_server_expire();
   }
 }
 
-#endif // SERVER_H
\ No newline at end of file
+#endif // SERVER_H
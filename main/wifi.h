@@ -1,32 +1,280 @@
 #ifndef WIFI_H
 #define WIFI_H
 
+#include <string.h>
 #include "config.h"
 #include "esp_log.h"
 #include "esp_wifi.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "freertos/event_groups.h"
+#include "persist.h"
+#include "boot_profile.h"
 
 #define WIFI_CONNECTED_BIT BIT0
 static EventGroupHandle_t s_wifi_event_group;
 
+#define NVS_KEY_WIFI_CACHE "wifi_cache"
+#define NVS_KEY_WIFI_POWER "wifi_power"
+#define WIFI_CACHE_VERSION 1
+
+typedef enum {
+  WIFI_PROFILE_PERFORMANCE = 0,
+  WIFI_PROFILE_BALANCED = 1,
+  WIFI_PROFILE_LOW_POWER = 2,
+  WIFI_PROFILE_COUNT
+} wifi_power_profile_t;
+
+static const char* const wifi_profile_names[WIFI_PROFILE_COUNT] = {"performance", "balanced", "low_power"};
+
+// Last good association, reused for a directed connect on the next boot or reconnect
+typedef struct {
+  uint8_t version;
+  uint8_t channel;
+  uint8_t bssid[6];
+  uint32_t ssid_hash;  // cache is ignored if WIFI_SSID changes
+  uint32_t ip;         // DHCP lease, network byte order
+  uint32_t netmask;
+  uint32_t gw;
+} wifi_cache_t;
+
+typedef struct {
+  uint32_t connects;         // IPs obtained
+  uint32_t fast_connects;    // ... of which via a directed connect
+  uint32_t fallbacks;        // directed connects given up for a full scan
+  uint32_t disconnects;
+  uint32_t connect_ms_last;  // connect start to IP
+  uint32_t connect_ms_max;
+  bool last_fast;
+} wifi_stats_t;
+
+static wifi_cache_t wifi_cache;
+static int wifi_cache_persist_id = -1;
+static wifi_stats_t wifi_stats;
+static bool wifi_fast = false;          // current attempt is a directed connect
+static bool wifi_static_ip = false;     // DHCP stopped, cached lease applied
+static int wifi_fast_failures = 0;
+static uint32_t wifi_connect_start_ms = 0;
+static uint8_t wifi_power_profile = WIFI_POWER_PROFILE_DEFAULT;
+static int wifi_power_persist_id = -1;
+
+static uint16_t wifi_profile_listen_interval(void) {
+  // Only used by WIFI_PS_MAX_MODEM; 0 = wake for every DTIM beacon
+  return wifi_power_profile == WIFI_PROFILE_LOW_POWER ? WIFI_LOW_POWER_LISTEN_INTERVAL : 0;
+}
+
+static wifi_ps_type_t wifi_profile_ps_type(void) {
+  switch (wifi_power_profile) {
+  case WIFI_PROFILE_PERFORMANCE:
+    return WIFI_PS_NONE;
+  case WIFI_PROFILE_LOW_POWER:
+    return WIFI_PS_MAX_MODEM;
+  default:
+    return WIFI_PS_MIN_MODEM;
+  }
+}
+
+static uint32_t wifi_ssid_hash(void) {
+  uint32_t h = 2166136261u;  // FNV-1a
+  for (const char* p = WIFI_SSID; *p; p++) {
+    h = (h ^ (uint8_t)*p) * 16777619u;
+  }
+  return h;
+}
+
+static bool wifi_cache_valid(void) {
+  return wifi_cache.version == WIFI_CACHE_VERSION && wifi_cache.ssid_hash == wifi_ssid_hash() &&
+         wifi_cache.channel != 0;
+}
+
+static void wifi_cache_load(void) {
+  wifi_cache_persist_id =
+      persist_register(NVS_KEY_WIFI_CACHE, &wifi_cache, sizeof(wifi_cache), PERSIST_BLOB, 0, 0);
+
+  wifi_power_persist_id =
+      persist_register(NVS_KEY_WIFI_POWER, &wifi_power_profile, sizeof(wifi_power_profile), PERSIST_BLOB, 0, 0);
+
+  nvs_handle_t nvs_handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+    return;
+  }
+  size_t size = sizeof(wifi_cache);
+  if (nvs_get_blob(nvs_handle, NVS_KEY_WIFI_CACHE, &wifi_cache, &size) != ESP_OK || size != sizeof(wifi_cache)) {
+    memset(&wifi_cache, 0, sizeof(wifi_cache));
+  }
+  size = sizeof(wifi_power_profile);
+  if (nvs_get_blob(nvs_handle, NVS_KEY_WIFI_POWER, &wifi_power_profile, &size) != ESP_OK ||
+      wifi_power_profile >= WIFI_PROFILE_COUNT) {
+    wifi_power_profile = WIFI_POWER_PROFILE_DEFAULT;
+  }
+  nvs_close(nvs_handle);
+}
+
+// Record the AP and lease we ended up with; only touches flash when they changed
+static void wifi_cache_update(const tcpip_adapter_ip_info_t* ip_info) {
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+    return;
+  }
+
+  wifi_cache_t next = wifi_cache;
+  next.version = WIFI_CACHE_VERSION;
+  next.ssid_hash = wifi_ssid_hash();
+  next.channel = ap.primary;
+  memcpy(next.bssid, ap.bssid, sizeof(next.bssid));
+  if (!wifi_static_ip) {
+    next.ip = ip_info->ip.addr;
+    next.netmask = ip_info->netmask.addr;
+    next.gw = ip_info->gw.addr;
+  }
+
+  if (memcmp(&next, &wifi_cache, sizeof(next)) != 0) {
+    wifi_cache = next;
+    persist_mark_dirty(wifi_cache_persist_id);
+    ESP_LOGI(TAG, "Cached AP on channel %d", wifi_cache.channel);
+  }
+}
+
+// Point the station at the cached AP (fast) or at any AP with our SSID (full scan + DHCP)
+static void wifi_configure(bool fast) {
+  wifi_config_t wifi_config = {
+      .sta =
+          {
+              .ssid = WIFI_SSID,
+              .password = WIFI_PASS,
+          },
+  };
+  wifi_config.sta.listen_interval = wifi_profile_listen_interval();
+
+  if (fast) {
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    wifi_config.sta.channel = wifi_cache.channel;
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, wifi_cache.bssid, sizeof(wifi_cache.bssid));
+  } else {
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  }
+  esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+
+  bool use_static = fast && WIFI_STATIC_IP_FROM_CACHE && wifi_cache.ip != 0;
+  if (use_static && !wifi_static_ip) {
+    tcpip_adapter_ip_info_t ip_info = {0};
+    ip_info.ip.addr = wifi_cache.ip;
+    ip_info.netmask.addr = wifi_cache.netmask;
+    ip_info.gw.addr = wifi_cache.gw;
+    tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
+    tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, &ip_info);
+  } else if (!use_static && wifi_static_ip) {
+    tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+  }
+
+  wifi_static_ip = use_static;
+  wifi_fast = fast;
+  wifi_fast_failures = 0;
+}
+
+static void wifi_connect(void) {
+  if (wifi_connect_start_ms == 0) {
+    wifi_connect_start_ms = esp_timer_get_time() / 1000;
+  }
+  esp_wifi_connect();
+}
+
 // WiFi event handler
 static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-    esp_wifi_connect();
+    wifi_connect();
   } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    ESP_LOGI(TAG, "Disconnected, retrying...");
-    esp_wifi_connect();
+    bool was_connected = xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT;
     xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+
+    if (was_connected) {
+      // Lost a working link (e.g. router reboot): go straight back to the same AP
+      wifi_stats.disconnects++;
+      wifi_configure(WIFI_FAST_CONNECT && wifi_cache_valid());
+    } else if (wifi_fast && ++wifi_fast_failures >= WIFI_FAST_CONNECT_ATTEMPTS) {
+      ESP_LOGW(TAG, "Cached AP not reachable, falling back to a full scan");
+      wifi_stats.fallbacks++;
+      wifi_configure(false);
+    }
+
+    ESP_LOGI(TAG, "Disconnected, retrying%s...", wifi_fast ? " cached AP" : "");
+    wifi_connect();
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
-    ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+    uint32_t elapsed = (uint32_t)(esp_timer_get_time() / 1000) - wifi_connect_start_ms;
+    wifi_connect_start_ms = 0;
+
+    wifi_stats.connects++;
+    wifi_stats.fast_connects += wifi_fast;
+    wifi_stats.last_fast = wifi_fast;
+    wifi_stats.connect_ms_last = elapsed;
+    if (elapsed > wifi_stats.connect_ms_max) {
+      wifi_stats.connect_ms_max = elapsed;
+    }
+
+    ESP_LOGI(TAG, "Got IP: " IPSTR " in %u ms (%s)", IP2STR(&event->ip_info.ip), elapsed,
+             wifi_fast ? (wifi_static_ip ? "cached AP, static IP" : "cached AP") : "full scan");
+    boot_mark(BOOT_GOT_IP);
+    wifi_cache_update(&event->ip_info);
     xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
   }
 }
 
+/**
+ * @brief Copy of the connection counters
+ */
+void wifi_get_stats(wifi_stats_t* out) {
+  *out = wifi_stats;
+}
+
+/**
+ * @brief Current power-save profile
+ */
+wifi_power_profile_t wifi_get_power_profile(void) {
+  return (wifi_power_profile_t)wifi_power_profile;
+}
+
+/**
+ * @brief Profile by name ("performance", "balanced", "low_power"), -1 if unknown
+ */
+int wifi_power_profile_from_name(const char* name) {
+  for (int i = 0; i < WIFI_PROFILE_COUNT; i++) {
+    if (strcmp(name, wifi_profile_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Switch power-save profile and remember it
+ *
+ * Modem sleep changes at once; a new listen interval is only negotiated with
+ * the AP on the next association, so it applies after a reconnect.
+ */
+void wifi_set_power_profile(wifi_power_profile_t profile) {
+  if (profile >= WIFI_PROFILE_COUNT || profile == wifi_power_profile) {
+    return;
+  }
+
+  wifi_power_profile = profile;
+  persist_mark_dirty(wifi_power_persist_id);
+  esp_wifi_set_ps(wifi_profile_ps_type());
+
+  wifi_config_t wifi_config;
+  if (esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config) == ESP_OK) {
+    wifi_config.sta.listen_interval = wifi_profile_listen_interval();
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+  }
+
+  ESP_LOGI(TAG, "WiFi power profile: %s", wifi_profile_names[profile]);
+}
+
 // Initialize WiFi
 void wifi_init_sta(void) {
   s_wifi_event_group = xEventGroupCreate();
+  wifi_cache_load();
 
   tcpip_adapter_init();
   ESP_ERROR_CHECK(esp_event_loop_create_default());
@@ -37,19 +285,17 @@ void wifi_init_sta(void) {
   ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL));
 
-  wifi_config_t wifi_config = {
-      .sta =
-          {
-              .ssid = WIFI_SSID,
-              .password = WIFI_PASS,
-          },
-  };
-
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-  ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+  wifi_configure(WIFI_FAST_CONNECT && wifi_cache_valid());
   ESP_ERROR_CHECK(esp_wifi_start());
+  esp_wifi_set_ps(wifi_profile_ps_type());
 
-  ESP_LOGI(TAG, "WiFi init finished, connecting to %s", WIFI_SSID);
+  if (wifi_fast) {
+    ESP_LOGI(TAG, "WiFi init finished, connecting to %s (cached channel %d)", WIFI_SSID, wifi_cache.channel);
+  } else {
+    ESP_LOGI(TAG, "WiFi init finished, connecting to %s", WIFI_SSID);
+  }
+  ESP_LOGI(TAG, "WiFi power profile: %s", wifi_profile_names[wifi_power_profile]);
 }
 
-#endif // WIFI_H
\ No newline at end of file
+#endif // WIFI_H
@@ -0,0 +1,124 @@
+/**
+ * @file cachetest.c
+ * @brief Host test of the cached binary protocol config responses
+ *
+ * Builds main/response_cache.h against a stand-in relay configuration (ten
+ * relays, so long names overflow the v2 GET_ALL_CONFIG frame) and checks that
+ * rebuilding after a rename gives well-formed frames with the current states.
+ *
+ * Usage: make test
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Stand-ins for config.h, relays.h and relay_config.h, which need the SDK
+#define CONFIG_H
+#define RELAYS_H
+#define RELAY_CONFIG_H
+
+#define NUM_RELAYS 10
+#define RELAY_NAME_MAX_LEN 32
+#define RELAY_ROOM_MAX_LEN 24
+
+typedef struct {
+  char name[RELAY_NAME_MAX_LEN];
+  char room[RELAY_ROOM_MAX_LEN];
+  uint8_t icon;
+  uint8_t alexa_enabled;
+} relay_config_entry_t;
+
+static relay_config_entry_t config[NUM_RELAYS];
+static uint32_t config_generation = 1;
+static uint8_t states[NUM_RELAYS];
+
+static const relay_config_entry_t* relay_config_get(uint8_t relay_id) {
+  return &config[relay_id];
+}
+
+static uint32_t relay_config_get_generation(void) {
+  return config_generation;
+}
+
+static uint8_t relay_get(uint8_t relay_num) {
+  return states[relay_num];
+}
+
+#include "response_cache.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                                                               \
+  do {                                                                                                                 \
+    if (!(cond)) {                                                                                                     \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__);                                                                      \
+      printf(__VA_ARGS__);                                                                                             \
+      printf("\n");                                                                                                    \
+      failures++;                                                                                                      \
+    }                                                                                                                  \
+  } while (0)
+
+static void set_names(int len) {
+  for (int i = 0; i < NUM_RELAYS; i++) {
+    memset(config[i].name, 0, sizeof(config[i].name));
+    memset(config[i].name, 'a' + i, len);
+    config[i].alexa_enabled = i & 1;
+  }
+  config_generation++;
+}
+
+/** Walk a v2 GET_ALL_CONFIG frame and compare every entry with the configuration and states */
+static void check_all_config(const char* label) {
+  size_t len;
+  const uint8_t* frame = resp_cache_all_config(&len);
+
+  CHECK(frame[0] == PROTO_MAGIC && frame[1] == RESP_CONFIG, "%s: bad header", label);
+  CHECK(len == 3u + frame[2], "%s: length %u, header says %u", label, (unsigned)len, 3u + frame[2]);
+
+  const uint8_t* data = frame + 3;
+  size_t idx = 1;
+  int count = data[0];
+  CHECK(count > 0 && count <= NUM_RELAYS, "%s: count %d", label, count);
+
+  int entries = 0;
+  for (int i = 0; i < count && idx < frame[2]; i++, entries++) {
+    size_t name_len = strlen(config[i].name);
+    CHECK(data[idx] == i, "%s: entry %d has id %d", label, i, data[idx]);
+    CHECK(data[idx + 1] == name_len, "%s: relay %d name length %d", label, i, data[idx + 1]);
+    CHECK(memcmp(&data[idx + 2], config[i].name, name_len) == 0, "%s: relay %d name corrupted", label, i);
+    idx += 2 + name_len;
+    CHECK(data[idx] == states[i], "%s: relay %d state %d, expected %d", label, i, data[idx], states[i]);
+    CHECK(data[idx + 1] == config[i].alexa_enabled, "%s: relay %d alexa flag", label, i);
+    idx += 2;
+  }
+  CHECK(entries == count, "%s: count %d, %d entries", label, count, entries);
+  CHECK(idx == frame[2], "%s: entries end at %u of %u", label, (unsigned)idx, frame[2]);
+}
+
+int main(void) {
+  for (int i = 0; i < NUM_RELAYS; i++) {
+    states[i] = i % 3 == 0;
+  }
+
+  set_names(4);
+  check_all_config("short names");
+
+  // Longer names push later relays out of the v2 frame; their old state offsets must not be patched
+  set_names(RELAY_NAME_MAX_LEN - 1);
+  for (int i = 0; i < NUM_RELAYS; i++) {
+    states[i] = !states[i];
+  }
+  check_all_config("long names");
+
+  set_names(8);
+  check_all_config("shorter again");
+
+  if (failures) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
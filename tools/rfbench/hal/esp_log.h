@@ -0,0 +1,24 @@
+/**
+ * @file esp_log.h
+ * @brief Host stand-in for the ESP-IDF logger (rfbench)
+ */
+
+#ifndef RFBENCH_ESP_LOG_H
+#define RFBENCH_ESP_LOG_H
+
+#include <stdio.h>
+
+extern int hal_verbose;
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...)                                                                                        \
+  do {                                                                                                                 \
+    if (hal_verbose) fprintf(stderr, "I %s: " fmt "\n", tag, ##__VA_ARGS__);                                           \
+  } while (0)
+#define ESP_LOGD(tag, fmt, ...)                                                                                        \
+  do {                                                                                                                 \
+    if (hal_verbose > 1) fprintf(stderr, "D %s: " fmt "\n", tag, ##__VA_ARGS__);                                       \
+  } while (0)
+
+#endif // RFBENCH_ESP_LOG_H
@@ -0,0 +1,13 @@
+/**
+ * @file esp_timer.h
+ * @brief Host stand-in for esp_timer (rfbench): returns the simulated edge clock
+ */
+
+#ifndef RFBENCH_ESP_TIMER_H
+#define RFBENCH_ESP_TIMER_H
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
+
+#endif // RFBENCH_ESP_TIMER_H
@@ -0,0 +1,26 @@
+/**
+ * @file FreeRTOS.h
+ * @brief Host stand-in for FreeRTOS (rfbench): single thread, so critical sections are empty
+ */
+
+#ifndef RFBENCH_FREERTOS_H
+#define RFBENCH_FREERTOS_H
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+
+#define IRAM_ATTR
+
+#define portENTER_CRITICAL()
+#define portEXIT_CRITICAL()
+#define portDISABLE_INTERRUPTS()
+#define portENABLE_INTERRUPTS()
+#define portYIELD_FROM_ISR()
+
+#endif // RFBENCH_FREERTOS_H
@@ -0,0 +1,17 @@
+/**
+ * @file task.h
+ * @brief Host stand-in for FreeRTOS task notifications (rfbench): notifications are only counted
+ */
+
+#ifndef RFBENCH_TASK_H
+#define RFBENCH_TASK_H
+
+#include "FreeRTOS.h"
+
+typedef void* TaskHandle_t;
+typedef enum { eNoAction, eSetBits, eIncrement, eSetValueWithOverwrite, eSetValueWithoutOverwrite } eNotifyAction;
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action, BaseType_t* woken);
+
+#endif // RFBENCH_TASK_H
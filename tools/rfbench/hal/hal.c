@@ -0,0 +1,73 @@
+/**
+ * @file hal.c
+ * @brief Host implementation of the ESP-IDF calls used by rfcodes (rfbench)
+ */
+
+#include "hal.h"
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "rom/ets_sys.h"
+#include <stddef.h>
+
+int hal_verbose = 0;
+uint32_t hal_notifications = 0;
+
+static int64_t hal_time_us = 0;
+static gpio_isr_t hal_isr = NULL;
+static void* hal_isr_arg = NULL;
+
+void hal_edge(uint32_t duration_us) {
+  hal_time_us += duration_us;
+  if (hal_isr) {
+    hal_isr(hal_isr_arg);
+  }
+}
+
+int64_t esp_timer_get_time(void) {
+  return hal_time_us;
+}
+
+esp_err_t gpio_config(const gpio_config_t* config) {
+  (void)config;
+  return 0;
+}
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level) {
+  (void)pin;
+  (void)level;
+  return 0;
+}
+
+esp_err_t gpio_install_isr_service(int flags) {
+  (void)flags;
+  return 0;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void* arg) {
+  (void)pin;
+  hal_isr = handler;
+  hal_isr_arg = arg;
+  return 0;
+}
+
+void ets_delay_us(uint32_t us) {
+  hal_time_us += us;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+  (void)task;
+  (void)value;
+  (void)action;
+  hal_notifications++;
+  return pdPASS;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action, BaseType_t* woken) {
+  (void)task;
+  (void)value;
+  (void)action;
+  (void)woken;
+  hal_notifications++;
+  return pdPASS;
+}
@@ -0,0 +1,24 @@
+/**
+ * @file hal.h
+ * @brief Simulated receiver pin for rfbench
+ *
+ * The collector registers its receive ISR through gpio_isr_handler_add() as on
+ * the device. hal_edge() advances the simulated clock by one pulse and calls
+ * that ISR, so timings take the same path (glitch filter, ring buffer, decoder
+ * wake-ups) as they do on the ESP8266.
+ */
+
+#ifndef RFBENCH_HAL_H
+#define RFBENCH_HAL_H
+
+#include <stdint.h>
+
+extern int hal_verbose;          // 1 = info logs, 2 = debug logs
+extern uint32_t hal_notifications; // decoder wake-ups requested by the collector
+
+/**
+ * @brief Let a pulse of the given length pass, then raise the next edge
+ */
+void hal_edge(uint32_t duration_us);
+
+#endif // RFBENCH_HAL_H
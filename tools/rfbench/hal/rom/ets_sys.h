@@ -0,0 +1,13 @@
+/**
+ * @file ets_sys.h
+ * @brief Host stand-in for the ROM delay (rfbench)
+ */
+
+#ifndef RFBENCH_ETS_SYS_H
+#define RFBENCH_ETS_SYS_H
+
+#include <stdint.h>
+
+void ets_delay_us(uint32_t us);
+
+#endif // RFBENCH_ETS_SYS_H
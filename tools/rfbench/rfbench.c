@@ -0,0 +1,559 @@
+/**
+ * @file rfbench.c
+ * @brief Host replay and benchmark of the rfcodes decoder
+ *
+ * Replays a corpus of timing captures through signal_collector (simulated
+ * receive ISR, glitch filter, ring buffer) into signal_parser, and reports
+ * per-protocol detection and false-positive counts for one or more timing
+ * tolerances, plus decoder throughput. See README.md for the corpus format.
+ *
+ * Usage:
+ *   rfbench [-t tol[,tol...]] [-m min_pulse_us] [-r runs] [-F max_false] [-v] corpus...
+ *   rfbench -g proto[,proto...] [-n count] [-R repeats] [-j jitter_pct] [-N noise] [-s seed]
+ */
+
+#include "hal.h"
+#include "rfcodes.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_GAP_US 50000     // silence between captures; longer than any code timing, so every decoder resets
+#define BENCH_MAX_DECODES 64   // decodes kept per capture
+#define BENCH_LINE_TIMINGS 16  // timings per line in generated corpora
+
+static const signal_protocol_t* const bench_protocols[] = {
+    &protocol_it1, &protocol_it2, &protocol_sc5, &protocol_ev1527, &protocol_cw,
+};
+#define BENCH_PROTOCOLS (sizeof(bench_protocols) / sizeof(bench_protocols[0]))
+
+typedef struct {
+  uint8_t protocol_id; // PROTOCOL_ID_NONE for noise
+  uint8_t bits;
+  uint64_t payload;
+  code_time_t* timings;
+  int count;
+  int alloc;
+} capture_t;
+
+typedef struct {
+  uint32_t captures;   // captures expecting this protocol
+  uint32_t detected;   // ... in which the expected frame was decoded
+  uint32_t frames;     // correct frames decoded (repeats count)
+  uint32_t false_hits; // frames of this protocol decoded where they were not sent
+} protocol_score_t;
+
+static capture_t* captures = NULL;
+static int capture_count = 0;
+static uint64_t timing_count = 0;
+
+// Decodes of the capture being replayed
+static signal_frame_t decodes[BENCH_MAX_DECODES];
+static int decode_count = 0;
+static uint64_t total_decodes = 0;
+
+// ===== Helpers =====
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng_next(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/** Uniform in [0, 1) */
+static double rng_unit(void) {
+  return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static const signal_protocol_t* protocol_by_name(const char* name) {
+  for (size_t n = 0; n < BENCH_PROTOCOLS; n++) {
+    if (strcmp(bench_protocols[n]->name, name) == 0) {
+      return bench_protocols[n];
+    }
+  }
+  return NULL;
+}
+
+static void on_frame(const signal_frame_t* frame) {
+  if (decode_count < BENCH_MAX_DECODES) {
+    decodes[decode_count++] = *frame;
+  }
+  total_decodes++;
+}
+
+// ===== Corpus =====
+
+static capture_t* add_capture(uint8_t protocol_id, uint8_t bits, uint64_t payload) {
+  captures = (capture_t*)realloc(captures, (capture_count + 1) * sizeof(capture_t));
+  capture_t* c = &captures[capture_count++];
+  memset(c, 0, sizeof(capture_t));
+  c->protocol_id = protocol_id;
+  c->bits = bits;
+  c->payload = payload;
+  return c;
+}
+
+static void add_timing(capture_t* c, code_time_t t) {
+  if (c->count == c->alloc) {
+    c->alloc = c->alloc ? c->alloc * 2 : 256;
+    c->timings = (code_time_t*)realloc(c->timings, c->alloc * sizeof(code_time_t));
+  }
+  c->timings[c->count++] = t;
+  timing_count++;
+}
+
+static bool load_corpus(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+
+  char line[1024];
+  int line_no = 0;
+  capture_t* c = NULL;
+  bool ok = true;
+
+  while (ok && fgets(line, sizeof(line), f)) {
+    line_no++;
+    char* s = line + strspn(line, " \t");
+
+    if (*s == '#' || *s == '\n' || *s == '\0') {
+      continue;
+    }
+
+    if (*s == '@') {
+      char name[PROTNAME_LEN + 1] = "";
+      unsigned bits = 0;
+      unsigned long long payload = 0;
+      int fields = sscanf(s + 1, "%12s %u %llx", name, &bits, &payload);
+
+      if (fields >= 1 && strcmp(name, "-") == 0) {
+        c = add_capture(PROTOCOL_ID_NONE, 0, 0);
+      } else if (fields == 3 && protocol_by_name(name)) {
+        c = add_capture(protocol_by_name(name)->id, bits, payload);
+      } else {
+        fprintf(stderr, "%s:%d: expected \"@ <protocol> <bits> <hex payload>\" or \"@ -\"\n", path, line_no);
+        ok = false;
+      }
+      continue;
+    }
+
+    if (c == NULL) {
+      fprintf(stderr, "%s:%d: timings before the first '@' line\n", path, line_no);
+      ok = false;
+      continue;
+    }
+
+    // Timings; "nnn:" index prefixes from signal_collector_dump_timings() are skipped
+    for (char* tok = strtok(s, " \t,\r\n"); tok; tok = strtok(NULL, " \t,\r\n")) {
+      if (tok[strlen(tok) - 1] == ':') {
+        continue;
+      }
+      char* end;
+      unsigned long t = strtoul(tok, &end, 10);
+      if (*end != '\0' || t == 0) {
+        fprintf(stderr, "%s:%d: bad timing '%s'\n", path, line_no, tok);
+        ok = false;
+        break;
+      }
+      add_timing(c, (code_time_t)t);
+    }
+  }
+
+  fclose(f);
+  return ok;
+}
+
+// ===== Generator =====
+
+/** Write captures of random frames with jittered timings (and noise captures) as a corpus */
+static int generate(char* names, int count, int repeats, double jitter, int noise) {
+  signal_parser_t parser;
+  signal_parser_init(&parser);
+
+  printf("# rfbench corpus: %d frames per protocol, %d repeats, %.0f%% jitter, seed %llu\n", count, repeats,
+         jitter * 100, (unsigned long long)rng_state);
+
+  for (char* name = strtok(names, ","); name; name = strtok(NULL, ",")) {
+    const signal_protocol_t* p = protocol_by_name(name);
+    if (p == NULL) {
+      fprintf(stderr, "unknown protocol '%s'\n", name);
+      return 1;
+    }
+    signal_parser_load(&parser, p);
+
+    // Split the alphabet: a pure start code, data codes and a pure end code
+    char start = 0, end = 0;
+    const signal_code_t* data[MAX_CODELENGTH];
+    int data_count = 0;
+    for (int cl = 0; cl < p->code_length; cl++) {
+      const signal_code_t* c = &p->codes[cl];
+      if (c->type & CODE_TYPE_DATA) {
+        data[data_count++] = c;
+      } else if (c->type == CODE_TYPE_START) {
+        start = c->name;
+      } else if (c->type == CODE_TYPE_END) {
+        end = c->name;
+      }
+    }
+
+    for (int n = 0; n < count; n++) {
+      char sequence[PROTNAME_LEN + MAX_SEQUENCE_LENGTH + 2];
+      int len = sprintf(sequence, "%s ", p->name);
+      int codes = 0;
+      uint64_t payload = 0;
+      int bits = 0;
+
+      if (start) {
+        sequence[len++] = start;
+        codes++;
+      }
+      while (codes < (int)p->min_code_len - (end ? 1 : 0)) {
+        const signal_code_t* c = data[rng_next() % data_count];
+        sequence[len++] = c->name;
+        payload = (payload << c->bits) | c->value;
+        bits += c->bits;
+        codes++;
+      }
+      if (end) {
+        sequence[len++] = end;
+      }
+      sequence[len] = NUL;
+
+      code_time_t timings[MAX_TIMING_LENGTH + 1];
+      signal_parser_compose(&parser, sequence, timings, MAX_TIMING_LENGTH / MAX_TIMELENGTH);
+
+      printf("@ %s %d %llx\n", p->name, bits < SIGNAL_MAX_PAYLOAD_BITS ? bits : SIGNAL_MAX_PAYLOAD_BITS,
+             (unsigned long long)payload);
+      int column = 0;
+      for (int r = 0; r < repeats; r++) {
+        for (code_time_t* t = timings; *t; t++) {
+          code_time_t jittered = (code_time_t)(*t * (1.0 + jitter * (2 * rng_unit() - 1)) + 0.5);
+          printf(++column % BENCH_LINE_TIMINGS ? "%u " : "%u\n", jittered ? jittered : 1);
+        }
+      }
+      if (column % BENCH_LINE_TIMINGS) {
+        printf("\n");
+      }
+    }
+  }
+
+  // Noise: log-uniform pulses from 50 µs to 5 ms
+  for (int n = 0; n < noise; n++) {
+    printf("@ -\n");
+    for (int i = 1; i <= 200; i++) {
+      printf(i % BENCH_LINE_TIMINGS ? "%u " : "%u\n", (code_time_t)(50 * pow(100, rng_unit())));
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+// ===== Replay =====
+
+/** Copies of the protocol definitions with windows recomputed for another tolerance */
+static signal_protocol_t tuned[BENCH_PROTOCOLS];
+
+static void tune_protocols(int tolerance) {
+  for (size_t n = 0; n < BENCH_PROTOCOLS; n++) {
+    tuned[n] = *bench_protocols[n];
+    if (tolerance <= 0) {
+      continue;
+    }
+    tuned[n].tolerance = tolerance;
+    for (int cl = 0; cl < tuned[n].code_length; cl++) {
+      signal_code_t* c = &tuned[n].codes[cl];
+      for (int tl = 0; tl < c->time_length; tl++) {
+        code_time_t t = (c->time[tl].min_time + c->time[tl].max_time) / 2;
+        code_time_t radius = t * tolerance / 100;
+        c->time[tl].min_time = t - radius;
+        c->time[tl].max_time = t + radius;
+      }
+    }
+  }
+}
+
+static void init_parser(signal_parser_t* parser) {
+  signal_parser_init(parser);
+  for (size_t n = 0; n < BENCH_PROTOCOLS; n++) {
+    signal_parser_load(parser, &tuned[n]);
+  }
+  signal_parser_attach_callback(parser, on_frame);
+}
+
+/** Replay every capture through the collector and score the decodes */
+static void score_run(int min_pulse, protocol_score_t* score, uint32_t* noise_hits, uint32_t* rejected) {
+  static code_time_t ring[4096];
+  signal_parser_t parser;
+  signal_collector_t collector;
+
+  init_parser(&parser);
+  signal_collector_init_buffered(&collector, &parser, 0, NO_PIN, 0, ring, sizeof(ring) / sizeof(ring[0]));
+  signal_collector_set_min_pulse(&collector, min_pulse);
+
+  for (int i = 0; i < capture_count; i++) {
+    capture_t* c = &captures[i];
+    decode_count = 0;
+
+    for (int n = 0; n < c->count; n++) {
+      hal_edge(c->timings[n]);
+    }
+    hal_edge(BENCH_GAP_US); // publishes the capture's last pulse
+    signal_collector_loop(&collector);
+
+    bool hit = false;
+    for (int d = 0; d < decode_count; d++) {
+      signal_frame_t* f = &decodes[d];
+      if (f->protocol_id == c->protocol_id && f->bits == c->bits && f->payload == c->payload) {
+        hit = true;
+        score[f->protocol_id].frames++;
+      } else if (c->protocol_id == PROTOCOL_ID_NONE) {
+        (*noise_hits)++;
+        score[f->protocol_id].false_hits++;
+      } else {
+        score[f->protocol_id].false_hits++;
+      }
+    }
+
+    if (c->protocol_id != PROTOCOL_ID_NONE) {
+      score[c->protocol_id].captures++;
+      score[c->protocol_id].detected += hit;
+    }
+  }
+  *rejected = signal_collector_get_rejected_spikes(&collector);
+}
+
+/** Print the per-protocol scores at one tolerance; returns the number of false frames */
+static uint32_t report_accuracy(int tolerance, int min_pulse) {
+  protocol_score_t score[256];
+  uint32_t noise_hits = 0, rejected = 0, noise_captures = 0;
+  memset(score, 0, sizeof(score));
+
+  tune_protocols(tolerance);
+  score_run(min_pulse, score, &noise_hits, &rejected);
+
+  for (int i = 0; i < capture_count; i++) {
+    noise_captures += captures[i].protocol_id == PROTOCOL_ID_NONE;
+  }
+
+  if (tolerance > 0) {
+    printf("\ntolerance %d%%, glitch filter %d us\n", tolerance, min_pulse);
+  } else {
+    printf("\ntolerance as defined, glitch filter %d us\n", min_pulse);
+  }
+  printf("%-8s %8s %8s %8s %7s %8s %9s\n", "protocol", "captures", "detected", "frames", "FN %", "false", "false/cap");
+  uint32_t false_hits = 0;
+  for (size_t n = 0; n < BENCH_PROTOCOLS; n++) {
+    uint8_t id = bench_protocols[n]->id;
+    protocol_score_t* s = &score[id];
+    false_hits += s->false_hits;
+    printf("%-8s %8u %8u %8u %7.1f %8u %9.3f\n", bench_protocols[n]->name, s->captures, s->detected, s->frames,
+           s->captures ? 100.0 * (s->captures - s->detected) / s->captures : 0.0, s->false_hits,
+           capture_count ? (double)s->false_hits / capture_count : 0.0);
+  }
+  printf("noise captures %u: %u false frames; %u spikes rejected by the glitch filter\n", noise_captures, noise_hits,
+         rejected);
+  return false_hits;
+}
+
+static void report_speed(int runs, int min_pulse) {
+  static code_time_t ring[4096];
+  signal_parser_t parser;
+  signal_collector_t collector;
+
+  tune_protocols(0);
+
+  // Parser only: durations straight into signal_parser_parse
+  init_parser(&parser);
+  total_decodes = 0;
+  double start = now_s();
+  for (int r = 0; r < runs; r++) {
+    for (int i = 0; i < capture_count; i++) {
+      decode_count = 0;
+      for (int n = 0; n < captures[i].count; n++) {
+        signal_parser_parse(&parser, captures[i].timings[n]);
+      }
+      signal_parser_parse(&parser, BENCH_GAP_US);
+    }
+  }
+  double parse_s = now_s() - start;
+  uint64_t parse_decodes = total_decodes;
+  signal_parser_free(&parser);
+
+  // Full path: simulated ISR, ring buffer, decode loop
+  init_parser(&parser);
+  signal_collector_init_buffered(&collector, &parser, 0, NO_PIN, 0, ring, sizeof(ring) / sizeof(ring[0]));
+  signal_collector_set_min_pulse(&collector, min_pulse);
+  signal_collector_set_notify(&collector, (TaskHandle_t)&collector, 1);
+  hal_notifications = 0;
+  start = now_s();
+  for (int r = 0; r < runs; r++) {
+    for (int i = 0; i < capture_count; i++) {
+      decode_count = 0;
+      for (int n = 0; n < captures[i].count; n++) {
+        hal_edge(captures[i].timings[n]);
+        if (signal_collector_get_buffer_count(&collector) >= sizeof(ring) / sizeof(ring[0]) / 2) {
+          signal_collector_loop(&collector);
+        }
+      }
+      hal_edge(BENCH_GAP_US);
+      signal_collector_loop(&collector);
+    }
+  }
+  double full_s = now_s() - start;
+  signal_parser_free(&parser);
+
+  uint64_t edges = (timing_count + capture_count) * runs;
+  printf("\n%llu edges x %d runs, %d protocols loaded\n", (unsigned long long)(timing_count + capture_count), runs,
+         (int)BENCH_PROTOCOLS);
+  printf("parser only:        %7.1f ns/edge, %6.2f Medges/s, %9.0f decodes/s\n", parse_s * 1e9 / edges,
+         edges / parse_s / 1e6, parse_decodes / parse_s);
+  printf("collector + parser: %7.1f ns/edge, %6.2f Medges/s, %.3f decoder wake-ups per capture\n", full_s * 1e9 / edges,
+         edges / full_s / 1e6, (double)hal_notifications / runs / capture_count);
+}
+
+// ===== Learning =====
+
+/** Run the learner over each capture and replay the capture through the protocol it infers */
+static void report_learning(void) {
+  static uint16_t buffer[1024];
+  static signal_protocol_t protocol;
+  uint32_t tried[256] = {0}, learned[256] = {0}, decoded[256] = {0}, exact[256] = {0};
+
+  for (int i = 0; i < capture_count; i++) {
+    capture_t* c = &captures[i];
+    signal_learner_t learner;
+    signal_learned_t result;
+    bool ok = false;
+
+    signal_learner_init(&learner, buffer, sizeof(buffer) / sizeof(buffer[0]));
+    for (int n = 0; n < c->count && !ok; n++) {
+      ok = signal_learner_add(&learner, c->timings[n]) && signal_learner_infer(&learner, &result);
+    }
+    tried[c->protocol_id]++;
+    if (!ok || !signal_learner_build(&result, &protocol)) {
+      continue;
+    }
+    learned[c->protocol_id]++;
+
+    signal_parser_t parser;
+    signal_parser_init(&parser);
+    signal_parser_load(&parser, &protocol);
+    signal_parser_attach_callback(&parser, on_frame);
+    decode_count = 0;
+    for (int n = 0; n < c->count; n++) {
+      signal_parser_parse(&parser, c->timings[n]);
+    }
+    signal_parser_parse(&parser, BENCH_GAP_US);
+    signal_parser_free(&parser);
+
+    decoded[c->protocol_id] += decode_count > 0;
+    for (int d = 0; d < decode_count; d++) {
+      if (decodes[d].bits == c->bits && decodes[d].payload == c->payload) {
+        exact[c->protocol_id]++;
+        break;
+      }
+    }
+    if (hal_verbose) {
+      printf("capture %d: base %u us, %u%%, %u codes of %u bits, %d frames decoded\n", i, result.base_time,
+             result.tolerance, result.data_codes, result.bits, decode_count);
+    }
+  }
+
+  printf("\nlearning (%d identical frames needed)\n", SIGNAL_LEARN_REPEATS);
+  printf("%-8s %8s %8s %8s %8s\n", "protocol", "captures", "learned", "decoding", "same");
+  for (size_t n = 0; n < BENCH_PROTOCOLS; n++) {
+    uint8_t id = bench_protocols[n]->id;
+    printf("%-8s %8u %8u %8u %8u\n", bench_protocols[n]->name, tried[id], learned[id], decoded[id], exact[id]);
+  }
+  printf("%-8s %8u %8u %8u\n", "noise", tried[PROTOCOL_ID_NONE], learned[PROTOCOL_ID_NONE],
+         decoded[PROTOCOL_ID_NONE]);
+}
+
+static int usage(void) {
+  fprintf(stderr, "usage: rfbench [-t tol[,tol...]] [-m min_pulse_us] [-r runs] [-F max_false] [-v] corpus...\n"
+                  "       rfbench -l [-v] corpus...\n"
+                  "       rfbench -g proto[,proto...] [-n count] [-R repeats] [-j jitter_pct] [-N noise] [-s seed]\n");
+  return 2;
+}
+
+int main(int argc, char** argv) {
+  char* generate_names = NULL;
+  char* tolerances = NULL;
+  int min_pulse = SC_MIN_PULSE_US;
+  int runs = 200;
+  int count = 50, repeats = 3, noise = 20;
+  double jitter = 0.1;
+  bool learn = false;
+  long max_false = -1; // fail if any tolerance decodes more false frames than this
+  int status = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:m:r:F:vlg:n:R:j:N:s:")) != -1) {
+    switch (opt) {
+      case 't': tolerances = optarg; break;
+      case 'm': min_pulse = atoi(optarg); break;
+      case 'r': runs = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+      case 'F': max_false = atol(optarg); break;
+      case 'v': hal_verbose++; break;
+      case 'l': learn = true; break;
+      case 'g': generate_names = optarg; break;
+      case 'n': count = atoi(optarg); break;
+      case 'R': repeats = atoi(optarg); break;
+      case 'j': jitter = atof(optarg) / 100; break;
+      case 'N': noise = atoi(optarg); break;
+      case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+      default: return usage();
+    }
+  }
+
+  if (generate_names) {
+    return generate(generate_names, count, repeats, jitter, noise);
+  }
+  if (optind >= argc) {
+    return usage();
+  }
+
+  for (int i = optind; i < argc; i++) {
+    if (!load_corpus(argv[i])) {
+      return 1;
+    }
+  }
+  printf("%d captures, %llu timings\n", capture_count, (unsigned long long)timing_count);
+
+  if (learn) {
+    report_learning();
+    return 0;
+  }
+
+  if (tolerances == NULL) {
+    uint32_t false_hits = report_accuracy(0, min_pulse);
+    if (max_false >= 0 && false_hits > max_false) {
+      fprintf(stderr, "rfbench: %u false frames, at most %ld allowed\n", false_hits, max_false);
+      status = 1;
+    }
+  } else {
+    for (char* tol = strtok(tolerances, ","); tol; tol = strtok(NULL, ",")) {
+      uint32_t false_hits = report_accuracy(atoi(tol), min_pulse);
+      if (max_false >= 0 && false_hits > max_false) {
+        fprintf(stderr, "rfbench: %u false frames at %s%% tolerance, at most %ld allowed\n", false_hits, tol, max_false);
+        status = 1;
+      }
+    }
+  }
+  report_speed(runs, min_pulse);
+  return status;
+}